@@ -0,0 +1,427 @@
+// Offline benchmark of the detection path: replays frame sources (video
+// files, image directories, synthetic scenes) through the same detectors
+// main() uses, as fast as frames can be decoded, and reports throughput,
+// latency percentiles, per-stage time and heap allocations. Only the
+// detector calls are timed; decoding is not. With -j, sources are spread
+// over that many threads, one source per thread at a time.
+//
+// Output lines are "key value" pairs so runs on different commits or
+// machines can be diffed directly.
+//
+// bench -t runs the self-checks instead: the fast paths against simple
+// reference implementations, no source needed.
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <malloc.h>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "detector.h"
+#include "frame_source.h"
+#include "hs_hist.h"
+#include "smoother.h"
+
+// heap allocations made by the current thread, counted so the hot path can
+// be checked for steady-state allocations. The count is taken at the C
+// allocator: OpenCV gets Mat data from fastMalloc(), which calls malloc() or
+// posix_memalign() directly and never goes through operator new (whose
+// default calls malloc(), so it is counted too). The hooks forward to the
+// glibc entry points.
+static thread_local unsigned long heap_allocations = 0;
+
+extern "C"
+{
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* p, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+
+void* malloc(size_t size) noexcept
+{
+    heap_allocations++;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) noexcept
+{
+    heap_allocations++;
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t size) noexcept
+{
+    heap_allocations++;
+    return __libc_realloc(p, size);
+}
+
+void* memalign(size_t alignment, size_t size) noexcept
+{
+    heap_allocations++;
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept
+{
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void** p, size_t alignment, size_t size) noexcept
+{
+    if (alignment % sizeof(void*) || (alignment & (alignment - 1)))
+    {
+        return EINVAL;
+    }
+    *p = memalign(alignment, size);
+    return *p ? 0 : ENOMEM;
+}
+}
+
+static void usage()
+{
+    fprintf(stderr, "bench [options] source...\n"
+                    "bench -t\n"
+                    "sources: a video file, an image directory or synthetic[:WxH[:frames]]\n"
+                    "options:\n"
+                    "  -m method     histogram method: fused (default), lut or opencv\n"
+                    "  -s step       analysis step (default 1)\n"
+                    "  -g COLSxROWS  tile grid detector instead of the global histogram\n"
+                    "  -r rate       background adaptation per frame (default 0)\n"
+                    "  -n frames     stop each source after this many frames (default all)\n"
+                    "  -j threads    replay this many sources in parallel (default 1)\n"
+                    "  -t            run the self-checks and exit\n");
+}
+
+static double percentile(std::vector<double>& v, double p)
+{
+    if (v.empty())
+    {
+        return 0;
+    }
+
+    size_t k = (size_t)(p * (v.size() - 1) + 0.5);
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+}
+
+// the running median against sorting the window, for every window up to
+// 16, on random scores with many repeats (as quantised scores have)
+static bool checkMedian()
+{
+    srand(1);
+
+    for (size_t window = 1; window <= 16; window++)
+    {
+        MedianSmoother median(window);
+        std::deque<double> last;
+
+        for (int i = 0; i < 20000; i++)
+        {
+            double v = (rand() % 11) / 10.0;
+            if (i < 4)
+            {
+                // the sequence that once broke the window of 2
+                static const double start[] = { 0.9, 0.9, 0.5, 0.7 };
+                v = start[i];
+            }
+
+            last.push_back(v);
+            if (last.size() > window)
+            {
+                last.pop_front();
+            }
+            std::vector<double> sorted(last.begin(), last.end());
+            std::sort(sorted.begin(), sorted.end());
+            size_t n = sorted.size();
+            double expected = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+
+            double got = median.update(v);
+            if (got != expected)
+            {
+                printf("check median FAILED window %zu value %d: %.3f, expected %.3f\n", window, i, got, expected);
+                return false;
+            }
+        }
+    }
+
+    printf("check median ok\n");
+    return true;
+}
+
+// the fused kernel against cvtColor()/calcHist(), which it must match bin
+// for bin, on the synthetic scene quiet and with its event block, and on
+// random noise (every colour region, bin edges included). HIST_LUT is only
+// measured against it: its score error is what keeps it out of camera_pi.
+static bool checkHistograms()
+{
+    SyntheticSource synthetic(cv::Size(640, 480));
+    std::vector<cv::Mat> scene(SYNTHETIC_PERIOD);
+    for (size_t i = 0; i < scene.size(); i++)
+    {
+        synthetic.read(scene[i]);
+    }
+
+    cv::Mat noise[2];
+    for (int i = 0; i < 2; i++)
+    {
+        noise[i].create(480, 640, CV_8UC3);
+        cv::randu(noise[i], cv::Scalar(0, 0, 0), cv::Scalar(256, 256, 256));
+    }
+
+    struct
+    {
+        const char* name;
+        const cv::Mat& ref;
+        const cv::Mat& img;
+    } pairs[] = {
+        { "scene", scene[0], scene[1] },
+        { "event", scene[0], scene[SYNTHETIC_PERIOD - SYNTHETIC_EVENT_FRAMES / 2] },
+        { "noise", noise[0], noise[1] },
+    };
+
+    bool ok = true;
+    for (size_t i = 0; i < sizeof pairs / sizeof pairs[0]; i++)
+    {
+        double delta;
+        int mismatched = checkFusedHist(pairs[i].ref, pairs[i].img, &delta);
+        bool good = !mismatched && delta <= 1e-6;
+        printf("check fused histogram (%s) %s: %s, %d mismatched bins, score delta %g\n", hsHistKernelName(),
+               pairs[i].name, good ? "ok" : "FAILED", mismatched, delta);
+        ok = ok && good;
+
+        double lutMismatch = checkLutHist(pairs[i].ref, pairs[i].img, &delta);
+        printf("lut histogram %s: %.1f%% pixels in a neighbouring bin, score delta %g\n", pairs[i].name,
+               lutMismatch * 100, delta);
+    }
+
+    return ok;
+}
+
+static int selfCheck()
+{
+    bool ok = checkMedian();
+    ok = checkHistograms() && ok;
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char** argv)
+{
+    HistMethod method = HIST_FUSED;
+    const char* method_name = "fused";
+    int step = 1;
+    int grid_cols = 0, grid_rows = 0;
+    double rate = 0;
+    unsigned long max_frames = 0;
+    int jobs = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:s:g:r:n:j:t")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                return selfCheck();
+            case 'j':
+                jobs = atoi(optarg);
+                break;
+            case 'm':
+                method_name = optarg;
+                if (!strcmp(optarg, "opencv"))
+                {
+                    method = HIST_OPENCV;
+                }
+                else if (!strcmp(optarg, "lut"))
+                {
+                    method = HIST_LUT;
+                }
+                else
+                {
+                    method = HIST_FUSED;
+                    method_name = "fused";
+                }
+                break;
+            case 's':
+                step = atoi(optarg);
+                break;
+            case 'g':
+                if (sscanf(optarg, "%dx%d", &grid_cols, &grid_rows) != 2 || grid_cols < 1 || grid_rows < 1)
+                {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 'n':
+                max_frames = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (optind == argc || step < 1 || jobs < 1)
+    {
+        usage();
+        return 1;
+    }
+
+    bool use_grid = grid_cols > 0;
+    std::vector<std::string> sources(argv + optind, argv + argc);
+    std::atomic<size_t> next_source(0);
+    std::mutex result_mutex;
+    std::vector<double> latencies;
+    unsigned long frames = 0;
+    unsigned long allocations = 0;
+    unsigned long reallocations = 0;
+    double busy_ms = 0;
+    DetectorTimings t;
+    cv::Size size;
+    bool failed = false;
+
+    // one detector per thread; every source starts from its own first
+    // frame, as main() does
+    auto worker = [&]()
+    {
+        HistDetector detector(method);
+        detector.setScale(step);
+        detector.enableTimings(true);
+        TileDetector grid(grid_cols ? grid_cols : 1, grid_rows ? grid_rows : 1);
+        grid.setScale(step);
+        grid.enableTimings(true);
+
+        std::vector<double> my_latencies;
+        unsigned long my_allocations = 0;
+        cv::Mat frame;
+        size_t i;
+
+        while ((i = next_source++) < sources.size())
+        {
+            FrameSource* source = FrameSource::open(sources[i]);
+            if (!source || source->live())
+            {
+                fprintf(stderr, "Cannot replay %s\n", sources[i].c_str());
+                delete source;
+                std::lock_guard<std::mutex> lock(result_mutex);
+                failed = true;
+                continue;
+            }
+
+            unsigned long n = 0;
+            if (source->read(frame))
+            {
+                detector.setReference(frame);
+                grid.setReference(frame);
+
+                std::lock_guard<std::mutex> lock(result_mutex);
+                size = frame.size();
+            }
+
+            while ((!max_frames || n < max_frames) && source->read(frame))
+            {
+                unsigned long allocs = heap_allocations;
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+                if (use_grid)
+                {
+                    grid.compare(frame);
+                    if (rate > 0)
+                    {
+                        grid.adaptReference(rate);
+                    }
+                }
+                else
+                {
+                    detector.compare(frame);
+                    if (rate > 0)
+                    {
+                        detector.adaptReference(rate);
+                    }
+                }
+
+                double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                my_allocations += heap_allocations - allocs;
+                my_latencies.push_back(ms);
+                n++;
+            }
+
+            delete source;
+        }
+
+        const DetectorTimings& mine = use_grid ? grid.timings() : detector.timings();
+
+        std::lock_guard<std::mutex> lock(result_mutex);
+        latencies.insert(latencies.end(), my_latencies.begin(), my_latencies.end());
+        frames += my_latencies.size();
+        allocations += my_allocations;
+        reallocations += use_grid ? 0 : detector.reallocations();
+        t.convertMs += mine.convertMs;
+        t.histMs += mine.histMs;
+        t.normalizeMs += mine.normalizeMs;
+        t.compareMs += mine.compareMs;
+    };
+
+    std::chrono::steady_clock::time_point wall_start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < jobs; i++)
+    {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+
+    double wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - wall_start).count();
+
+    if (failed || !frames)
+    {
+        fprintf(stderr, "Need at least two frames per source\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < latencies.size(); i++)
+    {
+        busy_ms += latencies[i];
+    }
+
+    printf("kernel %s\n", hsHistKernelName());
+    printf("method %s\n", use_grid ? "grid" : method_name);
+    if (use_grid)
+    {
+        printf("grid %dx%d\n", grid_cols, grid_rows);
+    }
+    printf("step %d\n", step);
+    printf("size %dx%d\n", size.width, size.height);
+    printf("threads %d\n", jobs);
+    printf("frames %lu\n", frames);
+    // per thread, detector time only; and over all threads, including decoding
+    printf("fps %.1f\n", frames * 1000 * jobs / busy_ms);
+    printf("wall_fps %.1f\n", frames * 1000 / wall_ms);
+    printf("mean_ms %.3f\n", busy_ms / frames);
+    printf("p50_ms %.3f\n", percentile(latencies, 0.50));
+    printf("p99_ms %.3f\n", percentile(latencies, 0.99));
+    printf("convert_ms %.3f\n", t.convertMs / frames);
+    printf("histogram_ms %.3f\n", t.histMs / frames);
+    printf("normalize_ms %.3f\n", t.normalizeMs / frames);
+    printf("compare_ms %.3f\n", t.compareMs / frames);
+    printf("allocations_per_frame %.2f\n", (double)allocations / frames);
+    printf("scratch_reallocations %lu\n", reallocations);
+
+    return 0;
+}
@@ -0,0 +1,135 @@
+#ifndef BIN_LUT_H
+#define BIN_LUT_H
+
+#include <opencv2/opencv.hpp>
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+#include "hs_hist.h"
+
+// Maps a BGR pixel straight to its H/S histogram bin with one table lookup.
+// Each channel is quantised to Bits bits and the resulting cube (2^(3*Bits)
+// cells) holds the bin of the cell's centre colour, computed with the exact
+// HSV conversion when the table is built. The bin layout (HBins x SBins over
+// [0, HMax) x [0, SMax)) is part of the type, so the key arithmetic and the
+// histogram loop are specialised per layout.
+//
+// Pixels near a bin edge may land in a neighbouring bin; measureAccuracy()
+// quantifies that against the exact kernel.
+template<int HBins, int SBins, int HMax, int SMax, int Bits>
+class BgrBinLut
+{
+public:
+    enum
+    {
+        BINS = HBins * SBins,
+        DISCARD = BINS,             // index of out-of-range pixels
+        SHIFT = 8 - Bits,
+        CELLS = 1 << (3 * Bits)
+    };
+
+    BgrBinLut() : m_table(CELLS)
+    {
+        const int half = (1 << SHIFT) >> 1;
+
+        for (int key = 0; key < CELLS; key++)
+        {
+            int b = ((key >> (2 * Bits)) << SHIFT) + half;
+            int g = (((key >> Bits) & ((1 << Bits) - 1)) << SHIFT) + half;
+            int r = ((key & ((1 << Bits) - 1)) << SHIFT) + half;
+
+            m_table[key] = exactBin(b, g, r);
+        }
+    }
+
+    static unsigned short exactBin(int b, int g, int r)
+    {
+        int h, s;
+        bgrToHs(b, g, r, &h, &s);
+
+        int hb = (int)floor(h * ((double)HBins / HMax));
+        int sb = (int)floor(s * ((double)SBins / SMax));
+
+        if ((unsigned)hb >= (unsigned)HBins || (unsigned)sb >= (unsigned)SBins)
+        {
+            return DISCARD;
+        }
+        return (unsigned short)(hb * SBins + sb);
+    }
+
+    unsigned short lookup(int b, int g, int r) const
+    {
+        return m_table[((b >> SHIFT) << (2 * Bits)) | ((g >> SHIFT) << Bits) | (r >> SHIFT)];
+    }
+
+    // histogram of every step-th pixel of every step-th row of a CV_8UC3
+    // frame; counts must hold BINS + 1 entries, the last one collects
+    // out-of-range pixels
+    void accumulate(const cv::Mat& bgr, unsigned* counts, int step = 1) const
+    {
+        CV_Assert(bgr.type() == CV_8UC3 && step > 0);
+
+        memset(counts, 0, (BINS + 1) * sizeof *counts);
+
+        const int cols = (bgr.cols + step - 1) / step;
+        for (int y = 0; y < bgr.rows; y += step)
+        {
+            const uchar* src = bgr.ptr<uchar>(y);
+            const uchar* end = src + 3 * step * cols;
+
+            for (; src != end; src += 3 * step)
+            {
+                counts[lookup(src[0], src[1], src[2])]++;
+            }
+        }
+    }
+
+    // fraction of all 2^24 BGR colours that the table puts in a different
+    // bin than the exact conversion
+    double cubeMismatch() const
+    {
+        unsigned long bad = 0;
+
+        for (int b = 0; b < 256; b++)
+        {
+            for (int g = 0; g < 256; g++)
+            {
+                for (int r = 0; r < 256; r++)
+                {
+                    bad += lookup(b, g, r) != exactBin(b, g, r);
+                }
+            }
+        }
+
+        return bad / (double)(1 << 24);
+    }
+
+    // fraction of the pixels of bgr binned differently than the exact
+    // conversion
+    double measureAccuracy(const cv::Mat& bgr) const
+    {
+        unsigned long bad = 0;
+
+        for (int y = 0; y < bgr.rows; y++)
+        {
+            const uchar* src = bgr.ptr<uchar>(y);
+
+            for (int x = 0; x < bgr.cols; x++, src += 3)
+            {
+                bad += lookup(src[0], src[1], src[2]) != exactBin(src[0], src[1], src[2]);
+            }
+        }
+
+        return bgr.total() ? bad / (double)bgr.total() : 0;
+    }
+
+private:
+    std::vector<unsigned short> m_table;
+};
+
+// the detector's layout at 5 bits per channel: 32768 entries (64 KB), small
+// enough to stay cache resident on the Pi
+typedef BgrBinLut<H_BINS, S_BINS, H_RANGE_MAX, S_RANGE_MAX, 5> HsBinLut;
+
+#endif
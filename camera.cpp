@@ -9,13 +9,47 @@
 #include <vector>
 #include <time.h>
 #include <string>
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 
 #include "sendmail.h"
 #include "megacli.h"
+#include "detector.h"
+#include "pipeline.h"
+#include "dispatcher.h"
+#include "reactor.h"
+#include "smoother.h"
+#include "scheduler.h"
+#include "frame_source.h"
+#include "pre_event.h"
+#include "clip_writer.h"
+#include "upload_spool.h"
+#include "smtp.h"
+#include "notifier.h"
 
 #define N_Capture 1 // 1 second
-#define AVG_COUNT 3
+#define AVG_COUNT 3 // default smoothing window, in frames
+#define IDLE_INTERVAL 2000 // ms between captures while the scene is quiet
+#define ARMED_INTERVAL 250 // ms between captures while something may be happening
+#define BACKGROUND_RATE 0.02 // weight of each quiet frame in the reference
 #define THRESHOLD 0.7
+#define STATS_INTERVAL 60 // seconds between pipeline statistics
+#define EVENT_QUEUE_DEPTH 32
+#define SHUTDOWN_UPLOAD_TIMEOUT 30 // seconds to finish uploads when stopping
+#define PRE_EVENT_BUDGET (4 << 20) // bytes of JPEG frames kept per camera before an event
+#define PRE_EVENT_SECONDS 5 // how far back the pre-event frames go
+#define CLIP_POST_ROLL 5 // seconds an event clip runs on after the last triggering frame
+#define CLIP_MAX_SECONDS 300 // longer incidents are split into several clips
+#define ANALYSIS_WORKERS 2 // analysis threads shared by all cameras (at most one per camera)
+#define UPLOAD_SPOOL_DIR ".upload_spool" // uploads not yet finished, kept across restarts
+#define SHUTDOWN_MAIL_TIMEOUT 30 // seconds to deliver the last notifications when stopping
+#define THUMBNAIL_WIDTH 160 // pixels, of the event pictures attached to notification mails
 
 std::string getDateString()
 {
@@ -40,111 +74,1047 @@ std::string getDateString()
     return str;
 }
 
-double compareImgDiff(const cv::Mat &Ref, const cv::Mat &Test)
+// One capture source and everything that judges its frames. The analysis
+// state is only touched by the analysis pool, one worker at a time.
+struct Camera
 {
-    cv::Mat m_ref = Ref.clone();
-    cv::Mat m_test = Test.clone();
-    cv::cvtColor(m_ref, m_ref, CV_BGR2HSV);
-    cv::cvtColor(m_test, m_test, CV_BGR2HSV);
-    
-    
-    int h_bins = 50; int s_bins = 60;
-    int histSize[] = {h_bins, s_bins};
-    float h_range[] = {0, 255};
-    float s_range[] = {0, 180};
-    const float*  ranges[] = {h_range, s_range};
-    int channels[] = {0, 1};
-    cv::MatND hist_ref, hist_test;
-    
-    cv::calcHist(&m_ref, 1, channels, cv::Mat(), hist_ref,  2, histSize, ranges, true, false);
-    cv::normalize(hist_ref, hist_ref, 0, 1, cv::NORM_MINMAX, -1, cv::Mat());
-    
-    cv::calcHist(&m_test, 1, channels, cv::Mat(), hist_test, 2, histSize, ranges, true, false);
-    cv::normalize(hist_test, hist_test, 0, 1, cv::NORM_MINMAX, -1, cv::Mat());
-    
-    double re = cv::compareHist(hist_ref, hist_test, CV_COMP_CORREL);
-    return re;
+    std::string name;
+    std::string input;
+    double threshold;
+    FrameSource* source;
+    Pipeline* pipeline;
+
+    HistDetector detector;
+    TileDetector* grid;
+    MogDetector* mog;
+    Smoother* smoother;
+    AdaptiveScheduler* scheduler;
+    PreEventBuffer* preEvent;
+
+    // no background learning while an event is on or the scheduler is armed
+    bool sceneQuiet;
+
+    // frames up to this capture time are passed on for the event clip
+    time_t incidentUntil;
+
+    // event clip, act side only
+    ClipWriter clip;
+    unsigned long clipTimer;
+
+    // encoding of the frames passed on, analysis side
+    cv::Mat eventSmall;
+    time_t lastThumbnail;
+
+    // for the statistics
+    std::atomic<double> lastScore;
+    unsigned long events;
+    unsigned long clips;
+
+    Camera(HistMethod method)
+        : detector(method)
+    {
+        threshold = THRESHOLD;
+        source = NULL;
+        pipeline = NULL;
+        grid = NULL;
+        mog = NULL;
+        smoother = NULL;
+        scheduler = NULL;
+        preEvent = NULL;
+        sceneQuiet = true;
+        incidentUntil = 0;
+        clipTimer = 0;
+        lastThumbnail = 0;
+        lastScore.store(1);
+        events = 0;
+        clips = 0;
+    }
+
+    ~Camera()
+    {
+        delete pipeline;
+        delete scheduler;
+        delete preEvent;
+        delete grid;
+        delete mog;
+        delete smoother;
+        delete source;
+    }
+};
+
+static void usage()
+{
+    std::cout << "Unexpected input parameters. The correct command should like this:\n"
+                 "camera_pi [options] myemail@some.com[,other@some.com...] mega_acount@some.com mega_password\n"
+                 "options:\n"
+                 "  -s step     analyse every step-th pixel/row only (default 1); events still save full frames\n"
+                 "  -m method   histogram method: fused (default) or opencv\n"
+                 "  -p policy   drop policy of the analysis queue: block, newest or oldest (default)\n"
+                 "  -P policy   drop policy of the event queue: block, newest (default) or oldest\n"
+                 "  -w count    event action worker threads (default 3)\n"
+                 "  -b policy   event action backpressure: oldest, coalesce (default) or spill\n"
+                 "  -a frames   score smoothing window (default 3)\n"
+                 "  -f filter   score smoothing: mean (default), ewma or median\n"
+                 "  -I ms       capture interval while idle (default 2000), 0 for a fixed 1 s without idle mode\n"
+                 "  -A ms       capture interval while armed (default 250)\n"
+                 "  -g COLSxROWS  score a grid of tiles (e.g. 8x6) instead of the whole frame\n"
+                 "  -r rate     background adaptation per quiet frame (default 0.02), 0 keeps the first frame\n"
+                 "  -M          per-pixel MOG2 background model instead of histograms (at the -s step)\n"
+                 "  -i source[@threshold]\n"
+                 "              camera[:N] (default), synthetic[:WxH[:frames]], an image directory or a video\n"
+                 "              file; recordings run as fast as they decode and stop at their end. Repeat for\n"
+                 "              several cameras, each with its own threshold (default 0.7)\n"
+                 "  -j threads  analysis threads shared by the cameras (default 2)\n"
+                 "  -B bytes    memory per camera for the frames before an event (default 4M), 0 for none;\n"
+                 "              K and M suffixes accepted\n"
+                 "  -S seconds  how far back the frames before an event go (default 5)\n"
+                 "  -D factor   shrink the frames kept before an event (and event clips) by this factor (default 1)\n"
+                 "  -c seconds  record each incident as one MJPEG AVI clip, running on this long after the\n"
+                 "              last triggering frame (default 5); 0 saves every event frame as a JPEG\n"
+                 "  -k          keep a local copy of every upload; otherwise event files go from memory\n"
+                 "              to MEGA without touching the SD card\n"
+                 "  -U dir      directory recording the uploads not yet finished, resumed after a restart\n"
+                 "              (default .upload_spool); \"none\" keeps them in memory only\n"
+                 "  -u count    files uploading at once (default 4)\n"
+                 "  -L rate     average upload rate limit in bytes/s, K and M suffixes accepted (default none)\n"
+                 "  -H host[:port]\n"
+                 "              SMTP server for the notifications (default localhost:25); \"sendmail\" runs\n"
+                 "              /usr/sbin/sendmail for each one instead\n"
+                 "  -d minutes  after the first mail of an incident, mail a digest of the events this often\n"
+                 "              while they last (default 10)\n"
+                 "  -R count    mails per hour and recipient, alerts and digests together (default 6),\n"
+                 "              0 for no limit\n" << std::endl;
 }
 
-double average(const double* vector, unsigned long size) {
-    double sum = 0.0;
-    for(int i = 0; i < size; i++)
+// "4194304", "512K" or "4M"
+static bool parseBytes(const char* arg, size_t* bytes)
+{
+    char* end;
+    double n = strtod(arg, &end);
+
+    if (*end == 'K' || *end == 'k')
     {
-        sum += vector[i];
+        n *= 1 << 10;
+        end++;
     }
-    
-    return sum/size;
+    else if (*end == 'M' || *end == 'm')
+    {
+        n *= 1 << 20;
+        end++;
+    }
+
+    *bytes = (size_t)n;
+    return end != arg && !*end && n >= 0;
+}
+
+// "host", "host:port" or "[v6 address]:port"
+static bool parseServer(const char* arg, std::string* host, unsigned short* port)
+{
+    std::string spec(arg);
+    size_t colon = spec.rfind(':');
+    bool bracketed = !spec.empty() && spec[0] == '[';
+
+    // a bare v6 address has several colons and no port
+    if (colon != std::string::npos && (bracketed ? spec[colon - 1] == ']' : spec.find(':') == colon))
+    {
+        char* end;
+        long n = strtol(spec.c_str() + colon + 1, &end, 10);
+        if (*end || n < 1 || n > 65535)
+        {
+            return false;
+        }
+        *port = n;
+        spec.erase(colon);
+    }
+    if (bracketed)
+    {
+        if (spec.size() < 3 || spec[spec.size() - 1] != ']')
+        {
+            return false;
+        }
+        spec = spec.substr(1, spec.size() - 2);
+    }
+
+    *host = spec;
+    return !spec.empty();
+}
+
+// "source[@threshold]"
+static bool parseInput(const char* arg, Camera* cam)
+{
+    std::string spec(arg);
+    size_t at = spec.rfind('@');
+
+    if (at != std::string::npos)
+    {
+        char* end;
+        cam->threshold = strtod(spec.c_str() + at + 1, &end);
+        if (*end || cam->threshold <= 0 || cam->threshold >= 1)
+        {
+            return false;
+        }
+        spec.erase(at);
+    }
+
+    cam->input = spec;
+    return !spec.empty();
 }
 
 int main(int argc, char** argv)
 {
-    if (argc != 3)
+    int analysis_step = 1;
+    HistMethod method = HIST_FUSED;
+    PipelineConfig pipeline_config;
+    pipeline_config.captureIntervalMs = N_Capture * 1000;
+    unsigned dispatcher_workers = 3;
+    BackpressurePolicy backpressure = BACKPRESSURE_COALESCE;
+    int smoothing_window = AVG_COUNT;
+    SmoothingMethod smoothing = SMOOTH_MEAN;
+    unsigned idle_interval = IDLE_INTERVAL;
+    unsigned armed_interval = ARMED_INTERVAL;
+    int grid_cols = 0;
+    int grid_rows = 0;
+    double background_rate = BACKGROUND_RATE;
+    bool use_mog = false;
+    std::vector<const char*> inputs;
+    unsigned analysis_workers = ANALYSIS_WORKERS;
+    size_t pre_event_budget = PRE_EVENT_BUDGET;
+    unsigned pre_event_seconds = PRE_EVENT_SECONDS;
+    int pre_event_downscale = 1;
+    unsigned clip_post_roll = CLIP_POST_ROLL;
+    bool keep_local = false;
+    const char* spool_dir = UPLOAD_SPOOL_DIR;
+    unsigned upload_slots = UPLOAD_SLOTS;
+    size_t upload_rate = 0;
+    std::string smtp_host = "localhost";
+    unsigned short smtp_port = SMTP_PORT;
+    bool use_sendmail = false;
+    unsigned digest_seconds = NOTIFY_DIGEST_SECONDS;
+    double mails_per_hour = NOTIFY_MAILS_PER_HOUR;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:m:p:P:w:b:a:f:I:A:g:r:Mi:j:B:S:D:c:kU:u:L:H:d:R:")) != -1)
     {
-        std::cout << "Unexpected input parameters. The correct command should like this:\ncamera_pi myemail@some.com mega_acount@some.com mega_password\n"<<std::endl;
+        switch (opt)
+        {
+            case 'd':
+                digest_seconds = atoi(optarg) * 60;
+                break;
+            case 'R':
+                mails_per_hour = atof(optarg);
+                break;
+            case 'H':
+                use_sendmail = !strcmp(optarg, "sendmail");
+                if (!use_sendmail && !parseServer(optarg, &smtp_host, &smtp_port))
+                {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'u':
+                upload_slots = atoi(optarg);
+                break;
+            case 'L':
+                if (!parseBytes(optarg, &upload_rate))
+                {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'U':
+                spool_dir = strcmp(optarg, "none") ? optarg : NULL;
+                break;
+            case 'k':
+                keep_local = true;
+                break;
+            case 'c':
+                clip_post_roll = atoi(optarg);
+                break;
+            case 'B':
+                if (!parseBytes(optarg, &pre_event_budget))
+                {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'S':
+                pre_event_seconds = atoi(optarg);
+                break;
+            case 'D':
+                pre_event_downscale = atoi(optarg);
+                break;
+            case 'j':
+                analysis_workers = atoi(optarg);
+                break;
+            case 'i':
+                inputs.push_back(optarg);
+                break;
+            case 'r':
+                background_rate = atof(optarg);
+                break;
+            case 'M':
+                use_mog = true;
+                break;
+            case 'g':
+                if (sscanf(optarg, "%dx%d", &grid_cols, &grid_rows) != 2 || grid_cols < 1 || grid_rows < 1)
+                {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'I':
+                idle_interval = atoi(optarg);
+                break;
+            case 'A':
+                armed_interval = atoi(optarg);
+                break;
+            case 'a':
+                smoothing_window = atoi(optarg);
+                break;
+            case 'f':
+                if (!parseSmoothingMethod(optarg, &smoothing))
+                {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'w':
+                dispatcher_workers = atoi(optarg);
+                break;
+            case 'b':
+                if (!parseBackpressurePolicy(optarg, &backpressure))
+                {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'p':
+                if (!parseDropPolicy(optarg, &pipeline_config.analysisPolicy))
+                {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'P':
+                if (!parseDropPolicy(optarg, &pipeline_config.eventPolicy))
+                {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 's':
+                analysis_step = atoi(optarg);
+                break;
+            case 'm':
+                if (!strcmp(optarg, "opencv"))
+                {
+                    method = HIST_OPENCV;
+                }
+                else if (!strcmp(optarg, "fused"))
+                {
+                    method = HIST_FUSED;
+                }
+                else
+                {
+                    usage();
+                    return 1;
+                }
+                break;
+            default:
+                usage();
+                return 1;
+        }
     }
 
-    char* email = argv[1];
-    char* mega_acount = argv[2];
-    char* mega_password = argv[3];
+    if (argc - optind != 3 || analysis_step < 1 || smoothing_window < 1 || background_rate < 0 || background_rate > 1 ||
+        analysis_workers < 1 || pre_event_downscale < 1 || upload_slots < 1 || digest_seconds < 60 || mails_per_hour < 0)
+    {
+        usage();
+        return 1;
+    }
 
-    CvCapture* pCapture = cvCreateCameraCapture(-1);
-    if (!pCapture)
+    char* email = argv[optind];
+    char* mega_acount = argv[optind + 1];
+    char* mega_password = argv[optind + 2];
+
+    if (inputs.empty())
     {
-        printf("Cannot find camera, exit...\n");
-        return 0;
+        inputs.push_back("camera");
     }
-    
+
+    std::vector<Camera*> cameras;
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        Camera* cam = new Camera(method);
+        cameras.push_back(cam);
+
+        if (!parseInput(inputs[i], cam))
+        {
+            usage();
+            return 1;
+        }
+
+        // a single camera keeps the plain event file names
+        cam->name = inputs.size() > 1 ? "cam" + std::to_string(i) : "camera";
+        cam->source = FrameSource::open(cam->input);
+        if (!cam->source)
+        {
+            printf("Cannot open %s, exit...\n", cam->input.c_str());
+            return 0;
+        }
+    }
+
+    // each camera is analysed by one thread at a time, so more threads
+    // than cameras would only sit idle
+    if (analysis_workers > cameras.size())
+    {
+        analysis_workers = cameras.size();
+    }
+    printf("%zu camera(s), %u analysis thread(s)\n", cameras.size(), analysis_workers);
+    printf("Score smoothing: %s over %d frame(s)\n", smoothingMethodName(smoothing), smoothing_window);
+
 //    cv::namedWindow("Camera", CV_WINDOW_NORMAL);
-    
-    bool isRefImageSet = false;
-    std::vector<double> img_diff;
-    cv::Mat ref_img;
-    
-    while (true)
+
+    for (size_t i = 0; i < cameras.size(); i++)
     {
-        IplImage* pImage = cvQueryFrame(pCapture);
-        if (!pImage)
+        Camera* cam = cameras[i];
+
+        cam->detector.setScale(analysis_step);
+        cam->smoother = Smoother::create(smoothing, smoothing_window);
+
+        // grid mode: the frame score is that of the most changed tile
+        if (grid_cols)
         {
-            sleep(10);
-            continue;
+            cam->grid = new TileDetector(grid_cols, grid_rows);
+            cam->grid->setThreshold(cam->threshold);
+            cam->grid->setScale(analysis_step);
         }
-        
-//        if (isRefImageSet) cv::imshow("Camera", ref_img);
-//        cv::waitKey();
-        
-        if(!isRefImageSet)
+
+        // MOG2 keeps its own per-pixel background, at a fixed step since a
+        // new step restarts the model
+        if (use_mog)
+        {
+            cam->mog = new MogDetector();
+            cam->mog->setScale(analysis_step);
+            if (background_rate > 0)
+            {
+                cam->mog->setLearningRate(background_rate);
+            }
+        }
+
+        // idle: slow and decimated until the score heads for the threshold;
+        // recordings are neither paced nor decimated
+        if (idle_interval && cam->source->live())
+        {
+            cam->scheduler = new AdaptiveScheduler(SchedulerConfig(cam->threshold, idle_interval, armed_interval, analysis_step));
+            cam->detector.setScale(cam->scheduler->step());
+            if (cam->grid)
+            {
+                cam->grid->setScale(cam->scheduler->step());
+            }
+        }
+
+        if (pre_event_budget && pre_event_seconds)
+        {
+            cam->preEvent = new PreEventBuffer(pre_event_budget, pre_event_seconds, pre_event_downscale);
+        }
+
+        printf("%s: %s, threshold %.2f\n", cam->name.c_str(), cam->input.c_str(), cam->threshold);
+    }
+
+    // analysis, on a pool thread; one worker per camera at a time
+    auto analyse_frame = [&](Camera& cam, Frame& frame)
+    {
+        const cv::Mat& cur_img = frame.img;
+        HistDetector& detector = cam.detector;
+        TileDetector* grid = cam.grid;
+        MogDetector* mog = cam.mog;
+        AdaptiveScheduler* scheduler = cam.scheduler;
+
+        if(!detector.hasReference())
         {
-            ref_img = cv::Mat(pImage).clone();
-            isRefImageSet = true;
+            detector.setReference(cur_img);
+            if (grid)
+            {
+                grid->setReference(cur_img);
+            }
+            return false;
+        }
+
+        double diff;
+        if (mog)
+        {
+            diff = mog->compare(cur_img, cam.sceneQuiet);
         }
         else
         {
-            cv::Mat cur_img(pImage);
-            const double diff = compareImgDiff(ref_img, cur_img);
-            img_diff.push_back(diff);
-            if (img_diff.size() > AVG_COUNT)
+            diff = grid ? grid->compare(cur_img) : detector.compare(cur_img);
+        }
+        double diff_average = cam.smoother->update(diff);
+        cam.lastScore.store(diff_average);
+
+        if (scheduler && scheduler->update(diff_average))
+        {
+            printf("%s %s: capturing every %u ms, analysis step %d\n", cam.name.c_str(), scheduleModeName(scheduler->mode()),
+                   scheduler->intervalMs(), scheduler->step());
+            detector.setScale(scheduler->step());
+            if (grid)
             {
-                img_diff.erase(img_diff.begin());
+                grid->setScale(scheduler->step());
             }
-            
-            double diff_average = average(&img_diff[0], img_diff.size());
-            
-            printf("\tdiff = %f\n", diff);
-            if (diff_average < THRESHOLD)
+            cam.pipeline->setCaptureInterval(scheduler->intervalMs());
+        }
+
+        printf("\t%s diff = %f\n", cam.name.c_str(), diff);
+        frame.score = diff;
+        frame.average = diff_average;
+
+        if (mog)
+        {
+            frame.region = mog->boundingBox();
+        }
+        else if (grid && grid->changedTiles())
+        {
+            frame.region = grid->boundingBox();
+            printf("\t%d tile(s) changed, bounding box %dx%d at (%d,%d):\n%s", grid->changedTiles(),
+                   frame.region.width, frame.region.height, frame.region.x, frame.region.y,
+                   grid->changeMap().c_str());
+        }
+
+        const bool event = diff_average < cam.threshold;
+        cam.sceneQuiet = !event && (!scheduler || scheduler->mode() == MODE_IDLE);
+
+        // let the reference follow daylight; O(bins) per frame
+        if (cam.sceneQuiet && background_rate > 0 && !mog)
+        {
+            if (grid)
             {
-                // There is something happen;
-                // Save Image
-                std::string filename = getDateString() + std::string(".jpg");
-                cv::imwrite(filename.c_str(), cur_img);
-                // Send notification mail
-                sendmail(email, "camera@pi", "Camera notification", "The camera have detected something strange.\n");
-                // Upload image to Mega
-                loginAndUploadFile(mega_acount, mega_password, filename.c_str());
+                grid->adaptReference(background_rate);
             }
+            else
+            {
+                detector.adaptReference(background_rate);
+            }
+        }
+
+        return event;
+    };
+
+    // event actions run on the dispatcher's workers, shared by all cameras
+    EventDispatcher dispatcher(dispatcher_workers, EVENT_QUEUE_DEPTH, backpressure);
+
+    dispatcher.setHandler(ACTION_SAVE, [&](EventJob& job)
+    {
+        FILE* fp = fopen(job.name.c_str(), "wb");
+        if (!fp)
+        {
+            perror("Failed to save event image");
+            return;
+        }
+        bool ok = fwrite(&job.data[0], 1, job.data.size(), fp) == job.data.size();
+        ok = !fclose(fp) && ok;
+
+        // upload the bytes we already have rather than reading the file back
+        if (ok)
+        {
+            EventJob upload(ACTION_UPLOAD, job.name);
+            upload.data.swap(job.data);
+            dispatcher.submit(upload);
         }
-        
-        sleep(N_Capture);
+    }, 2);
+
+    // the main thread runs this: MEGA sockets, the event stages, signals
+    // and timers, all from one epoll loop
+    Reactor reactor;
+
+    // notifications go to the MTA over SMTP from the reactor, so a slow or
+    // dead mail server never holds up a worker
+    SmtpClient* smtp = NULL;
+    if (!use_sendmail)
+    {
+        smtp = new SmtpClient(reactor, smtp_host, smtp_port);
+        printf("Notifications to %s through %s:%u\n", email, smtp_host.c_str(), smtp_port);
     }
-    
-    cvReleaseCapture(&pCapture);
-}
\ No newline at end of file
+
+    // the fallback: a prepared message, piped to sendmail by a worker
+    dispatcher.setHandler(ACTION_MAIL, [&](EventJob& job)
+    {
+        sendmail(std::string(job.data.begin(), job.data.end()));
+    });
+
+    std::vector<std::string> recipients;
+    for (const char* p = email; *p; )
+    {
+        size_t n = strcspn(p, ",");
+        if (n)
+        {
+            recipients.push_back(std::string(p, n));
+        }
+        p += n + (p[n] == ',');
+    }
+    if (recipients.empty())
+    {
+        usage();
+        return 1;
+    }
+
+    // one alert per incident, then digests, within a rate per recipient
+    NotificationAggregator notifier(reactor, recipients, "camera@pi", [&](const SmtpMessage& mail)
+    {
+        if (smtp)
+        {
+            smtp->send(mail);
+            return;
+        }
+
+        std::string text = formatMail(mail);
+        EventJob job(ACTION_MAIL, mail.to);
+        job.data.assign(text.begin(), text.end());
+        dispatcher.submit(job);
+    }, digest_seconds, mails_per_hour);
+
+    // one MEGA login for the lifetime of the process, whatever the number
+    // of cameras
+    UploaderService uploader(reactor, mega_acount, mega_password);
+    uploader.setLimits(upload_slots, upload_rate);
+    if (upload_rate)
+    {
+        printf("Uploads limited to %zu KB/s on average, %u at once\n", upload_rate >> 10, upload_slots);
+    }
+
+    // every upload is journaled here until MEGA has it, so that a crash or
+    // a restart during an outage does not lose events
+    UploadSpool* spool = NULL;
+    if (spool_dir)
+    {
+        spool = new UploadSpool(spool_dir);
+        if (!spool->open())
+        {
+            printf("Cannot use the upload spool in %s\n", spool_dir);
+            delete spool;
+            return 1;
+        }
+        uploader.setSpool(spool);
+    }
+
+    // only queues the file or the bytes; the transfer runs on the reactor.
+    // Event stills go first, clips and pre-event frames after them.
+    dispatcher.setHandler(ACTION_UPLOAD, [&](EventJob& job)
+    {
+        size_t dot = job.name.rfind('.');
+        UploadClass cls = dot != std::string::npos && job.name.compare(dot, std::string::npos, ".jpg") == 0 ?
+                          UPLOAD_URGENT : UPLOAD_NORMAL;
+
+        if (job.data.empty())
+        {
+            uploader.upload(job.name, cls);
+        }
+        else
+        {
+            uploader.upload(job.name, job.data, cls);
+        }
+    }, 1);
+
+    // with a local copy the file is written first, then uploaded from memory
+    const ActionType store_action = keep_local ? ACTION_SAVE : ACTION_UPLOAD;
+
+    // name of the files of an event
+    auto event_name = [&](Camera& cam, Frame& frame)
+    {
+        std::string name = getDateString();
+        if (cameras.size() > 1)
+        {
+            name = cam.name + "_" + name;
+        }
+        // the date has whole seconds, and an armed camera or a recording
+        // produces several events per second
+        name += "_" + std::to_string(frame.seq);
+        return name;
+    };
+
+    // finishes the clip of an incident and uploads it
+    auto close_clip = [&](Camera& cam)
+    {
+        if (!cam.clip.isOpen())
+        {
+            return;
+        }
+
+        reactor.cancel(cam.clipTimer);
+        cam.clipTimer = 0;
+
+        unsigned long frames = cam.clip.frames();
+        if (!cam.clip.close())
+        {
+            printf("Failed to write event clip %s\n", cam.clip.path().c_str());
+            return;
+        }
+
+        printf("%s: clip %s, %lu frame(s)\n", cam.name.c_str(), cam.clip.path().c_str(), frames);
+        cam.clips++;
+        EventJob upload(ACTION_UPLOAD, cam.clip.path());
+        if (!keep_local)
+        {
+            upload.data.swap(cam.clip.data());
+        }
+        dispatcher.submit(upload);
+    };
+
+    // analysis side, for a frame passed on to the act stage: everything it
+    // will store, already encoded, as the act stage runs on the reactor
+    // next to the network I/O
+    auto encode_event = [&](Camera& cam, Frame& frame)
+    {
+        // clips: the same size as the pre-event frames, so that both fit one
+        // clip; event stills: always the full resolution frame, whatever the
+        // analysis step
+        if (clip_post_roll && pre_event_downscale > 1)
+        {
+            cv::resize(frame.img, cam.eventSmall, cv::Size(frame.img.cols / pre_event_downscale, frame.img.rows / pre_event_downscale),
+                       0, 0, cv::INTER_AREA);
+            cv::imencode(".jpg", cam.eventSmall, frame.jpeg);
+        }
+        else
+        {
+            cv::imencode(".jpg", frame.img, frame.jpeg);
+        }
+
+        // for the mails; a few are plenty, so at most one per THUMBNAIL_SPACING
+        if (frame.trigger && frame.img.cols > 0 && frame.stamp >= cam.lastThumbnail + THUMBNAIL_SPACING)
+        {
+            int width = frame.img.cols < THUMBNAIL_WIDTH ? frame.img.cols : THUMBNAIL_WIDTH;
+            cv::resize(frame.img, cam.eventSmall, cv::Size(width, frame.img.rows * width / frame.img.cols), 0, 0, cv::INTER_AREA);
+            cv::imencode(".jpg", cam.eventSmall, frame.thumbnail);
+            cam.lastThumbnail = frame.stamp;
+        }
+    };
+
+    // hands the event to the notifier, with the frame's thumbnail if it has one
+    auto notify = [&](Camera& cam, Frame& frame, const std::string& file)
+    {
+        Notification n;
+        n.camera = cam.name;
+        n.file = file;
+        n.stamp = frame.stamp;
+
+        if (!frame.thumbnail.empty())
+        {
+            n.thumbnail = std::make_shared<std::vector<unsigned char> >(frame.thumbnail);
+        }
+
+        notifier.notify(n);
+    };
+
+    // clip mode: every frame of an incident goes into one AVI, from the
+    // pre-event frames to the end of the post-roll; one mail per clip
+    auto record_clip = [&](Camera& cam, Frame& frame)
+    {
+        // frame.jpeg has this size (see encode_event)
+        int width = frame.img.cols / pre_event_downscale;
+        int height = frame.img.rows / pre_event_downscale;
+
+        if (cam.clip.isOpen() && frame.stamp - cam.clip.firstStamp() >= CLIP_MAX_SECONDS)
+        {
+            close_clip(cam);
+        }
+
+        // a full clip (CLIP_MAX_BYTES) is closed and the frame starts the next
+        for (int attempt = 0; attempt < 2; attempt++)
+        {
+            if (!cam.clip.isOpen())
+            {
+                std::string name = event_name(cam, frame) + ".avi";
+                if (!keep_local)
+                {
+                    cam.clip.openMemory(name, width, height);
+                }
+                else if (!cam.clip.open(name, width, height))
+                {
+                    perror("Failed to create event clip");
+                    return;
+                }
+
+                if (cam.preEvent)
+                {
+                    cam.preEvent->take(frame.seq, [&](const std::vector<unsigned char>& jpeg, time_t stamp)
+                    {
+                        cam.clip.write(jpeg, stamp);
+                    });
+                }
+
+                notify(cam, frame, name);
+            }
+
+            if (cam.clip.write(frame.jpeg, frame.stamp))
+            {
+                break;
+            }
+            close_clip(cam);
+        }
+
+        // the clip ends once the post-roll has passed without a new trigger
+        if (frame.trigger || !cam.clipTimer)
+        {
+            Camera* c = &cam;
+            reactor.cancel(cam.clipTimer);
+            cam.clipTimer = reactor.after((clip_post_roll + 1) * 1000, [&, c]()
+            {
+                c->clipTimer = 0;
+                close_clip(*c);
+            });
+        }
+    };
+
+    // event stage, run by the reactor whenever an event stage is readable
+    auto act_frame = [&](Camera& cam, Frame& frame)
+    {
+        if (frame.trigger)
+        {
+            cam.events++;
+        }
+
+        if (clip_post_roll)
+        {
+            record_clip(cam, frame);
+            return;
+        }
+
+        // There is something happen;
+        // Save Image (encoded by encode_event)
+        std::string name = event_name(cam, frame);
+
+        // the frames leading up to it, as one MJPEG file saved and uploaded
+        // like the event image
+        if (cam.preEvent)
+        {
+            EventJob pre(store_action, name + "_pre.mjpg");
+            if (cam.preEvent->take(frame.seq, pre.data))
+            {
+                dispatcher.submit(pre);
+            }
+        }
+
+        EventJob save(store_action, name + ".jpg");
+        save.data.swap(frame.jpeg);
+        dispatcher.submit(save);
+        // Send notification mail
+        notify(cam, frame, save.name);
+    };
+
+    // SIGINT/SIGTERM arrive through a signalfd on the reactor; block them
+    // before any thread starts so that all threads inherit the mask
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+    int signal_fd = signalfd(-1, &stop_signals, SFD_CLOEXEC);
+
+    AnalysisPool analysis(analysis_workers);
+
+    for (size_t i = 0; i < cameras.size(); i++)
+    {
+        Camera* cam = cameras[i];
+        PipelineConfig config = pipeline_config;
+        config.analysisThread = false;
+        config.actThread = false;
+
+        // recordings: no pacing, no dropped frames, and the run ends with them
+        if (!cam->source->live())
+        {
+            config.captureIntervalMs = 0;
+            config.analysisPolicy = DROP_BLOCK;
+            config.eventPolicy = DROP_BLOCK;
+            config.stopAtEnd = true;
+        }
+        else if (cam->scheduler)
+        {
+            config.captureIntervalMs = cam->scheduler->intervalMs();
+        }
+
+        cam->pipeline = new Pipeline(config,
+                                     [cam](cv::Mat& img) { return cam->source->read(img); },
+                                     [&, cam](Frame& frame)
+                                     {
+                                         bool event = analyse_frame(*cam, frame);
+                                         frame.trigger = event;
+
+                                         // the post-roll of an incident goes to its clip
+                                         if (clip_post_roll)
+                                         {
+                                             if (event)
+                                             {
+                                                 cam->incidentUntil = frame.stamp + clip_post_roll;
+                                             }
+                                             else if (frame.stamp <= cam->incidentUntil)
+                                             {
+                                                 encode_event(*cam, frame);
+                                                 return true;
+                                             }
+                                         }
+
+                                         if (!event && cam->preEvent)
+                                         {
+                                             cam->preEvent->add(frame);
+                                         }
+                                         if (event)
+                                         {
+                                             encode_event(*cam, frame);
+                                         }
+                                         return event;
+                                     },
+                                     [&, cam](Frame& frame) { act_frame(*cam, frame); });
+        analysis.add(*cam->pipeline, cam->name);
+    }
+
+    // stops capturing, flushes every stage and lets the last uploads finish
+    // before the reactor returns
+    std::function<void()> shutdown = [&]()
+    {
+        reactor.unwatch(signal_fd);
+        for (size_t i = 0; i < cameras.size(); i++)
+        {
+            reactor.unwatch(cameras[i]->pipeline->eventFd());
+            cameras[i]->pipeline->stop();
+        }
+        analysis.stop();
+        for (size_t i = 0; i < cameras.size(); i++)
+        {
+            cameras[i]->pipeline->dispatchEvents();
+            close_clip(*cameras[i]);
+        }
+        notifier.flush();
+        dispatcher.stop();
+
+        // the reactor keeps running the uploads and the mail the
+        // dispatcher queued last
+        uploader.drain(SHUTDOWN_UPLOAD_TIMEOUT * 1000, [&]()
+        {
+            if (!smtp)
+            {
+                reactor.stop();
+                return;
+            }
+            smtp->drain(SHUTDOWN_MAIL_TIMEOUT * 1000, [&]()
+            {
+                reactor.stop();
+            });
+        });
+    };
+
+    for (size_t i = 0; i < cameras.size(); i++)
+    {
+        Camera* cam = cameras[i];
+
+        reactor.watch(cam->pipeline->eventFd(), EPOLLIN, [&, cam](uint32_t)
+        {
+            cam->pipeline->dispatchEvents();
+
+            if (cam->pipeline->finished())
+            {
+                printf("End of %s\n", cam->input.c_str());
+
+                // live cameras never finish, so this only stops a run made
+                // of recordings
+                for (size_t j = 0; j < cameras.size(); j++)
+                {
+                    if (!cameras[j]->pipeline->finished())
+                    {
+                        reactor.unwatch(cam->pipeline->eventFd());
+                        return;
+                    }
+                }
+                printf("Stopping...\n");
+                shutdown();
+            }
+        });
+    }
+
+    auto print_camera_stats = [&]()
+    {
+        for (size_t i = 0; i < cameras.size(); i++)
+        {
+            Camera* cam = cameras[i];
+
+            printf("%s (%s): threshold %.2f, score %.3f, %lu event(s), %lu clip(s)\n", cam->name.c_str(),
+                   cam->input.c_str(), cam->threshold, cam->lastScore.load(), cam->events, cam->clips);
+            cam->pipeline->printStats();
+            if (cam->preEvent)
+            {
+                cam->preEvent->printStats();
+            }
+            if (cam->scheduler)
+            {
+                cam->scheduler->printStats();
+            }
+        }
+        analysis.printStats();
+    };
+
+    std::function<void()> print_stats = [&]()
+    {
+        print_camera_stats();
+        dispatcher.printStats();
+        uploader.printStats();
+        if (spool)
+        {
+            spool->printStats();
+        }
+        notifier.printStats();
+        if (smtp)
+        {
+            smtp->printStats();
+        }
+        reactor.after(STATS_INTERVAL * 1000, print_stats);
+    };
+    reactor.after(STATS_INTERVAL * 1000, print_stats);
+
+    reactor.watch(signal_fd, EPOLLIN, [&](uint32_t)
+    {
+        struct signalfd_siginfo info;
+        if (read(signal_fd, &info, sizeof info) != sizeof info)
+        {
+            return;
+        }
+
+        printf("Stopping...\n");
+        shutdown();
+    });
+
+    uploader.start();
+    if (smtp)
+    {
+        smtp->start();
+    }
+    dispatcher.start();
+    analysis.start();
+    for (size_t i = 0; i < cameras.size(); i++)
+    {
+        cameras[i]->pipeline->start();
+    }
+
+    reactor.run();
+
+    uploader.stop();
+    close(signal_fd);
+    print_camera_stats();
+    dispatcher.printStats();
+    uploader.printStats();
+    if (spool)
+    {
+        spool->printStats();
+        delete spool;
+    }
+    notifier.printStats();
+    if (smtp)
+    {
+        smtp->stop();
+        smtp->printStats();
+        delete smtp;
+    }
+
+    for (size_t i = 0; i < cameras.size(); i++)
+    {
+        delete cameras[i];
+    }
+}
@@ -0,0 +1,307 @@
+#include "clip_writer.h"
+
+#include <string.h>
+
+#define AVIF_HASINDEX 0x10
+#define AVIIF_KEYFRAME 0x10
+
+ClipWriter::ClipWriter()
+{
+    m_fp = NULL;
+    m_memory = false;
+    m_limit = 0;
+    m_ok = false;
+    m_width = 0;
+    m_height = 0;
+    m_riffSize = 0;
+    m_moviSize = 0;
+    m_moviStart = 0;
+    m_pos = 0;
+    m_maxFrame = 0;
+    m_first = 0;
+    m_last = 0;
+}
+
+ClipWriter::~ClipWriter()
+{
+    close();
+}
+
+void ClipWriter::put(const void* data, size_t size)
+{
+    if (m_memory)
+    {
+        const unsigned char* p = (const unsigned char*)data;
+        if (m_pos == (long)m_buf.size())
+        {
+            m_buf.insert(m_buf.end(), p, p + size);
+        }
+        else
+        {
+            // patching a header field
+            memcpy(&m_buf[m_pos], p, size);
+        }
+    }
+    else
+    {
+        m_ok = fwrite(data, 1, size, m_fp) == size && m_ok;
+    }
+    m_pos += size;
+}
+
+// little endian, whatever the host
+void ClipWriter::put32(uint32_t v)
+{
+    unsigned char b[4] = { (unsigned char)v, (unsigned char)(v >> 8), (unsigned char)(v >> 16), (unsigned char)(v >> 24) };
+    put(b, 4);
+}
+
+void ClipWriter::putFourcc(const char* fourcc)
+{
+    put(fourcc, 4);
+}
+
+void ClipWriter::patch32(long offset, uint32_t v)
+{
+    if (!m_memory && fseek(m_fp, offset, SEEK_SET))
+    {
+        m_ok = false;
+        return;
+    }
+    m_pos = offset;
+    put32(v);
+}
+
+bool ClipWriter::open(const std::string& path, int width, int height)
+{
+    close();
+
+    m_fp = fopen(path.c_str(), "wb");
+    if (!m_fp)
+    {
+        return false;
+    }
+
+    m_memory = false;
+    m_limit = CLIP_MAX_BYTES;
+    start(path, width, height);
+
+    if (!m_ok)
+    {
+        fclose(m_fp);
+        m_fp = NULL;
+        remove(path.c_str());
+    }
+
+    return m_ok;
+}
+
+void ClipWriter::openMemory(const std::string& path, int width, int height)
+{
+    close();
+
+    m_memory = true;
+    m_limit = CLIP_MAX_MEMORY;
+    m_buf.clear();
+    start(path, width, height);
+}
+
+// the headers, up to the start of the movi list
+void ClipWriter::start(const std::string& path, int width, int height)
+{
+    m_path = path;
+    m_ok = true;
+    m_width = width;
+    m_height = height;
+    m_pos = 0;
+    m_index.clear();
+    m_maxFrame = 0;
+    m_first = 0;
+    m_last = 0;
+
+    putFourcc("RIFF");
+    m_riffSize = m_pos;
+    put32(0);
+    putFourcc("AVI ");
+
+    // hdrl: avih + strl(strh + strf)
+    putFourcc("LIST");
+    put32(4 + (8 + 56) + (8 + 4 + (8 + 56) + (8 + 40)));
+    putFourcc("hdrl");
+
+    // avih; frame rate, frame count and buffer size are filled in by close()
+    putFourcc("avih");
+    put32(56);
+    put32(0);               // dwMicroSecPerFrame
+    put32(0);               // dwMaxBytesPerSec
+    put32(0);               // dwPaddingGranularity
+    put32(AVIF_HASINDEX);   // dwFlags
+    put32(0);               // dwTotalFrames
+    put32(0);               // dwInitialFrames
+    put32(1);               // dwStreams
+    put32(0);               // dwSuggestedBufferSize
+    put32(width);
+    put32(height);
+    put32(0);
+    put32(0);
+    put32(0);
+    put32(0);
+
+    putFourcc("LIST");
+    put32(4 + (8 + 56) + (8 + 40));
+    putFourcc("strl");
+
+    putFourcc("strh");
+    put32(56);
+    putFourcc("vids");
+    putFourcc("MJPG");
+    put32(0);               // dwFlags
+    put32(0);               // wPriority, wLanguage
+    put32(0);               // dwInitialFrames
+    put32(1);               // dwScale
+    put32(1);               // dwRate
+    put32(0);               // dwStart
+    put32(0);               // dwLength
+    put32(0);               // dwSuggestedBufferSize
+    put32(0xffffffff);      // dwQuality: default
+    put32(0);               // dwSampleSize: variable
+    put32(0);               // rcFrame left, top
+    put32((height << 16) | (width & 0xffff));
+
+    putFourcc("strf");
+    put32(40);
+    put32(40);              // biSize
+    put32(width);
+    put32(height);
+    put32(1 | (24 << 16));  // biPlanes, biBitCount
+    putFourcc("MJPG");
+    put32(width * height * 3);
+    put32(0);
+    put32(0);
+    put32(0);
+    put32(0);
+
+    putFourcc("LIST");
+    m_moviSize = m_pos;
+    put32(0);
+    m_moviStart = m_pos;
+    putFourcc("movi");
+}
+
+bool ClipWriter::write(const unsigned char* jpeg, size_t size, time_t stamp)
+{
+    if (!isOpen() || !m_ok)
+    {
+        return false;
+    }
+
+    // room for this chunk and its index entry, and for the rest of the index
+    if (m_pos + 8 + size + 1 + 16 * (m_index.size() / 2 + 1) > m_limit)
+    {
+        return false;
+    }
+
+    m_index.push_back(m_pos - m_moviStart);
+    m_index.push_back(size);
+
+    putFourcc("00dc");
+    put32(size);
+    put(jpeg, size);
+    if (size & 1)
+    {
+        unsigned char pad = 0;
+        put(&pad, 1);
+    }
+
+    if (size > m_maxFrame)
+    {
+        m_maxFrame = size;
+    }
+    if (m_index.size() == 2)
+    {
+        m_first = stamp;
+    }
+    m_last = stamp;
+
+    return m_ok;
+}
+
+bool ClipWriter::write(const std::vector<unsigned char>& jpeg, time_t stamp)
+{
+    return !jpeg.empty() && write(&jpeg[0], jpeg.size(), stamp);
+}
+
+bool ClipWriter::close()
+{
+    if (!isOpen())
+    {
+        return false;
+    }
+
+    uint32_t frames = m_index.size() / 2;
+    uint32_t moviBytes = m_pos - m_moviStart;
+
+    putFourcc("idx1");
+    put32(frames * 16);
+    for (size_t i = 0; i < m_index.size(); i += 2)
+    {
+        putFourcc("00dc");
+        put32(AVIIF_KEYFRAME);
+        put32(m_index[i]);
+        put32(m_index[i + 1]);
+    }
+    uint32_t fileSize = m_pos;
+
+    // the capture rate varies, so the clip plays at the average rate,
+    // dwRate / dwScale = frames / seconds
+    uint32_t seconds = m_last > m_first ? m_last - m_first : 1;
+    uint32_t rate = frames ? frames : 1;
+
+    patch32(m_riffSize, fileSize - 8);
+    patch32(m_moviSize, moviBytes);
+    patch32(32, (uint32_t)(1000000.0 * seconds / rate));   // avih.dwMicroSecPerFrame
+    patch32(36, (uint64_t)m_maxFrame * rate / seconds);     // avih.dwMaxBytesPerSec
+    patch32(48, frames);                                    // avih.dwTotalFrames
+    patch32(60, m_maxFrame);                                // avih.dwSuggestedBufferSize
+    patch32(128, seconds);                                  // strh.dwScale
+    patch32(132, rate);                                     // strh.dwRate
+    patch32(140, frames);                                   // strh.dwLength
+    patch32(144, m_maxFrame);                               // strh.dwSuggestedBufferSize
+
+    if (m_memory)
+    {
+        m_memory = false;
+    }
+    else
+    {
+        m_ok = !fclose(m_fp) && m_ok;
+        m_fp = NULL;
+    }
+
+    return m_ok;
+}
+
+std::vector<unsigned char>& ClipWriter::data()
+{
+    return m_buf;
+}
+
+bool ClipWriter::isOpen() const
+{
+    return m_fp != NULL || m_memory;
+}
+
+const std::string& ClipWriter::path() const
+{
+    return m_path;
+}
+
+unsigned long ClipWriter::frames() const
+{
+    return m_index.size() / 2;
+}
+
+time_t ClipWriter::firstStamp() const
+{
+    return m_first;
+}
@@ -0,0 +1,82 @@
+#ifndef CLIP_WRITER_H
+#define CLIP_WRITER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <time.h>
+#include <vector>
+
+// Writes already JPEG-encoded frames into an MJPEG AVI file, without
+// decoding or re-encoding them. Frames are appended as they come; the
+// frame rate is not known up front (the capture rate changes with the
+// schedule), so close() derives it from the frame timestamps and patches
+// the headers. Only the legacy (AVI 1.0, idx1) layout is written, which
+// limits a clip to CLIP_MAX_BYTES; a clip built in memory is limited to
+// CLIP_MAX_MEMORY.
+#define CLIP_MAX_BYTES (1000u << 20)
+#define CLIP_MAX_MEMORY (32u << 20)
+
+class ClipWriter
+{
+public:
+    ClipWriter();
+    ~ClipWriter();
+
+    // creates path for frames of width x height pixels
+    bool open(const std::string& path, int width, int height);
+
+    // as open(), but builds the clip in memory; path only names it
+    void openMemory(const std::string& path, int width, int height);
+
+    // appends one JPEG frame captured at stamp; false on a write error or
+    // once the clip is full
+    bool write(const unsigned char* jpeg, size_t size, time_t stamp);
+    bool write(const std::vector<unsigned char>& jpeg, time_t stamp);
+
+    // writes the index and the final headers; false if any write failed
+    bool close();
+
+    // the bytes of a memory clip after close(); take them with swap()
+    std::vector<unsigned char>& data();
+
+    bool isOpen() const;
+    const std::string& path() const;
+    unsigned long frames() const;
+    time_t firstStamp() const;
+
+private:
+    ClipWriter(const ClipWriter&);
+    ClipWriter& operator=(const ClipWriter&);
+
+    void start(const std::string& path, int width, int height);
+    void put(const void* data, size_t size);
+    void put32(uint32_t v);
+    void putFourcc(const char* fourcc);
+    void patch32(long offset, uint32_t v);
+
+    // output: a file, or m_buf while m_memory
+    FILE* m_fp;
+    bool m_memory;
+    std::vector<unsigned char> m_buf;
+    size_t m_limit;
+
+    std::string m_path;
+    bool m_ok;
+    int m_width;
+    int m_height;
+
+    // file offsets of the fields close() fills in
+    long m_riffSize;
+    long m_moviSize;
+    long m_moviStart;
+    long m_pos;
+
+    // idx1 entries: offset from m_moviStart, size
+    std::vector<uint32_t> m_index;
+    uint32_t m_maxFrame;
+    time_t m_first;
+    time_t m_last;
+};
+
+#endif
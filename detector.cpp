@@ -0,0 +1,647 @@
+#include "detector.h"
+#include "hs_hist.h"
+#include "bin_lut.h"
+
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+
+static const int histSize[] = {H_BINS, S_BINS};
+
+static void calcHsHistRaw(const cv::Mat& hsv, const cv::Mat& mask, cv::MatND& hist)
+{
+    float h_range[] = {0, H_RANGE_MAX};
+    float s_range[] = {0, S_RANGE_MAX};
+    const float*  ranges[] = {h_range, s_range};
+    int channels[] = {0, 1};
+
+    cv::calcHist(&hsv, 1, channels, mask, hist, 2, histSize, ranges, true, false);
+}
+
+static void calcHsHist(const cv::Mat& hsv, const cv::Mat& mask, cv::MatND& hist)
+{
+    calcHsHistRaw(hsv, mask, hist);
+    cv::normalize(hist, hist, 0, 1, cv::NORM_MINMAX, -1, cv::Mat());
+}
+
+// copies the kernel counters into a CV_32F H_BINS x S_BINS histogram
+static void countsToHist(const unsigned* counts, cv::MatND& hist)
+{
+    hist.create(2, histSize, CV_32F);
+
+    float* dst = hist.ptr<float>();
+    for (int i = 0; i < H_BINS * S_BINS; i++)
+    {
+        dst[i] = (float)counts[i];
+    }
+}
+
+typedef std::chrono::steady_clock Clock;
+
+// adds the time since t to ms and restarts t from now; no-op unless timed
+static inline void lap(bool timed, double& ms, Clock::time_point& t)
+{
+    if (timed)
+    {
+        Clock::time_point now = Clock::now();
+        ms += std::chrono::duration<double, std::milli>(now - t).count();
+        t = now;
+    }
+}
+
+DetectorTimings::DetectorTimings()
+{
+    convertMs = 0;
+    histMs = 0;
+    normalizeMs = 0;
+    compareMs = 0;
+    frames = 0;
+}
+
+// built on first use, shared by all detectors
+static const HsBinLut& hsBinLut()
+{
+    static const HsBinLut lut;
+    return lut;
+}
+
+HistDetector::HistDetector(HistMethod method)
+{
+    init(method);
+}
+
+HistDetector::HistDetector(cv::Size frameSize, HistMethod method)
+{
+    init(method);
+    reserve(frameSize);
+}
+
+void HistDetector::init(HistMethod method)
+{
+    m_method = method;
+    m_nextMethod = method;
+    m_step = 1;
+    m_hasRef = false;
+    m_useMask = false;
+    m_hsvData = NULL;
+    m_smallData = NULL;
+    m_histData = NULL;
+    m_maskData = NULL;
+    m_reallocs = 0;
+    m_timing = false;
+}
+
+void HistDetector::setMethod(HistMethod method)
+{
+    m_nextMethod = method;
+}
+
+HistMethod HistDetector::method() const
+{
+    return m_method;
+}
+
+void HistDetector::setScale(int step)
+{
+    m_step = step > 0 ? step : 1;
+}
+
+int HistDetector::scale() const
+{
+    return m_step;
+}
+
+void HistDetector::reserve(cv::Size frameSize)
+{
+    // the fused kernel never touches the HSV frame, so it is only sized on
+    // demand by cvtColor()
+    if (m_method == HIST_OPENCV)
+    {
+        m_hsv.create(frameSize, CV_8UC3);
+        track(m_hsv, m_hsvData);
+    }
+
+    m_mask.create(frameSize, CV_8UC1);
+    m_hist.create(2, histSize, CV_32F);
+    m_refHist.create(2, histSize, CV_32F);
+    m_counts.resize(HS_COUNTS_SIZE);
+
+    track(m_mask, m_maskData);
+    track(m_hist, m_histData);
+}
+
+void HistDetector::setReference(const cv::Mat& ref)
+{
+    m_method = m_nextMethod;
+
+    if (m_mask.size() != ref.size())
+    {
+        reserve(ref.size());
+    }
+
+    computeHist(ref, m_refHist, 1, false);
+    m_hasRef = true;
+}
+
+bool HistDetector::hasReference() const
+{
+    return m_hasRef;
+}
+
+void HistDetector::setMask(const cv::Mat& mask)
+{
+    m_useMask = !mask.empty();
+
+    if (m_useMask)
+    {
+        mask.copyTo(m_mask);
+        track(m_mask, m_maskData);
+    }
+}
+
+double HistDetector::compare(const cv::Mat& img)
+{
+    computeHist(img, m_hist, m_step, m_timing);
+    track(m_hist, m_histData);
+
+    Clock::time_point t = m_timing ? Clock::now() : Clock::time_point();
+    double score = cv::compareHist(m_refHist, m_hist, CV_COMP_CORREL);
+    lap(m_timing, m_timings.compareMs, t);
+    m_timings.frames += m_timing;
+
+    return score;
+}
+
+void HistDetector::adaptReference(double rate)
+{
+    if (!m_hasRef || m_hist.empty())
+    {
+        return;
+    }
+
+    // same size and type, so this blends in place
+    cv::addWeighted(m_refHist, 1 - rate, m_hist, rate, 0, m_refHist);
+}
+
+unsigned long HistDetector::reallocations() const
+{
+    return m_reallocs;
+}
+
+void HistDetector::enableTimings(bool on)
+{
+    m_timing = on;
+}
+
+const DetectorTimings& HistDetector::timings() const
+{
+    return m_timings;
+}
+
+void HistDetector::resetTimings()
+{
+    m_timings = DetectorTimings();
+}
+
+void HistDetector::computeHist(const cv::Mat& img, cv::MatND& hist, int step, bool timed)
+{
+    Clock::time_point t = timed ? Clock::now() : Clock::time_point();
+
+    if (m_method != HIST_OPENCV && !m_useMask)
+    {
+        if (m_method == HIST_LUT)
+        {
+            hsBinLut().accumulate(img, &m_counts[0], step);
+        }
+        else
+        {
+            calcHsHistBgr(img, &m_counts[0], step);
+        }
+        lap(timed, m_timings.histMs, t);
+
+        countsToHist(&m_counts[0], hist);
+        cv::normalize(hist, hist, 0, 1, cv::NORM_MINMAX, -1, cv::Mat());
+        lap(timed, m_timings.normalizeMs, t);
+        return;
+    }
+
+    // cvtColor(), resize() and calcHist() only reallocate their outputs when
+    // the size or type changes
+    if (step > 1 && !m_useMask)
+    {
+        // decimated frames get their own buffer (converted in place) so that
+        // alternating with full resolution reference frames never reallocates
+        cv::resize(img, m_small, cv::Size((img.cols + step - 1) / step, (img.rows + step - 1) / step),
+                   0, 0, cv::INTER_NEAREST);
+        cv::cvtColor(m_small, m_small, CV_BGR2HSV);
+        track(m_small, m_smallData);
+        lap(timed, m_timings.convertMs, t);
+
+        calcHsHistRaw(m_small, cv::Mat(), hist);
+    }
+    else
+    {
+        cv::cvtColor(img, m_hsv, CV_BGR2HSV);
+        track(m_hsv, m_hsvData);
+        lap(timed, m_timings.convertMs, t);
+
+        calcHsHistRaw(m_hsv, m_useMask ? m_mask : cv::Mat(), hist);
+    }
+    lap(timed, m_timings.histMs, t);
+
+    cv::normalize(hist, hist, 0, 1, cv::NORM_MINMAX, -1, cv::Mat());
+    lap(timed, m_timings.normalizeMs, t);
+}
+
+void HistDetector::track(const cv::Mat& buf, const uchar*& last)
+{
+    if (buf.data != last)
+    {
+        last = buf.data;
+        m_reallocs++;
+    }
+}
+
+// mean and sqrt(sum of squared deviations) of one tile histogram
+template<typename T>
+static void tileMoments(const T* counts, double* mean, double* norm)
+{
+    double sum = 0;
+    for (int i = 0; i < TILE_BINS; i++)
+    {
+        sum += counts[i];
+    }
+    *mean = sum / TILE_BINS;
+
+    double sq = 0;
+    for (int i = 0; i < TILE_BINS; i++)
+    {
+        double d = counts[i] - *mean;
+        sq += d * d;
+    }
+    *norm = sqrt(sq);
+}
+
+TileDetector::TileDetector(int tilesX, int tilesY)
+{
+    m_tilesX = tilesX > 0 ? tilesX : 1;
+    m_tilesY = tilesY > 0 ? tilesY : 1;
+    m_step = 1;
+    m_threshold = 0;
+    m_hasRef = false;
+    m_timing = false;
+
+    int tiles = m_tilesX * m_tilesY;
+    m_counts.resize(tiles * TILE_COUNTS_SIZE);
+    m_ref.resize(tiles * TILE_BINS);
+    m_refMean.resize(tiles);
+    m_refNorm.resize(tiles);
+    m_scores.assign(tiles, 1.0);
+}
+
+void TileDetector::setScale(int step)
+{
+    m_step = step > 0 ? step : 1;
+}
+
+void TileDetector::setThreshold(double threshold)
+{
+    m_threshold = threshold;
+}
+
+void TileDetector::setReference(const cv::Mat& ref)
+{
+    calcHsTileHistBgr(ref, m_tilesX, m_tilesY, &m_counts[0]);
+
+    for (int i = 0; i < m_tilesX * m_tilesY; i++)
+    {
+        const unsigned* counts = &m_counts[i * TILE_COUNTS_SIZE];
+        double* tile = &m_ref[i * TILE_BINS];
+
+        double total = 0;
+        for (int b = 0; b < TILE_BINS; b++)
+        {
+            total += counts[b];
+        }
+        for (int b = 0; b < TILE_BINS; b++)
+        {
+            tile[b] = total ? counts[b] / total : 0;
+        }
+
+        tileMoments(tile, &m_refMean[i], &m_refNorm[i]);
+    }
+    m_scores.assign(m_scores.size(), 1.0);
+
+    m_size = ref.size();
+    m_hasRef = true;
+}
+
+bool TileDetector::hasReference() const
+{
+    return m_hasRef;
+}
+
+double TileDetector::compare(const cv::Mat& img)
+{
+    Clock::time_point t = m_timing ? Clock::now() : Clock::time_point();
+    calcHsTileHistBgr(img, m_tilesX, m_tilesY, &m_counts[0], m_step);
+    lap(m_timing, m_timings.histMs, t);
+
+    double lowest = 1;
+    for (int i = 0; i < m_tilesX * m_tilesY; i++)
+    {
+        const double* ref = &m_ref[i * TILE_BINS];
+        const unsigned* cur = &m_counts[i * TILE_COUNTS_SIZE];
+
+        double mean, norm;
+        tileMoments(cur, &mean, &norm);
+
+        // same correlation as CV_COMP_CORREL; like it, independent of the
+        // pixel count, so a decimated tile still compares with a full one
+        double dot = 0;
+        for (int b = 0; b < TILE_BINS; b++)
+        {
+            dot += (ref[b] - m_refMean[i]) * (cur[b] - mean);
+        }
+
+        double denom = m_refNorm[i] * norm;
+        m_scores[i] = denom > 0 ? dot / denom : (m_refNorm[i] == norm ? 1 : 0);
+
+        if (m_scores[i] < lowest)
+        {
+            lowest = m_scores[i];
+        }
+    }
+    lap(m_timing, m_timings.compareMs, t);
+    m_timings.frames += m_timing;
+
+    return lowest;
+}
+
+void TileDetector::adaptReference(double rate)
+{
+    if (!m_hasRef)
+    {
+        return;
+    }
+
+    for (int i = 0; i < m_tilesX * m_tilesY; i++)
+    {
+        if (m_scores[i] < m_threshold)
+        {
+            continue;
+        }
+
+        const unsigned* cur = &m_counts[i * TILE_COUNTS_SIZE];
+        double* tile = &m_ref[i * TILE_BINS];
+
+        double total = 0;
+        for (int b = 0; b < TILE_BINS; b++)
+        {
+            total += cur[b];
+        }
+        if (!total)
+        {
+            continue;
+        }
+
+        double w = rate / total;
+        for (int b = 0; b < TILE_BINS; b++)
+        {
+            tile[b] = (1 - rate) * tile[b] + w * cur[b];
+        }
+
+        tileMoments(tile, &m_refMean[i], &m_refNorm[i]);
+    }
+}
+
+double TileDetector::score(int tx, int ty) const
+{
+    return m_scores[ty * m_tilesX + tx];
+}
+
+bool TileDetector::changed(int tx, int ty) const
+{
+    return score(tx, ty) < m_threshold;
+}
+
+int TileDetector::changedTiles() const
+{
+    int n = 0;
+    for (int ty = 0; ty < m_tilesY; ty++)
+    {
+        for (int tx = 0; tx < m_tilesX; tx++)
+        {
+            n += changed(tx, ty);
+        }
+    }
+    return n;
+}
+
+cv::Rect TileDetector::boundingBox() const
+{
+    int x0 = m_tilesX, y0 = m_tilesY, x1 = -1, y1 = -1;
+
+    for (int ty = 0; ty < m_tilesY; ty++)
+    {
+        for (int tx = 0; tx < m_tilesX; tx++)
+        {
+            if (changed(tx, ty))
+            {
+                x0 = std::min(x0, tx);
+                y0 = std::min(y0, ty);
+                x1 = std::max(x1, tx);
+                y1 = std::max(y1, ty);
+            }
+        }
+    }
+
+    if (x1 < 0)
+    {
+        return cv::Rect();
+    }
+
+    // same tile bounds as calcHsTileHistBgr()
+    int left = x0 * m_size.width / m_tilesX;
+    int top = y0 * m_size.height / m_tilesY;
+    int right = (x1 + 1) * m_size.width / m_tilesX;
+    int bottom = (y1 + 1) * m_size.height / m_tilesY;
+
+    return cv::Rect(left, top, right - left, bottom - top);
+}
+
+std::string TileDetector::changeMap() const
+{
+    std::string map;
+
+    for (int ty = 0; ty < m_tilesY; ty++)
+    {
+        for (int tx = 0; tx < m_tilesX; tx++)
+        {
+            map += changed(tx, ty) ? '#' : '.';
+        }
+        map += '\n';
+    }
+
+    return map;
+}
+
+int TileDetector::tilesX() const
+{
+    return m_tilesX;
+}
+
+int TileDetector::tilesY() const
+{
+    return m_tilesY;
+}
+
+void TileDetector::enableTimings(bool on)
+{
+    m_timing = on;
+}
+
+const DetectorTimings& TileDetector::timings() const
+{
+    return m_timings;
+}
+
+void TileDetector::resetTimings()
+{
+    m_timings = DetectorTimings();
+}
+
+MogDetector::MogDetector(int history, double varThreshold)
+{
+    m_history = history;
+    m_varThreshold = varThreshold;
+    m_step = 1;
+    m_rate = -1;
+    m_foreground = 0;
+    restart();
+}
+
+void MogDetector::restart()
+{
+    // shadows are detected, and marked 127 in the mask, so that they do
+    // not count as foreground
+    m_mog = new cv::BackgroundSubtractorMOG2(m_history, (float)m_varThreshold, true);
+}
+
+void MogDetector::setScale(int step)
+{
+    step = step > 0 ? step : 1;
+    if (step != m_step)
+    {
+        m_step = step;
+        restart();
+    }
+}
+
+void MogDetector::setLearningRate(double rate)
+{
+    m_rate = rate;
+}
+
+double MogDetector::compare(const cv::Mat& img, bool learn)
+{
+    const cv::Mat* src = &img;
+    if (m_step > 1)
+    {
+        cv::resize(img, m_small, cv::Size((img.cols + m_step - 1) / m_step, (img.rows + m_step - 1) / m_step),
+                   0, 0, cv::INTER_NEAREST);
+        src = &m_small;
+    }
+
+    (*m_mog)(*src, m_mask, learn ? m_rate : 0);
+
+    // foreground count and bounds in one pass
+    unsigned long count = 0;
+    int x0 = m_mask.cols, y0 = m_mask.rows, x1 = -1, y1 = -1;
+    for (int y = 0; y < m_mask.rows; y++)
+    {
+        const uchar* row = m_mask.ptr<uchar>(y);
+        for (int x = 0; x < m_mask.cols; x++)
+        {
+            if (row[x] == 255)
+            {
+                count++;
+                x0 = std::min(x0, x);
+                x1 = std::max(x1, x);
+                y0 = std::min(y0, y);
+                y1 = y;
+            }
+        }
+    }
+
+    m_foreground = m_mask.total() ? (double)count / m_mask.total() : 0;
+    m_box = x1 < 0 ? cv::Rect()
+                   : cv::Rect(x0 * m_step, y0 * m_step,
+                              std::min((x1 + 1) * m_step, img.cols) - x0 * m_step,
+                              std::min((y1 + 1) * m_step, img.rows) - y0 * m_step);
+
+    return std::max(0.0, 1 - m_foreground / MOG_FULL_AREA);
+}
+
+double MogDetector::foreground() const
+{
+    return m_foreground;
+}
+
+cv::Rect MogDetector::boundingBox() const
+{
+    return m_box;
+}
+
+double compareImgDiff(const cv::Mat &Ref, const cv::Mat &Test)
+{
+    cv::Mat m_ref = Ref.clone();
+    cv::Mat m_test = Test.clone();
+    cv::cvtColor(m_ref, m_ref, CV_BGR2HSV);
+    cv::cvtColor(m_test, m_test, CV_BGR2HSV);
+
+    cv::MatND hist_ref, hist_test;
+    calcHsHist(m_ref, cv::Mat(), hist_ref);
+    calcHsHist(m_test, cv::Mat(), hist_test);
+
+    double re = cv::compareHist(hist_ref, hist_test, CV_COMP_CORREL);
+    return re;
+}
+
+int checkFusedHist(const cv::Mat& ref, const cv::Mat& img, double* scoreDelta)
+{
+    cv::Mat hsv;
+    cv::MatND expected;
+    cv::cvtColor(img, hsv, CV_BGR2HSV);
+    calcHsHistRaw(hsv, cv::Mat(), expected);
+
+    std::vector<unsigned> counts(HS_COUNTS_SIZE);
+    calcHsHistBgr(img, &counts[0]);
+
+    const float* e = expected.ptr<float>();
+    int mismatched = 0;
+    for (int i = 0; i < H_BINS * S_BINS; i++)
+    {
+        if ((unsigned)e[i] != counts[i])
+        {
+            mismatched++;
+        }
+    }
+
+    HistDetector fused(HIST_FUSED);
+    fused.setReference(ref);
+    *scoreDelta = fabs(fused.compare(img) - compareImgDiff(ref, img));
+
+    return mismatched;
+}
+
+double checkLutHist(const cv::Mat& ref, const cv::Mat& img, double* scoreDelta)
+{
+    HistDetector lut(HIST_LUT);
+    HistDetector exact(HIST_FUSED);
+    lut.setReference(ref);
+    exact.setReference(ref);
+    *scoreDelta = fabs(lut.compare(img) - exact.compare(img));
+
+    return hsBinLut().measureAccuracy(img);
+}
@@ -0,0 +1,242 @@
+#ifndef DETECTOR_H
+#define DETECTOR_H
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+// how the H/S histogram of a frame is computed
+enum HistMethod
+{
+    HIST_OPENCV,    // cvtColor() to a full HSV frame, then calcHist()
+    HIST_FUSED,     // single pass calcHsHistBgr() kernel, no HSV frame
+    HIST_LUT        // one HsBinLut lookup per pixel, approximate (bench only)
+};
+
+// Time spent per stage, summed over the compare() calls made while timing
+// was enabled. setReference() is not counted.
+struct DetectorTimings
+{
+    double convertMs;       // cvtColor()/resize(), HIST_OPENCV only
+    double histMs;          // binning; the fused kernels convert as they go
+    double normalizeMs;
+    double compareMs;
+    unsigned long frames;
+
+    DetectorTimings();
+};
+
+// Scores frames against a reference frame by correlating their H/S colour
+// histograms. The reference histogram is built once in setReference() and
+// kept until the reference changes, so compare() only pays for the histogram
+// of the frame under test.
+//
+// All per-frame work goes through scratch buffers (HSV frame, histogram,
+// mask) owned by the detector. reserve() sizes them up front; after that a
+// stream of same-sized frames never reallocates them. reallocations() only
+// watches those buffers, not what OpenCV allocates internally; bench counts
+// every malloc() made while compare() runs, which is what shows a hot path
+// free of allocations.
+class HistDetector
+{
+public:
+    HistDetector(HistMethod method = HIST_FUSED);
+    HistDetector(cv::Size frameSize, HistMethod method = HIST_FUSED);
+
+    // switching methods takes effect with the next setReference(), so that
+    // the reference and the frames are always binned the same way; until
+    // then method() still returns the one in use
+    void setMethod(HistMethod method);
+    HistMethod method() const;
+
+    // Analyse only every step-th pixel of every step-th row of the frames
+    // passed to compare() (1 = full resolution). The reference histogram is
+    // always built at full resolution; correlation does not depend on the
+    // total count, so it stays valid for any step and the step can change
+    // between frames.
+    void setScale(int step);
+    int scale() const;
+
+    // preallocate the scratch buffers for frames of the given size
+    void reserve(cv::Size frameSize);
+
+    void setReference(const cv::Mat& ref);
+    bool hasReference() const;
+
+    // restrict the histograms to the non-zero pixels of mask (8-bit, frame
+    // sized); an empty mask switches back to the whole frame. Masked frames
+    // always take the HIST_OPENCV path at full resolution.
+    void setMask(const cv::Mat& mask);
+
+    // correlation of img against the reference (1.0 = identical)
+    double compare(const cv::Mat& img);
+
+    // Background update: blends the histogram of the last compare() into
+    // the reference, ref = (1 - rate) * ref + rate * hist. O(bins), so
+    // the reference can follow slow lighting changes at no real cost.
+    void adaptReference(double rate);
+
+    // number of times a scratch buffer came back at a new address, i.e. was
+    // (re)allocated; stays constant in steady state
+    unsigned long reallocations() const;
+
+    // per-stage timing of compare(), off by default (it costs a clock read
+    // per stage)
+    void enableTimings(bool on);
+    const DetectorTimings& timings() const;
+    void resetTimings();
+
+private:
+    void init(HistMethod method);
+    void computeHist(const cv::Mat& img, cv::MatND& hist, int step, bool timed);
+    void track(const cv::Mat& buf, const uchar*& last);
+
+    HistMethod m_method;
+    HistMethod m_nextMethod;    // set by setMethod(), applied by setReference()
+    int m_step;
+
+    cv::MatND m_refHist;
+    bool m_hasRef;
+
+    cv::Mat m_hsv;
+    cv::Mat m_small;
+    cv::MatND m_hist;
+    cv::Mat m_mask;
+    bool m_useMask;
+    std::vector<unsigned> m_counts;
+
+    const uchar* m_hsvData;
+    const uchar* m_smallData;
+    const uchar* m_histData;
+    const uchar* m_maskData;
+    unsigned long m_reallocs;
+
+    bool m_timing;
+    DetectorTimings m_timings;
+};
+
+// Scores frames tile by tile: a tilesX x tilesY grid of coarse H/S
+// histograms (TILE_BINS each, see hs_hist.h), all built in one pass over the
+// frame and each correlated with the same tile of the reference. A change
+// confined to one tile pulls that tile's score down instead of disappearing
+// into the global histogram, and the changed tiles locate it.
+class TileDetector
+{
+public:
+    TileDetector(int tilesX, int tilesY);
+
+    // as HistDetector::setScale()
+    void setScale(int step);
+
+    // tiles scoring below threshold count as changed
+    void setThreshold(double threshold);
+
+    void setReference(const cv::Mat& ref);
+    bool hasReference() const;
+
+    // scores img against the reference; returns the lowest tile score
+    double compare(const cv::Mat& img);
+
+    // as HistDetector::adaptReference(), tile by tile; changed tiles keep
+    // their reference so that whatever changed them is not learned
+    void adaptReference(double rate);
+
+    // results of the last compare()
+    double score(int tx, int ty) const;
+    bool changed(int tx, int ty) const;
+    int changedTiles() const;
+
+    // pixel bounds of the changed tiles, empty if none changed
+    cv::Rect boundingBox() const;
+
+    // one line per tile row, '#' for a changed tile and '.' otherwise
+    std::string changeMap() const;
+
+    int tilesX() const;
+    int tilesY() const;
+
+    // as for HistDetector; the tiles have no convert or normalize stage
+    void enableTimings(bool on);
+    const DetectorTimings& timings() const;
+    void resetTimings();
+
+private:
+    int m_tilesX;
+    int m_tilesY;
+    int m_step;
+    double m_threshold;
+    cv::Size m_size;
+
+    std::vector<unsigned> m_counts;
+
+    // reference tiles, each normalised to a sum of 1 so that blending does
+    // not depend on how many pixels a frame contributed
+    std::vector<double> m_ref;
+
+    // per reference tile: bin mean and sqrt of the summed squared deviations
+    std::vector<double> m_refMean;
+    std::vector<double> m_refNorm;
+    bool m_hasRef;
+
+    std::vector<double> m_scores;
+
+    bool m_timing;
+    DetectorTimings m_timings;
+};
+
+// Per-pixel background model (OpenCV's MOG2) as an alternative to the
+// histogram detectors: every frame updates the model, and the score falls
+// from 1 to 0 as the foreground grows to MOG_FULL_AREA of the frame. Much
+// more expensive per pixel than a histogram, so use setScale() on a Pi.
+#define MOG_FULL_AREA 0.1
+
+class MogDetector
+{
+public:
+    MogDetector(int history = 500, double varThreshold = 16);
+
+    // model every step-th pixel of every step-th row; changing the step
+    // restarts the model
+    void setScale(int step);
+
+    // learning rate of the model, -1 for OpenCV's default of 1 / history
+    void setLearningRate(double rate);
+
+    // feeds img to the model (without learning from it if learn is false)
+    // and scores how much of it is foreground
+    double compare(const cv::Mat& img, bool learn = true);
+
+    // results of the last compare(): foreground fraction, and its bounds
+    // in full-frame pixels (empty if none)
+    double foreground() const;
+    cv::Rect boundingBox() const;
+
+private:
+    void restart();
+
+    cv::Ptr<cv::BackgroundSubtractorMOG2> m_mog;
+    int m_history;
+    double m_varThreshold;
+    int m_step;
+    double m_rate;
+
+    cv::Mat m_small;
+    cv::Mat m_mask;
+    double m_foreground;
+    cv::Rect m_box;
+};
+
+// one-shot comparison of two frames, rebuilding both histograms
+double compareImgDiff(const cv::Mat &Ref, const cv::Mat &Test);
+
+// Cross-checks the fused kernel against the cvtColor()/calcHist() path on
+// one frame pair. Returns the number of histogram bins whose counts differ
+// and stores |HIST_FUSED score - compareImgDiff()| in scoreDelta.
+int checkFusedHist(const cv::Mat& ref, const cv::Mat& img, double* scoreDelta);
+
+// Accuracy report for HIST_LUT on one frame pair: returns the fraction of
+// pixels of img binned differently than the exact path and stores
+// |HIST_LUT score - HIST_FUSED score| in scoreDelta.
+double checkLutHist(const cv::Mat& ref, const cv::Mat& img, double* scoreDelta);
+
+#endif
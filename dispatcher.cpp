@@ -0,0 +1,412 @@
+#include "dispatcher.h"
+
+#include <algorithm>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsedMs(Clock::time_point since)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - since).count();
+}
+
+const char* actionName(ActionType action)
+{
+    switch (action)
+    {
+        case ACTION_SAVE:
+            return "save";
+        case ACTION_MAIL:
+            return "mail";
+        case ACTION_UPLOAD:
+            return "upload";
+        default:
+            return "unknown";
+    }
+}
+
+bool parseBackpressurePolicy(const char* name, BackpressurePolicy* policy)
+{
+    if (!strcmp(name, "oldest"))
+    {
+        *policy = BACKPRESSURE_DROP_OLDEST;
+    }
+    else if (!strcmp(name, "coalesce"))
+    {
+        *policy = BACKPRESSURE_COALESCE;
+    }
+    else if (!strcmp(name, "spill"))
+    {
+        *policy = BACKPRESSURE_SPILL;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+EventJob::EventJob()
+{
+    action = ACTION_COUNT;
+    count = 1;
+}
+
+EventJob::EventJob(ActionType action, const std::string& name)
+{
+    this->action = action;
+    this->name = name;
+    count = 1;
+}
+
+EventDispatcher::EventDispatcher(unsigned workers, size_t capacity, BackpressurePolicy policy,
+                                 const std::string& spillDir)
+{
+    m_workerCount = workers ? workers : 1;
+    m_capacity = capacity ? capacity : 1;
+    m_policy = policy;
+    m_spillDir = spillDir;
+    m_spillSeq = 0;
+    m_stopping = false;
+    m_highWater = 0;
+    m_dropped = 0;
+    m_coalesced = 0;
+    m_spillCount = 0;
+
+    for (int i = 0; i < ACTION_COUNT; i++)
+    {
+        m_limit[i] = 1;
+        m_running[i] = 0;
+        memset(&m_stats[i], 0, sizeof m_stats[i]);
+    }
+}
+
+EventDispatcher::~EventDispatcher()
+{
+    stop();
+}
+
+void EventDispatcher::setHandler(ActionType action, Handler handler, unsigned concurrency)
+{
+    m_handlers[action] = handler;
+    m_limit[action] = concurrency ? concurrency : 1;
+}
+
+void EventDispatcher::start()
+{
+    // coalescing spills the files it cannot merge
+    if (m_policy != BACKPRESSURE_DROP_OLDEST)
+    {
+        mkdir(m_spillDir.c_str(), 0700);
+
+        // jobs left over from a previous run
+        std::vector<std::string> names;
+        DIR* dir = opendir(m_spillDir.c_str());
+        if (dir)
+        {
+            struct dirent* entry;
+            while ((entry = readdir(dir)))
+            {
+                if (strstr(entry->d_name, ".job") && !strstr(entry->d_name, ".tmp"))
+                {
+                    names.push_back(entry->d_name);
+                }
+            }
+            closedir(dir);
+        }
+        std::sort(names.begin(), names.end());
+
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            m_spilled.push_back(m_spillDir + "/" + names[i]);
+
+            // new spill files are numbered after these, never over them
+            unsigned long seq = strtoul(names[i].c_str(), NULL, 10);
+            m_spillSeq = std::max(m_spillSeq, seq);
+        }
+        if (names.size())
+        {
+            printf("Recovered %zu spilled event job(s)\n", names.size());
+        }
+    }
+
+    for (unsigned i = 0; i < m_workerCount; i++)
+    {
+        m_workers.push_back(std::thread(&EventDispatcher::workerLoop, this));
+    }
+}
+
+void EventDispatcher::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_cond.notify_all();
+
+    for (size_t i = 0; i < m_workers.size(); i++)
+    {
+        m_workers[i].join();
+    }
+    m_workers.clear();
+}
+
+void EventDispatcher::submit(EventJob& job)
+{
+    job.queued = Clock::now();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    // once spilling has started, newer jobs queue up behind the spilled ones
+    bool full = m_queue.size() >= m_capacity;
+    if (m_policy == BACKPRESSURE_SPILL && !m_spilled.empty())
+    {
+        full = true;
+    }
+
+    if (full)
+    {
+        if (m_policy == BACKPRESSURE_COALESCE)
+        {
+            for (std::deque<EventJob>::reverse_iterator it = m_queue.rbegin(); it != m_queue.rend(); it++)
+            {
+                // only a job that would do the same again: the same file,
+                // or a mail to the same recipient
+                if (it->action == job.action && it->name == job.name)
+                {
+                    it->count += job.count;
+                    if (!job.data.empty())
+                    {
+                        it->data.swap(job.data);
+                    }
+                    m_coalesced++;
+                    return;
+                }
+            }
+        }
+
+        // event files are evidence: coalescing keeps the ones it could not
+        // merge on disk rather than dropping anything
+        if (m_policy == BACKPRESSURE_SPILL || (m_policy == BACKPRESSURE_COALESCE && job.action != ACTION_MAIL))
+        {
+            std::string path;
+            char seq[32];
+            snprintf(seq, sizeof seq, "/%010lu.job", ++m_spillSeq);
+            path = m_spillDir + seq;
+
+            lock.unlock();
+            bool ok = spill(job, path);
+            lock.lock();
+
+            if (ok)
+            {
+                m_spilled.push_back(path);
+                m_spillCount++;
+                return;
+            }
+            // could not write the spill file - make room in memory instead
+        }
+
+        if (!m_queue.empty())
+        {
+            printf("Event queue full, dropping %s of %s\n", actionName(m_queue.front().action),
+                   m_queue.front().name.c_str());
+            m_queue.pop_front();
+        }
+        m_dropped++;
+    }
+
+    m_queue.push_back(std::move(job));
+    m_highWater = std::max(m_highWater, m_queue.size());
+    lock.unlock();
+
+    m_cond.notify_one();
+}
+
+size_t EventDispatcher::depth()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_queue.size() + m_spilled.size();
+}
+
+// called with the mutex held: picks the oldest job whose action has a free slot
+bool EventDispatcher::takeJob(EventJob& job)
+{
+    for (std::deque<EventJob>::iterator it = m_queue.begin(); it != m_queue.end(); it++)
+    {
+        if (m_running[it->action] < m_limit[it->action])
+        {
+            job = std::move(*it);
+            m_queue.erase(it);
+            m_running[job.action]++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void EventDispatcher::workerLoop()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (true)
+    {
+        // refill from the spill directory while the queue has room
+        if (!m_spilled.empty() && m_queue.size() < m_capacity)
+        {
+            std::string path = m_spilled.front();
+            m_spilled.pop_front();
+
+            lock.unlock();
+            EventJob job;
+            bool ok = unspill(path, job);
+            lock.lock();
+
+            if (ok)
+            {
+                m_queue.push_back(std::move(job));
+                m_cond.notify_one();
+            }
+            continue;
+        }
+
+        EventJob job;
+        if (takeJob(job))
+        {
+            lock.unlock();
+
+            Clock::time_point start = Clock::now();
+            if (m_handlers[job.action])
+            {
+                m_handlers[job.action](job);
+            }
+            double runMs = elapsedMs(start);
+
+            lock.lock();
+            m_running[job.action]--;
+            record(job, runMs);
+
+            // a slot of this action became free
+            m_cond.notify_all();
+            continue;
+        }
+
+        if (m_stopping && m_queue.empty() && m_spilled.empty())
+        {
+            break;
+        }
+
+        m_cond.wait(lock);
+    }
+
+    m_cond.notify_all();
+}
+
+// spill file: "<action> <count> <name>\n" followed by the payload
+bool EventDispatcher::spill(EventJob& job, const std::string& path)
+{
+    std::string tmp = path + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (!fp)
+    {
+        perror("Failed to spill event job");
+        return false;
+    }
+
+    bool ok = fprintf(fp, "%d %u %s\n", (int)job.action, job.count, job.name.c_str()) > 0;
+    if (ok && !job.data.empty())
+    {
+        ok = fwrite(&job.data[0], 1, job.data.size(), fp) == job.data.size();
+    }
+    ok = !fclose(fp) && ok;
+
+    if (!ok || rename(tmp.c_str(), path.c_str()))
+    {
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool EventDispatcher::unspill(const std::string& path, EventJob& job)
+{
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp)
+    {
+        return false;
+    }
+
+    int action;
+    char name[1024];
+    bool ok = fscanf(fp, "%d %u %1023[^\n]", &action, &job.count, name) == 3 && fgetc(fp) == '\n'
+              && action >= 0 && action < ACTION_COUNT;
+
+    if (ok)
+    {
+        job.action = (ActionType)action;
+        job.name = name;
+
+        long start = ftell(fp);
+        fseek(fp, 0, SEEK_END);
+        long end = ftell(fp);
+        fseek(fp, start, SEEK_SET);
+
+        job.data.resize(end - start);
+        if (!job.data.empty())
+        {
+            ok = fread(&job.data[0], 1, job.data.size(), fp) == job.data.size();
+        }
+    }
+    fclose(fp);
+
+    if (!ok)
+    {
+        printf("Discarding unreadable spill file %s\n", path.c_str());
+    }
+    unlink(path.c_str());
+
+    // latency of a spilled job counts from when it was requeued
+    job.queued = Clock::now();
+    return ok;
+}
+
+// called with the mutex held
+void EventDispatcher::record(const EventJob& job, double runMs)
+{
+    ActionStats& s = m_stats[job.action];
+    double latencyMs = elapsedMs(job.queued);
+
+    s.completed++;
+    s.totalLatencyMs += latencyMs;
+    s.totalRunMs += runMs;
+    s.maxLatencyMs = std::max(s.maxLatencyMs, latencyMs);
+}
+
+void EventDispatcher::printStats()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    printf("event queue: depth %zu/%zu (max %zu), spilled %zu pending / %lu total, dropped %lu, coalesced %lu\n",
+           m_queue.size(), m_capacity, m_highWater, m_spilled.size(), m_spillCount, m_dropped, m_coalesced);
+
+    for (int i = 0; i < ACTION_COUNT; i++)
+    {
+        const ActionStats& s = m_stats[i];
+        if (!s.completed)
+        {
+            continue;
+        }
+
+        printf("  %s: %lu done, latency avg %.1f ms max %.1f ms, run avg %.1f ms\n",
+               actionName((ActionType)i), s.completed, s.totalLatencyMs / s.completed, s.maxLatencyMs,
+               s.totalRunMs / s.completed);
+    }
+}
@@ -0,0 +1,126 @@
+#ifndef DISPATCHER_H
+#define DISPATCHER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// side effects of a detection event
+enum ActionType
+{
+    ACTION_SAVE,        // write the encoded frame to disk
+    ACTION_MAIL,        // send the notification mail
+    ACTION_UPLOAD,      // upload a saved file
+    ACTION_COUNT
+};
+
+const char* actionName(ActionType action);
+
+struct EventJob
+{
+    ActionType action;
+
+    // file name of the event image; the recipient for ACTION_MAIL
+    std::string name;
+
+    // encoded image for ACTION_SAVE and ACTION_UPLOAD, the whole message
+    // for ACTION_MAIL
+    std::vector<unsigned char> data;
+
+    // number of events merged into this job by BACKPRESSURE_COALESCE
+    unsigned count;
+
+    std::chrono::steady_clock::time_point queued;
+
+    EventJob();
+    EventJob(ActionType action, const std::string& name);
+};
+
+// what submit() does when the queue is full
+enum BackpressurePolicy
+{
+    BACKPRESSURE_DROP_OLDEST,   // discard the oldest queued job
+    BACKPRESSURE_COALESCE,      // merge into a queued job doing the same
+                                // (same action and file or recipient;
+                                // newest payload wins, counts add up);
+                                // otherwise saves and uploads are spilled,
+                                // mail drops the oldest job
+    BACKPRESSURE_SPILL          // park the job in the spill directory and
+                                // requeue it once the queue has room
+};
+
+bool parseBackpressurePolicy(const char* name, BackpressurePolicy* policy);
+
+struct ActionStats
+{
+    unsigned long completed;
+    double totalLatencyMs;      // queued -> finished
+    double maxLatencyMs;
+    double totalRunMs;          // time spent in the handler
+};
+
+// Runs event actions on a pool of worker threads fed from one bounded
+// queue. Each action type has its own handler and a limit on how many of
+// its jobs run at once (uploads share a single MEGA client, so they are
+// serialised). submit() never blocks the caller.
+class EventDispatcher
+{
+public:
+    typedef std::function<void(EventJob&)> Handler;
+
+    EventDispatcher(unsigned workers, size_t capacity, BackpressurePolicy policy,
+                    const std::string& spillDir = ".spill");
+    ~EventDispatcher();
+
+    // handlers and limits must be set before start()
+    void setHandler(ActionType action, Handler handler, unsigned concurrency = 1);
+
+    void start();
+
+    // finishes the queued and spilled jobs, then joins the workers
+    void stop();
+
+    // any thread, including handlers
+    void submit(EventJob& job);
+
+    size_t depth();
+    void printStats();
+
+private:
+    void workerLoop();
+    bool takeJob(EventJob& job);
+    bool spill(EventJob& job, const std::string& path);
+    bool unspill(const std::string& path, EventJob& job);
+    void record(const EventJob& job, double runMs);
+
+    unsigned m_workerCount;
+    size_t m_capacity;
+    BackpressurePolicy m_policy;
+    std::string m_spillDir;
+
+    Handler m_handlers[ACTION_COUNT];
+    unsigned m_limit[ACTION_COUNT];
+    unsigned m_running[ACTION_COUNT];
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<EventJob> m_queue;
+    std::deque<std::string> m_spilled;
+    unsigned long m_spillSeq;
+    bool m_stopping;
+
+    size_t m_highWater;
+    unsigned long m_dropped;
+    unsigned long m_coalesced;
+    unsigned long m_spillCount;
+    ActionStats m_stats[ACTION_COUNT];
+
+    std::vector<std::thread> m_workers;
+};
+
+#endif
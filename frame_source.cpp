@@ -0,0 +1,207 @@
+#include "frame_source.h"
+
+#include <opencv/highgui.h>
+
+#include <algorithm>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+FrameSource* FrameSource::open(const std::string& spec)
+{
+    // only "camera" and "camera:N": camera_day1.avi is a file
+    if (spec == "camera" || spec.compare(0, 7, "camera:") == 0)
+    {
+        CameraSource* camera = new CameraSource(spec.size() > 7 ? atoi(spec.c_str() + 7) : -1);
+        if (!camera->opened())
+        {
+            delete camera;
+            return NULL;
+        }
+        return camera;
+    }
+
+    if (spec == "synthetic" || spec.compare(0, 10, "synthetic:") == 0)
+    {
+        int width = 640, height = 480;
+        unsigned long frames = 0;
+        if (spec.size() > 10)
+        {
+            sscanf(spec.c_str() + 10, "%dx%d:%lu", &width, &height, &frames);
+        }
+        if (width < 1 || height < 1)
+        {
+            return NULL;
+        }
+        return new SyntheticSource(cv::Size(width, height), frames);
+    }
+
+    struct stat st;
+    if (!stat(spec.c_str(), &st) && S_ISDIR(st.st_mode))
+    {
+        ImageDirSource* dir = new ImageDirSource(spec);
+        if (!dir->opened())
+        {
+            delete dir;
+            return NULL;
+        }
+        return dir;
+    }
+
+    VideoFileSource* video = new VideoFileSource(spec);
+    if (!video->opened())
+    {
+        delete video;
+        return NULL;
+    }
+    return video;
+}
+
+CameraSource::CameraSource(int index)
+{
+    m_capture = cvCreateCameraCapture(index);
+}
+
+CameraSource::~CameraSource()
+{
+    if (m_capture)
+    {
+        cvReleaseCapture(&m_capture);
+    }
+}
+
+bool CameraSource::opened() const
+{
+    return m_capture != NULL;
+}
+
+bool CameraSource::read(cv::Mat& frame)
+{
+    IplImage* pImage = cvQueryFrame(m_capture);
+    if (!pImage)
+    {
+        return false;
+    }
+
+    // copy out of the capture's internal buffer
+    cv::Mat(pImage).copyTo(frame);
+    return true;
+}
+
+bool CameraSource::live() const
+{
+    return true;
+}
+
+VideoFileSource::VideoFileSource(const std::string& path)
+    : m_video(path)
+{
+}
+
+bool VideoFileSource::opened() const
+{
+    return m_video.isOpened();
+}
+
+bool VideoFileSource::read(cv::Mat& frame)
+{
+    return m_video.read(frame);
+}
+
+bool VideoFileSource::live() const
+{
+    return false;
+}
+
+ImageDirSource::ImageDirSource(const std::string& dir)
+{
+    m_next = 0;
+
+    DIR* d = opendir(dir.c_str());
+    if (!d)
+    {
+        return;
+    }
+
+    struct dirent* e;
+    while ((e = readdir(d)))
+    {
+        if (e->d_name[0] != '.')
+        {
+            m_files.push_back(dir + "/" + e->d_name);
+        }
+    }
+    closedir(d);
+
+    std::sort(m_files.begin(), m_files.end());
+}
+
+bool ImageDirSource::opened() const
+{
+    return !m_files.empty();
+}
+
+bool ImageDirSource::read(cv::Mat& frame)
+{
+    while (m_next < m_files.size())
+    {
+        frame = cv::imread(m_files[m_next++]);
+        if (!frame.empty())
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool ImageDirSource::live() const
+{
+    return false;
+}
+
+SyntheticSource::SyntheticSource(cv::Size size, unsigned long frames)
+    : m_background(size, CV_8UC3)
+{
+    m_frames = frames;
+    m_next = 0;
+
+    // smooth hue/brightness gradient, so that the histograms are not trivial
+    for (int y = 0; y < size.height; y++)
+    {
+        uchar* p = m_background.ptr<uchar>(y);
+        for (int x = 0; x < size.width; x++, p += 3)
+        {
+            p[0] = (uchar)(64 + 128 * x / size.width);
+            p[1] = (uchar)(96 + 96 * y / size.height);
+            p[2] = (uchar)(160 - 64 * (x + y) / (size.width + size.height));
+        }
+    }
+}
+
+bool SyntheticSource::read(cv::Mat& frame)
+{
+    if (m_frames && m_next >= m_frames)
+    {
+        return false;
+    }
+
+    m_background.copyTo(frame);
+
+    // a block of an eighth of the frame (a quarter wide, half high) sweeping left to right during the event frames
+    unsigned long phase = m_next++ % SYNTHETIC_PERIOD;
+    if (phase >= SYNTHETIC_PERIOD - SYNTHETIC_EVENT_FRAMES)
+    {
+        int w = frame.cols / 4, h = frame.rows / 2;
+        int x = (int)((phase - (SYNTHETIC_PERIOD - SYNTHETIC_EVENT_FRAMES)) * (frame.cols - w) / SYNTHETIC_EVENT_FRAMES);
+        frame(cv::Rect(x, frame.rows / 4, w, h)) = cv::Scalar(20, 200, 240);
+    }
+
+    return true;
+}
+
+bool SyntheticSource::live() const
+{
+    return false;
+}
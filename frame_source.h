@@ -0,0 +1,94 @@
+#ifndef FRAME_SOURCE_H
+#define FRAME_SOURCE_H
+
+#include <opencv2/opencv.hpp>
+
+#include <string>
+#include <vector>
+
+// Where frames come from. read() is called from one thread at a time.
+class FrameSource
+{
+public:
+    virtual ~FrameSource() {}
+
+    // fills frame with the next frame; false at the end of a recording, or
+    // when a live source has nothing right now
+    virtual bool read(cv::Mat& frame) = 0;
+
+    // live sources deliver frames in real time and are paced by the
+    // capture schedule; recordings are replayed as fast as they decode
+    virtual bool live() const = 0;
+
+    // Opens a source from a spec:
+    //   camera[:N]                    camera N (default: any camera)
+    //   synthetic[:WxH[:frames]]      generated scene (default 640x480, endless)
+    //   a directory                   its images in name order
+    //   anything else                 a video file
+    // Returns NULL if the source cannot be opened.
+    static FrameSource* open(const std::string& spec);
+};
+
+class CameraSource : public FrameSource
+{
+public:
+    explicit CameraSource(int index = -1);
+    ~CameraSource();
+
+    bool opened() const;
+    bool read(cv::Mat& frame);
+    bool live() const;
+
+private:
+    CvCapture* m_capture;
+};
+
+class VideoFileSource : public FrameSource
+{
+public:
+    explicit VideoFileSource(const std::string& path);
+
+    bool opened() const;
+    bool read(cv::Mat& frame);
+    bool live() const;
+
+private:
+    cv::VideoCapture m_video;
+};
+
+// images of a directory in name order; files that do not decode are skipped
+class ImageDirSource : public FrameSource
+{
+public:
+    explicit ImageDirSource(const std::string& dir);
+
+    bool opened() const;
+    bool read(cv::Mat& frame);
+    bool live() const;
+
+private:
+    std::vector<std::string> m_files;
+    size_t m_next;
+};
+
+// A static gradient background crossed by a coloured block for
+// SYNTHETIC_EVENT_FRAMES out of every SYNTHETIC_PERIOD frames, so a run
+// contains a known number of events. frames = 0 never ends.
+#define SYNTHETIC_PERIOD 100
+#define SYNTHETIC_EVENT_FRAMES 20
+
+class SyntheticSource : public FrameSource
+{
+public:
+    SyntheticSource(cv::Size size, unsigned long frames = 0);
+
+    bool read(cv::Mat& frame);
+    bool live() const;
+
+private:
+    cv::Mat m_background;
+    unsigned long m_frames;
+    unsigned long m_next;
+};
+
+#endif
@@ -0,0 +1,390 @@
+#include "hs_hist.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HS_HIST_NEON
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define HS_HIST_AVX2
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#define HS_HIST_SSSE3
+#endif
+
+// fixed point scheme of OpenCV's 8-bit RGB2HSV conversion
+#define HSV_SHIFT 12
+#define HSV_ROUND (1 << (HSV_SHIFT - 1))
+#define HUE_RANGE 180
+
+#define HS_BINS (H_BINS * S_BINS)
+
+struct HsTables
+{
+    int sdiv[256];
+    int hdiv[256];
+
+    // bin offsets per hue / saturation value; out-of-range values map to
+    // HS_BINS so that any sum involving one lands past the histogram
+    unsigned hidx[256];
+    unsigned sidx[256];
+
+    // hidx + sidx -> bin of the coarse tile layout, TILE_BINS if out of range
+    unsigned short tidx[HS_COUNTS_SIZE];
+
+    HsTables()
+    {
+        sdiv[0] = hdiv[0] = 0;
+        for (int i = 1; i < 256; i++)
+        {
+            sdiv[i] = (int)lrint((255 << HSV_SHIFT) / (1. * i));
+            hdiv[i] = (int)lrint((HUE_RANGE << HSV_SHIFT) / (6. * i));
+        }
+
+        // same lookup calcHist() builds for uniform 8-bit ranges
+        double ha = (double)H_BINS / H_RANGE_MAX;
+        double sa = (double)S_BINS / S_RANGE_MAX;
+        for (int i = 0; i < 256; i++)
+        {
+            int hb = (int)floor(i * ha);
+            int sb = (int)floor(i * sa);
+            hidx[i] = (unsigned)hb < (unsigned)H_BINS ? hb * S_BINS : HS_BINS;
+            sidx[i] = (unsigned)sb < (unsigned)S_BINS ? sb : HS_BINS;
+        }
+
+        for (int i = 0; i < HS_COUNTS_SIZE; i++)
+        {
+            tidx[i] = i < HS_BINS ? i / S_BINS / 2 * TILE_S_BINS + i % S_BINS / 2 : TILE_BINS;
+        }
+    }
+};
+
+static const HsTables& tables()
+{
+    static const HsTables t;
+    return t;
+}
+
+// v = max(b,g,r), diff = v - min(b,g,r), hn = hue numerator before scaling
+static inline unsigned hsIndex(const HsTables& t, int v, int diff, int hn)
+{
+    int s = (diff * t.sdiv[v] + HSV_ROUND) >> HSV_SHIFT;
+    int h = (hn * t.hdiv[diff] + HSV_ROUND) >> HSV_SHIFT;
+    h += h < 0 ? HUE_RANGE : 0;
+
+    return t.hidx[h] + t.sidx[s];
+}
+
+// scalar version of the per-pixel inputs to hsIndex()
+static inline void hsNumerators(int b, int g, int r, int* v, int* diff, int* hn)
+{
+    int vmax = b, vmin = b;
+    if (g > vmax) vmax = g;
+    if (r > vmax) vmax = r;
+    if (g < vmin) vmin = g;
+    if (r < vmin) vmin = r;
+
+    *v = vmax;
+    *diff = vmax - vmin;
+    if (vmax == r)
+    {
+        *hn = g - b;
+    }
+    else if (vmax == g)
+    {
+        *hn = b - r + 2 * *diff;
+    }
+    else
+    {
+        *hn = r - g + 4 * *diff;
+    }
+}
+
+static inline unsigned hsIndexBgr(const HsTables& t, int b, int g, int r)
+{
+    int v, diff, hn;
+    hsNumerators(b, g, r, &v, &diff, &hn);
+
+    return hsIndex(t, v, diff, hn);
+}
+
+void bgrToHs(int b, int g, int r, int* h, int* s)
+{
+    const HsTables& t = tables();
+    int v, diff, hn;
+    hsNumerators(b, g, r, &v, &diff, &hn);
+
+    *s = (diff * t.sdiv[v] + HSV_ROUND) >> HSV_SHIFT;
+    *h = (hn * t.hdiv[diff] + HSV_ROUND) >> HSV_SHIFT;
+    *h += *h < 0 ? HUE_RANGE : 0;
+}
+
+#if defined(HS_HIST_NEON)
+#define HS_BLOCK 16
+
+// v, diff and the hue numerator for 16 pixels
+static inline void hsBlock(const uchar* src, uchar* vo, uchar* diffo, short* hno)
+{
+    uint8x16x3_t px = vld3q_u8(src);
+    uint8x16_t b = px.val[0], g = px.val[1], r = px.val[2];
+
+    uint8x16_t v = vmaxq_u8(vmaxq_u8(b, g), r);
+    uint8x16_t diff = vsubq_u8(v, vminq_u8(vminq_u8(b, g), r));
+    uint8x16_t vr = vceqq_u8(v, r);
+    uint8x16_t vg = vceqq_u8(v, g);
+
+    vst1q_u8(vo, v);
+    vst1q_u8(diffo, diff);
+
+    for (int half = 0; half < 2; half++)
+    {
+        uint8x8_t b8 = half ? vget_high_u8(b) : vget_low_u8(b);
+        uint8x8_t g8 = half ? vget_high_u8(g) : vget_low_u8(g);
+        uint8x8_t r8 = half ? vget_high_u8(r) : vget_low_u8(r);
+        uint8x8_t d8 = half ? vget_high_u8(diff) : vget_low_u8(diff);
+        uint8x8_t vr8 = half ? vget_high_u8(vr) : vget_low_u8(vr);
+        uint8x8_t vg8 = half ? vget_high_u8(vg) : vget_low_u8(vg);
+
+        int16x8_t b16 = vreinterpretq_s16_u16(vmovl_u8(b8));
+        int16x8_t g16 = vreinterpretq_s16_u16(vmovl_u8(g8));
+        int16x8_t r16 = vreinterpretq_s16_u16(vmovl_u8(r8));
+        int16x8_t d16 = vreinterpretq_s16_u16(vmovl_u8(d8));
+        uint16x8_t mr = vreinterpretq_u16_s16(vmovl_s8(vreinterpret_s8_u8(vr8)));
+        uint16x8_t mg = vreinterpretq_u16_s16(vmovl_s8(vreinterpret_s8_u8(vg8)));
+
+        int16x8_t hr = vsubq_s16(g16, b16);
+        int16x8_t hg = vaddq_s16(vsubq_s16(b16, r16), vshlq_n_s16(d16, 1));
+        int16x8_t hb = vaddq_s16(vsubq_s16(r16, g16), vshlq_n_s16(d16, 2));
+
+        vst1q_s16(hno + half * 8, vbslq_s16(mr, hr, vbslq_s16(mg, hg, hb)));
+    }
+}
+#elif defined(HS_HIST_AVX2) || defined(HS_HIST_SSSE3)
+// split 16 interleaved BGR pixels into planar b, g, r
+static inline void deinterleave16(const uchar* src, __m128i& b, __m128i& g, __m128i& r)
+{
+    const __m128i a0 = _mm_loadu_si128((const __m128i*)src);
+    const __m128i a1 = _mm_loadu_si128((const __m128i*)(src + 16));
+    const __m128i a2 = _mm_loadu_si128((const __m128i*)(src + 32));
+
+    b = _mm_or_si128(_mm_or_si128(
+            _mm_shuffle_epi8(a0, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+            _mm_shuffle_epi8(a1, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+            _mm_shuffle_epi8(a2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+    g = _mm_or_si128(_mm_or_si128(
+            _mm_shuffle_epi8(a0, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+            _mm_shuffle_epi8(a1, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+            _mm_shuffle_epi8(a2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+    r = _mm_or_si128(_mm_or_si128(
+            _mm_shuffle_epi8(a0, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+            _mm_shuffle_epi8(a1, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+            _mm_shuffle_epi8(a2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+}
+
+#if defined(HS_HIST_AVX2)
+#define HS_BLOCK 32
+
+// v, diff and the hue numerator for 32 pixels
+static inline void hsBlock(const uchar* src, uchar* vo, uchar* diffo, short* hno)
+{
+    __m128i b0, g0, r0, b1, g1, r1;
+    deinterleave16(src, b0, g0, r0);
+    deinterleave16(src + 48, b1, g1, r1);
+
+    const __m256i b = _mm256_inserti128_si256(_mm256_castsi128_si256(b0), b1, 1);
+    const __m256i g = _mm256_inserti128_si256(_mm256_castsi128_si256(g0), g1, 1);
+    const __m256i r = _mm256_inserti128_si256(_mm256_castsi128_si256(r0), r1, 1);
+
+    const __m256i v = _mm256_max_epu8(_mm256_max_epu8(b, g), r);
+    const __m256i diff = _mm256_sub_epi8(v, _mm256_min_epu8(_mm256_min_epu8(b, g), r));
+    const __m256i vr = _mm256_cmpeq_epi8(v, r);
+    const __m256i vg = _mm256_cmpeq_epi8(v, g);
+
+    _mm256_storeu_si256((__m256i*)vo, v);
+    _mm256_storeu_si256((__m256i*)diffo, diff);
+
+    for (int half = 0; half < 2; half++)
+    {
+        const __m256i b16 = _mm256_cvtepu8_epi16(half ? b1 : b0);
+        const __m256i g16 = _mm256_cvtepu8_epi16(half ? g1 : g0);
+        const __m256i r16 = _mm256_cvtepu8_epi16(half ? r1 : r0);
+        const __m256i d16 = _mm256_cvtepu8_epi16(half ? _mm256_extracti128_si256(diff, 1)
+                                                      : _mm256_castsi256_si128(diff));
+        const __m256i mr = _mm256_cvtepi8_epi16(half ? _mm256_extracti128_si256(vr, 1)
+                                                     : _mm256_castsi256_si128(vr));
+        const __m256i mg = _mm256_cvtepi8_epi16(half ? _mm256_extracti128_si256(vg, 1)
+                                                     : _mm256_castsi256_si128(vg));
+
+        const __m256i hr = _mm256_sub_epi16(g16, b16);
+        const __m256i hg = _mm256_add_epi16(_mm256_sub_epi16(b16, r16), _mm256_slli_epi16(d16, 1));
+        const __m256i hb = _mm256_add_epi16(_mm256_sub_epi16(r16, g16), _mm256_slli_epi16(d16, 2));
+
+        _mm256_storeu_si256((__m256i*)(hno + half * 16),
+                            _mm256_blendv_epi8(_mm256_blendv_epi8(hb, hg, mg), hr, mr));
+    }
+}
+#else
+#define HS_BLOCK 16
+
+static inline __m128i select16(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// v, diff and the hue numerator for 16 pixels
+static inline void hsBlock(const uchar* src, uchar* vo, uchar* diffo, short* hno)
+{
+    __m128i b, g, r;
+    deinterleave16(src, b, g, r);
+
+    const __m128i v = _mm_max_epu8(_mm_max_epu8(b, g), r);
+    const __m128i diff = _mm_sub_epi8(v, _mm_min_epu8(_mm_min_epu8(b, g), r));
+    const __m128i vr = _mm_cmpeq_epi8(v, r);
+    const __m128i vg = _mm_cmpeq_epi8(v, g);
+    const __m128i zero = _mm_setzero_si128();
+
+    _mm_storeu_si128((__m128i*)vo, v);
+    _mm_storeu_si128((__m128i*)diffo, diff);
+
+    for (int half = 0; half < 2; half++)
+    {
+        const __m128i b16 = half ? _mm_unpackhi_epi8(b, zero) : _mm_unpacklo_epi8(b, zero);
+        const __m128i g16 = half ? _mm_unpackhi_epi8(g, zero) : _mm_unpacklo_epi8(g, zero);
+        const __m128i r16 = half ? _mm_unpackhi_epi8(r, zero) : _mm_unpacklo_epi8(r, zero);
+        const __m128i d16 = half ? _mm_unpackhi_epi8(diff, zero) : _mm_unpacklo_epi8(diff, zero);
+        const __m128i mr = half ? _mm_unpackhi_epi8(vr, vr) : _mm_unpacklo_epi8(vr, vr);
+        const __m128i mg = half ? _mm_unpackhi_epi8(vg, vg) : _mm_unpacklo_epi8(vg, vg);
+
+        const __m128i hr = _mm_sub_epi16(g16, b16);
+        const __m128i hg = _mm_add_epi16(_mm_sub_epi16(b16, r16), _mm_slli_epi16(d16, 1));
+        const __m128i hb = _mm_add_epi16(_mm_sub_epi16(r16, g16), _mm_slli_epi16(d16, 2));
+
+        _mm_storeu_si128((__m128i*)(hno + half * 8), select16(mr, hr, select16(mg, hg, hb)));
+    }
+}
+#endif
+#endif
+
+void calcHsHistBgr(const cv::Mat& bgr, unsigned* counts, int step)
+{
+    CV_Assert(bgr.type() == CV_8UC3 && step > 0);
+
+    const HsTables& t = tables();
+    memset(counts, 0, HS_COUNTS_SIZE * sizeof *counts);
+
+    if (step > 1)
+    {
+        for (int y = 0; y < bgr.rows; y += step)
+        {
+            const uchar* src = bgr.ptr<uchar>(y);
+
+            for (int x = 0; x < bgr.cols; x += step, src += 3 * step)
+            {
+                counts[hsIndexBgr(t, src[0], src[1], src[2])]++;
+            }
+        }
+        return;
+    }
+
+    for (int y = 0; y < bgr.rows; y++)
+    {
+        const uchar* src = bgr.ptr<uchar>(y);
+        int x = 0;
+
+#ifdef HS_BLOCK
+        uchar v[HS_BLOCK], diff[HS_BLOCK];
+        short hn[HS_BLOCK];
+
+        for (; x + HS_BLOCK <= bgr.cols; x += HS_BLOCK, src += 3 * HS_BLOCK)
+        {
+            hsBlock(src, v, diff, hn);
+
+            // the histogram scatter itself stays scalar
+            for (int i = 0; i < HS_BLOCK; i++)
+            {
+                counts[hsIndex(t, v[i], diff[i], hn[i])]++;
+            }
+        }
+#endif
+
+        for (; x < bgr.cols; x++, src += 3)
+        {
+            counts[hsIndexBgr(t, src[0], src[1], src[2])]++;
+        }
+    }
+}
+
+void calcHsTileHistBgr(const cv::Mat& bgr, int tilesX, int tilesY, unsigned* counts, int step)
+{
+    CV_Assert(bgr.type() == CV_8UC3 && step > 0 && tilesX > 0 && tilesY > 0);
+
+    const HsTables& t = tables();
+    memset(counts, 0, (size_t)tilesX * tilesY * TILE_COUNTS_SIZE * sizeof *counts);
+
+    for (int ty = 0; ty < tilesY; ty++)
+    {
+        // first sampled row of the tile row: rows on the step grid only
+        int y0 = ty * bgr.rows / tilesY;
+        int y1 = (ty + 1) * bgr.rows / tilesY;
+        y0 += (step - y0 % step) % step;
+
+        for (int y = y0; y < y1; y += step)
+        {
+            const uchar* row = bgr.ptr<uchar>(y);
+
+            for (int tx = 0; tx < tilesX; tx++)
+            {
+                unsigned* tile = counts + (size_t)(ty * tilesX + tx) * TILE_COUNTS_SIZE;
+                int x = tx * bgr.cols / tilesX;
+                int x1 = (tx + 1) * bgr.cols / tilesX;
+
+                if (step > 1)
+                {
+                    x += (step - x % step) % step;
+                    for (; x < x1; x += step)
+                    {
+                        const uchar* src = row + 3 * x;
+                        tile[t.tidx[hsIndexBgr(t, src[0], src[1], src[2])]]++;
+                    }
+                    continue;
+                }
+
+                const uchar* src = row + 3 * x;
+#ifdef HS_BLOCK
+                uchar v[HS_BLOCK], diff[HS_BLOCK];
+                short hn[HS_BLOCK];
+
+                for (; x + HS_BLOCK <= x1; x += HS_BLOCK, src += 3 * HS_BLOCK)
+                {
+                    hsBlock(src, v, diff, hn);
+
+                    for (int i = 0; i < HS_BLOCK; i++)
+                    {
+                        tile[t.tidx[hsIndex(t, v[i], diff[i], hn[i])]]++;
+                    }
+                }
+#endif
+
+                for (; x < x1; x++, src += 3)
+                {
+                    tile[t.tidx[hsIndexBgr(t, src[0], src[1], src[2])]]++;
+                }
+            }
+        }
+    }
+}
+
+const char* hsHistKernelName()
+{
+#if defined(HS_HIST_NEON)
+    return "NEON";
+#elif defined(HS_HIST_AVX2)
+    return "AVX2";
+#elif defined(HS_HIST_SSSE3)
+    return "SSSE3";
+#else
+    return "scalar";
+#endif
+}
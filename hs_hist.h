@@ -0,0 +1,49 @@
+#ifndef HS_HIST_H
+#define HS_HIST_H
+
+#include <opencv2/opencv.hpp>
+
+// H/S histogram layout used by the detector. The ranges are the ones
+// compareImgDiff() has always used (channel 0 over 0..255, channel 1 over
+// 0..180), so scores stay comparable with older logs.
+#define H_BINS 50
+#define S_BINS 60
+#define H_RANGE_MAX 255
+#define S_RANGE_MAX 180
+
+// calcHsHistBgr() needs H_BINS*S_BINS counters plus room past the end where
+// out-of-range pixels are dropped without a branch
+#define HS_COUNTS_SIZE (2 * H_BINS * S_BINS + 1)
+
+// Single pass BGR -> H/S histogram. Bit-exact with cv::cvtColor(CV_BGR2HSV)
+// followed by cv::calcHist() over the layout above, but without writing the
+// intermediate HSV image. counts must hold HS_COUNTS_SIZE entries; the first
+// H_BINS*S_BINS receive the histogram (row-major, H major).
+//
+// With step > 1 only every step-th pixel of every step-th row is binned;
+// that path is scalar since the samples are no longer contiguous.
+void calcHsHistBgr(const cv::Mat& bgr, unsigned* counts, int step = 1);
+
+// Coarser layout for per-tile histograms: each tile bin merges 2x2 bins of
+// the layout above, which keeps a row of tiles small enough for the cache
+#define TILE_H_BINS (H_BINS / 2)
+#define TILE_S_BINS (S_BINS / 2)
+#define TILE_BINS (TILE_H_BINS * TILE_S_BINS)
+
+// per tile: TILE_BINS counters plus one where out-of-range pixels are dropped
+#define TILE_COUNTS_SIZE (TILE_BINS + 1)
+
+// Single pass per-tile H/S histograms over a tilesX x tilesY grid. Tile
+// (tx, ty) covers columns tx*cols/tilesX up to (tx+1)*cols/tilesX and rows
+// likewise; its TILE_COUNTS_SIZE counters start at
+// counts + (ty*tilesX + tx) * TILE_COUNTS_SIZE. step as for calcHsHistBgr().
+void calcHsTileHistBgr(const cv::Mat& bgr, int tilesX, int tilesY, unsigned* counts, int step = 1);
+
+// exact 8-bit hue (0..179) and saturation (0..255) of one BGR pixel, as
+// cv::cvtColor(CV_BGR2HSV) computes them
+void bgrToHs(int b, int g, int r, int* h, int* s);
+
+// name of the vector path compiled in ("NEON", "AVX2", "SSSE3" or "scalar")
+const char* hsHistKernelName();
+
+#endif
@@ -22,16 +22,26 @@
 /**
  * Note: The function we need to use is:
  * loginAndUploadFile(const char* UserName, const char* Password, const char* FilePath) 
+ * or, to control the session's lifetime, an UploaderService.
  *
  */
 
 #include "mega.h"
 #include "megacli.h"
 
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 using namespace mega;
 
 MegaClient* client;
 
+// long-lived upload session, if one was started
+UploaderService* uploader;
+
 // new account signup e-mail address and name
 static string signupemail, signupname;
 
@@ -52,7 +62,22 @@ appfile_list appxferq[2];
 static const char* accesslevels[] =
 { "read-only", "read/write", "full access" };
 
-unsigned state = 0;
+// UploaderService deadlines: login up to the node tree, and a single upload
+#define STARTUP_TIMEOUT_MS 120000
+#define UPLOAD_TIMEOUT_MS 600000
+
+// wait after a failed password login, doubling with each failure in a row
+#define LOGIN_RETRY_MS 10000
+#define LOGIN_RETRY_MAX_MS 900000
+
+// queued memory uploads kept in RAM when they are also in the spool
+#define SPOOL_MEMORY_UPLOADS 8
+
+// how long spool records may wait for their group fsync
+#define SPOOL_SYNC_MS 500
+
+// local directory memory uploads pretend to live in; never created
+#define MEMORY_UPLOAD_DIR "/camera_pi-memory/"
 
 const char* errorstring(error e)
 {
@@ -109,6 +134,30 @@ const char* errorstring(error e)
     }
 }
 
+// how RetryPolicy should treat an API error
+static RetryClass retryClassOf(error e)
+{
+    switch (e)
+    {
+        case API_ERATELIMIT:
+        case API_ETOOMANY:
+        case API_ETOOMANYCONNECTIONS:
+            return RETRY_RATELIMIT;
+        case API_EOVERQUOTA:
+            return RETRY_QUOTA;
+        case API_EARGS:
+        case API_EACCESS:
+        case API_EKEY:
+        case API_EBLOCKED:
+        case API_ENOENT:
+        case API_ECIRCULAR:
+        case API_EAPPKEY:
+            return RETRY_FATAL;
+        default:
+            return RETRY_TRANSIENT;
+    }
+}
+
 AppFile::AppFile()
 {
     static int nextseqno;
@@ -128,6 +177,12 @@ void AppFileGet::start()
 // returns true to effect a retry, false to effect a failure
 bool AppFile::failed(error e)
 {
+    // the uploader retries uploads itself, with backoff and spooling
+    if (uploader && transfer->type == PUT)
+    {
+        return false;
+    }
+
     return e != API_EKEY && e != API_EBLOCKED && transfer->failcount < 10;
 }
 
@@ -143,6 +198,11 @@ void AppFilePut::completed(Transfer* t, LocalNode*)
     // perform standard completion (place node in user filesystem etc.)
     File::completed(t, NULL);
 
+    if (uploader)
+    {
+        uploader->fileCompleted(this);
+    }
+
     delete this;
 }
 
@@ -154,6 +214,11 @@ AppFileGet::~AppFileGet()
 AppFilePut::~AppFilePut()
 {
     appxferq[PUT].erase(appxfer_it);
+
+    if (uploader)
+    {
+        uploader->fileRemoved(this);
+    }
 }
 
 void AppFilePut::displayname(string* dname)
@@ -205,6 +270,11 @@ void DemoApp::transfer_failed(Transfer* t, error e)
 {
     displaytransferdetails(t, "failed (");
     cout << errorstring(e) << ")" << endl;
+
+    if (uploader && t->type == PUT)
+    {
+        uploader->transferDone(t, e);
+    }
 }
 
 void DemoApp::transfer_limit(Transfer *t)
@@ -224,6 +294,11 @@ void DemoApp::transfer_complete(Transfer* t)
     {
         cout << "delayed" << endl;
     }
+
+    if (uploader && t->type == PUT)
+    {
+        uploader->transferDone(t, API_OK);
+    }
 }
 
 // transfer about to start - make final preparations (determine localfilename, create thumbnail for image upload)
@@ -477,8 +552,6 @@ void DemoApp::users_updated(User** u, int count)
     {
         cout << count << " users received or updated" << endl;
     }
-    
-    state = 1;
 }
 
 void DemoApp::setattr_result(handle, error e)
@@ -897,6 +970,12 @@ void DemoApp::request_response_progress(m_off_t current, m_off_t total)
 // login result
 void DemoApp::login_result(error e)
 {
+    if (uploader)
+    {
+        uploader->loginResult(e);
+        return;
+    }
+
     if (e)
     {
         cout << "Login failed: " << errorstring(e) << endl;
@@ -1133,16 +1212,25 @@ bool DemoApp::pread_data(byte* data, m_off_t len, m_off_t pos, void* appdata)
 
 dstime DemoApp::pread_failure(error e, int retry, void* appdata)
 {
-    if (retry < 5)
+    unsigned ms;
+
+    if (uploader)
     {
-        cout << "Retrying read (" << errorstring(e) << ", attempt #" << retry << ")" << endl;
-        return (dstime)(retry*10);
+        if (uploader->retryPolicy().backoff(retryClassOf(e), retry, &ms))
+        {
+            cout << "Retrying read (" << errorstring(e) << ", attempt #" << retry << ") in " << ms << " ms" << endl;
+            return (dstime)(ms / 100);
+        }
     }
-    else
+    else if (retry < 5)
     {
-        cout << "Too many failures (" << errorstring(e) << "), giving up" << endl;
-        return ~(dstime)0;
+        cout << "Retrying read (" << errorstring(e) << ", attempt #" << retry << ")" << endl;
+        return (dstime)(retry*10);
     }
+
+    // budget spent, or an error retrying cannot fix
+    cout << "Too many failures (" << errorstring(e) << "), giving up" << endl;
+    return ~(dstime)0;
 }
 
 // reload needed
@@ -1175,6 +1263,12 @@ void DemoApp::nodes_updated(Node** n, int count)
             }
         }
     }
+    else if (uploader)
+    {
+        // full (re)load: the per-type breakdown would cost a walk over the
+        // whole account, which can hold months of camera images
+        cout << client->nodes.size() << " node(s) loaded" << endl;
+    }
     else
     {
         for (node_map::iterator it = client->nodes.begin(); it != client->nodes.end(); it++)
@@ -1193,8 +1287,6 @@ void DemoApp::nodes_updated(Node** n, int count)
     {
         cwd = client->rootnodes[0];
     }
-    
-    state = 2;
 }
 
 // nodes now (almost) current, i.e. no server-client notifications pending
@@ -1354,84 +1446,1200 @@ void DemoApp::userattr_update(User* u, int priv, const char* n)
           << n << " added or updated" << endl;
 }
 
-void loginAndUploadFile(const char* User, const char* Password, const char* FilePath)
+typedef std::chrono::steady_clock Clock;
+
+ReactorWaiter::ReactorWaiter(Reactor& reactor)
+    : m_reactor(reactor)
+{
+}
+
+ReactorWaiter::~ReactorWaiter()
+{
+    for (std::set<int>::iterator it = m_fds.begin(); it != m_fds.end(); it++)
+    {
+        m_reactor.unwatch(*it);
+    }
+}
+
+int ReactorWaiter::wait()
+{
+    std::set<int> wanted;
+
+    for (int fd = 0; fd <= maxfd; fd++)
+    {
+        uint32_t events = 0;
+
+        if (FD_ISSET(fd, &rfds))
+        {
+            events |= EPOLLIN;
+        }
+        if (FD_ISSET(fd, &wfds))
+        {
+            events |= EPOLLOUT;
+        }
+        if (FD_ISSET(fd, &efds))
+        {
+            events |= EPOLLPRI;
+        }
+
+        if (events)
+        {
+            m_reactor.watch(fd, events, std::bind(&ReactorWaiter::ready, this, fd, std::placeholders::_1));
+            wanted.insert(fd);
+        }
+    }
+
+    for (std::set<int>::iterator it = m_fds.begin(); it != m_fds.end(); it++)
+    {
+        if (!wanted.count(*it))
+        {
+            m_reactor.unwatch(*it);
+        }
+    }
+    m_fds.swap(wanted);
+
+    // as after select(), the sets end up holding only the fds that are ready
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_ZERO(&efds);
+
+    // maxds: deciseconds until the SDK needs exec() again, ~0 for never
+    long long timeoutMs = -1;
+    if (maxds + 1)
+    {
+        timeoutMs = (long long)maxds * 100;
+        if (timeoutMs > INT_MAX)
+        {
+            timeoutMs = INT_MAX;
+        }
+    }
+
+    m_reactor.poll((int)timeoutMs);
+
+    return NEEDEXEC;
+}
+
+void ReactorWaiter::notify()
+{
+    m_reactor.wake();
+}
+
+void ReactorWaiter::ready(int fd, uint32_t events)
+{
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+    {
+        FD_SET(fd, &rfds);
+    }
+    if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+    {
+        FD_SET(fd, &wfds);
+    }
+    if (events & EPOLLPRI)
+    {
+        FD_SET(fd, &efds);
+    }
+}
+
+FileAccess* MemoryFileSystemAccess::newfileaccess()
+{
+    return new MemoryFileAccess(this, FSACCESS_CLASS::newfileaccess());
+}
+
+void MemoryFileSystemAccess::addfile(const string& localname, MemoryFileData data)
+{
+    MemoryFile& f = memfiles[localname];
+    f.data = data;
+    f.mtime = time(NULL);
+}
+
+void MemoryFileSystemAccess::removefile(const string& localname)
+{
+    memfiles.erase(localname);
+}
+
+MemoryFileData MemoryFileSystemAccess::findfile(const string& localname, m_time_t* mtime) const
+{
+    map<string, MemoryFile>::const_iterator it = memfiles.find(localname);
+
+    if (it == memfiles.end())
+    {
+        return MemoryFileData();
+    }
+
+    *mtime = it->second.mtime;
+    return it->second.data;
+}
+
+size_t MemoryFileSystemAccess::files() const
+{
+    return memfiles.size();
+}
+
+MemoryFileAccess::MemoryFileAccess(MemoryFileSystemAccess* cfs, FileAccess* cdisk)
+{
+    fs = cfs;
+    disk = cdisk;
+    datamtime = 0;
+}
+
+MemoryFileAccess::~MemoryFileAccess()
+{
+    delete disk;
+}
+
+// the SDK reads size, mtime etc. from us, not from the FileAccess we wrap
+void MemoryFileAccess::copystate()
+{
+    size = disk->size;
+    mtime = disk->mtime;
+    fsid = disk->fsid;
+    fsidvalid = disk->fsidvalid;
+    type = disk->type;
+    retry = disk->retry;
+}
+
+bool MemoryFileAccess::fopen(string* name, bool read, bool write)
+{
+    data = fs->findfile(*name, &datamtime);
+
+    if (data)
+    {
+        size = data->size();
+        mtime = datamtime;
+        fsidvalid = false;
+        type = FILENODE;
+        retry = false;
+        return read && !write;
+    }
+
+    bool ok = disk->fopen(name, read, write);
+    copystate();
+    return ok;
+}
+
+void MemoryFileAccess::updatelocalname(string* name)
+{
+    if (!data)
+    {
+        disk->updatelocalname(name);
+    }
+}
+
+bool MemoryFileAccess::fwrite(const byte* buf, unsigned len, m_off_t pos)
+{
+    if (data)
+    {
+        return false;
+    }
+
+    bool ok = disk->fwrite(buf, len, pos);
+    copystate();
+    return ok;
+}
+
+bool MemoryFileAccess::sysread(byte* buf, unsigned len, m_off_t pos)
+{
+    if (!data)
+    {
+        return disk->sysread(buf, len, pos);
+    }
+
+    if (pos < 0 || pos + len > (m_off_t)data->size())
+    {
+        return false;
+    }
+
+    memcpy(buf, &(*data)[0] + pos, len);
+    return true;
+}
+
+bool MemoryFileAccess::sysstat(m_time_t* cmtime, m_off_t* csize)
+{
+    if (!data)
+    {
+        return disk->sysstat(cmtime, csize);
+    }
+
+    *cmtime = datamtime;
+    *csize = data->size();
+    return true;
+}
+
+bool MemoryFileAccess::sysopen()
+{
+    return data ? true : disk->sysopen();
+}
+
+void MemoryFileAccess::sysclose()
+{
+    if (!data)
+    {
+        disk->sysclose();
+    }
+}
+
+UploaderService::UploaderService(Reactor& reactor, const char* user, const char* password,
+                                 const char* sessionFile)
+    : m_reactor(reactor)
 {
+    m_waiter = NULL;
+    m_fs = NULL;
+    m_spool = NULL;
+    m_pendingInMemory = 0;
+    m_memorySeq = 0;
+    m_cancelling = false;
+    m_breakerTimer = 0;
+    m_activeSeq = 0;
+    m_user = user;
+    m_password = password;
+    m_sessionFile = sessionFile;
+
+    m_loginPending = false;
+    m_loginFailed = false;
+    m_loginRefused = false;
+    m_loginFailures = 0;
+    m_usingSession = false;
+    m_sessionSaved = false;
+    m_pwkeyValid = false;
+
+    m_startupTimer = 0;
+    m_loginTimer = 0;
+    m_drainTimer = 0;
+    m_syncTimer = 0;
+    m_scheduleTimer = 0;
+
+    m_logins = 0;
+    m_started = 0;
+    m_completed = 0;
+    m_failed = 0;
+    m_timedOut = 0;
+    m_cancelled = 0;
+    m_fromMemory = 0;
+    m_fromSpool = 0;
+    m_requeued = 0;
+    m_totalStartMs = 0;
+    m_maxStartMs = 0;
+    m_loginMs = 0;
+    m_coldStartMs = -1;
+    m_warmStartMs = -1;
+}
+
+UploaderService::~UploaderService()
+{
+    stop();
+}
+
+void UploaderService::setSpool(UploadSpool* spool)
+{
+    m_spool = spool;
+}
+
+void UploaderService::setLimits(unsigned slots, double bytesPerSecond)
+{
+    m_scheduler = UploadScheduler(slots, bytesPerSecond);
+}
+
+void UploaderService::start()
+{
+    if (m_spool)
+    {
+        const std::vector<SpoolEntry>& left = m_spool->recovered();
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (size_t i = 0; i < left.size(); i++)
+        {
+            PendingUpload p;
+            p.path = left[i].name;
+            p.spoolId = left[i].id;
+            p.cls = UPLOAD_BULK;
+            p.queued = Clock::now();
+            m_pending[p.cls].push_back(p);
+        }
+    }
+
     // instantiate app components: the callback processor (DemoApp),
-    // the HTTP I/O engine (WinHttpIO) and the MegaClient itself
+    // the HTTP I/O engine and the MegaClient itself
+    uploader = this;
+    m_waiter = new ReactorWaiter(m_reactor);
+    m_fs = new MemoryFileSystemAccess;
     client = new MegaClient(new DemoApp,
-                            new CONSOLE_WAIT_CLASS,
+                            m_waiter,
                             new HTTPIO_CLASS,
-                            new FSACCESS_CLASS,
+                            m_fs,
+#ifdef DBACCESS_CLASS
+                            // local node tree cache: a resumed session loads
+                            // the tree from disk and only fetches the changes
+                            new DBACCESS_CLASS,
+#else
                             NULL,
+#endif
                             NULL,
                             "CameraPi",
                             "megaCameraPi/" TOSTRING(MEGA_MAJOR_VERSION)
                             "." TOSTRING(MEGA_MINOR_VERSION)
                             "." TOSTRING(MEGA_MICRO_VERSION));
-    
-    byte my_pwkey[SymmCipher::KEYLENGTH];
-    client->pw_key(Password, my_pwkey);
-    client->login(User, my_pwkey);
-    client->exec();
-    state = 0;
-    while(state != 1)
+
+    m_reactor.setDriver(std::bind(&UploaderService::step, this));
+}
+
+void UploaderService::stop()
+{
+    if (!client)
     {
-        if (client->wait())
-        {
-            client->exec();
-            if (state == 1) break;
-        }
+        return;
     }
-    
-    if (client->loggedin() == NOTLOGGEDIN) return;
-    
-    /////////////////////////////
-    // Start Upload
-    AppFile* f;
-    handle target = cwd;
-    string targetuser;
-    string localname;
-    string name;
-    nodetype_t type;
-    
-    
-    if (client->loggedin() == NOTLOGGEDIN && !targetuser.size())
+
+    m_reactor.setDriver(Reactor::Task());
+    if (m_startupTimer)
     {
-        cout << "Not logged in." << endl;
-        
-        return;
+        m_reactor.cancel(m_startupTimer);
+        m_startupTimer = 0;
+    }
+    if (m_loginTimer)
+    {
+        m_reactor.cancel(m_loginTimer);
+        m_loginTimer = 0;
+    }
+    if (m_drainTimer)
+    {
+        m_reactor.cancel(m_drainTimer);
+        m_drainTimer = 0;
+    }
+    cancelUploads();
+
+    if (m_scheduleTimer)
+    {
+        m_reactor.cancel(m_scheduleTimer);
+        m_scheduleTimer = 0;
+    }
+    if (m_breakerTimer)
+    {
+        m_reactor.cancel(m_breakerTimer);
+        m_breakerTimer = 0;
+    }
+
+    // uploads waiting out a backoff stay in the spool
+    for (std::map<unsigned long, unsigned long>::iterator it = m_retryTimers.begin(); it != m_retryTimers.end(); ++it)
+    {
+        m_reactor.cancel(it->second);
+    }
+    m_retryTimers.clear();
+
+    // whatever did not finish stays in the spool for the next run
+    if (m_syncTimer)
+    {
+        m_reactor.cancel(m_syncTimer);
+        m_syncTimer = 0;
+    }
+    if (m_spool)
+    {
+        m_spool->sync();
+    }
+
+    delete client;
+    client = NULL;
+    uploader = NULL;
+
+    delete m_waiter;
+    m_waiter = NULL;
+    m_fs = NULL;
+}
+
+void UploaderService::upload(const string& path, UploadClass cls)
+{
+    PendingUpload p;
+    p.path = path;
+    p.spoolId = m_spool ? m_spool->addPath(path) : 0;
+    p.cls = cls;
+    p.queued = Clock::now();
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending[cls].push_back(p);
     }
-    
-    std::string str_file_path(FilePath);
-    client->fsaccess->path2local(&str_file_path, &localname);
-    
-    DirAccess* da = client->fsaccess->newdiraccess();
-    
-    if (da->dopen(&localname, NULL, true))
+
+    // step() picks it up once the reactor returns from poll()
+    m_reactor.wake();
+}
+
+void UploaderService::upload(const string& name, std::vector<unsigned char>& data, UploadClass cls)
+{
+    std::shared_ptr<std::vector<unsigned char> > buf = std::make_shared<std::vector<unsigned char> >();
+    buf->swap(data);
+
+    PendingUpload p;
+    p.path = name;
+    p.data = buf;
+    p.spoolId = m_spool ? m_spool->add(name, *buf) : 0;
+    p.cls = cls;
+    p.queued = Clock::now();
+
     {
-        while (da->dnext(NULL, &localname, true, &type))
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // a long queue waits in the spool rather than in RAM
+        if (p.spoolId && m_pendingInMemory >= SPOOL_MEMORY_UPLOADS)
         {
-            client->fsaccess->local2path(&localname, &name);
-            cout << "Queueing " << name << "..." << endl;
-            
-            if (type == FILENODE)
-            {
-                f = new AppFilePut(&localname, target, targetuser.c_str());
-                f->appxfer_it = appxferq[PUT].insert(appxferq[PUT].end(), f);
-                client->startxfer(PUT, f);
-            }
+            p.data.reset();
         }
+        if (p.data)
+        {
+            m_pendingInMemory++;
+        }
+        m_pending[cls].push_back(p);
     }
-    
-    delete da;
-    ////////////////////////////
-    
-    while (true)
+
+    // step() picks it up once the reactor returns from poll()
+    m_reactor.wake();
+}
+
+void UploaderService::cancelUploads()
+{
+    // cancelled uploads stay in the spool instead of being queued again
+    m_cancelling = true;
+
+    while (!appxferq[PUT].empty())
     {
-        if (client->wait())
+        AppFile* f = appxferq[PUT].front();
+
+        if (f->transfer)
         {
-            client->exec();
-            if (state == 2) break;
+            client->stopxfer(f);
         }
+
+        // also cancels its deadline, see fileRemoved()
+        delete f;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cancelled++;
     }
+
+    m_cancelling = false;
+}
+
+void UploaderService::drain(unsigned ms, Reactor::Task done)
+{
+    m_drainDone = done;
+    m_drainTimer = m_reactor.after(ms, [this]()
+    {
+        m_drainTimer = 0;
+
+        size_t waiting;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            waiting = waitingLocked();
+            for (int c = 0; c < UPLOAD_CLASSES; c++)
+            {
+                m_pending[c].clear();
+            }
+            m_pendingInMemory = 0;
+        }
+        cout << "Uploads still busy at shutdown: cancelling " << appxferq[PUT].size()
+             << " and " << (m_spool ? "leaving " : "dropping ") << waiting << " not yet started"
+             << (m_spool ? " in the spool" : "") << endl;
+
+        cancelUploads();
+        finishDrain();
+    });
+
+    m_reactor.wake();
+}
+
+void UploaderService::printStats()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    cout << "uploader: " << m_logins << " login(s), " << waitingLocked() << " waiting, " << m_started
+         << " started, " << m_completed << " completed, " << m_failed << " failed attempt(s), " << m_timedOut
+         << " timed out, " << m_cancelled << " cancelled, " << m_fromMemory << " from memory";
+    if (m_spool)
+    {
+        cout << ", " << m_fromSpool << " read back from the spool, " << m_requeued << " queued again";
+    }
+    if (m_started)
+    {
+        cout << ", queue to start avg " << m_totalStartMs / m_started << " ms max " << m_maxStartMs << " ms";
+    }
+    if (m_coldStartMs >= 0)
+    {
+        cout << ", last cold start " << m_coldStartMs << " ms";
+    }
+    if (m_warmStartMs >= 0)
+    {
+        cout << ", last warm start " << m_warmStartMs << " ms";
+    }
+    if (!m_parked.empty() || !m_retryTimers.empty())
+    {
+        cout << ", " << m_retryTimers.size() << " backing off, " << m_parked.size() << " parked";
+    }
+    cout << endl;
+
+    m_scheduler.printStats();
+    m_retry.printStats();
+}
+
+RetryPolicy& UploaderService::retryPolicy()
+{
+    return m_retry;
+}
+
+// reactor driver: one round of SDK work, then sleep in client->wait(),
+// i.e. in the reactor, until an fd, a timer or upload() needs us
+void UploaderService::step()
+{
+    // a failed password login waits for m_loginTimer, refused credentials
+    // are not tried again at all
+    if (client->loggedin() == NOTLOGGEDIN && !m_loginPending && !m_loginTimer && !m_loginRefused)
+    {
+        // after a failure, only try again once there is something to upload
+        bool idle;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            idle = waitingLocked() == 0;
+        }
+
+        if (!m_loginFailed || !idle)
+        {
+            login();
+        }
+    }
+
+    if (ready())
+    {
+        if (!m_sessionSaved)
+        {
+            recordStartup();
+            saveSession();
+        }
+        startPending();
+    }
+
+    if (m_drainDone && idle())
+    {
+        finishDrain();
+    }
+
+    // group commit: records appended since the last sync wait for one
+    // timer instead of each paying for an fsync
+    if (m_spool && !m_syncTimer && m_spool->dirty())
+    {
+        m_syncTimer = m_reactor.after(SPOOL_SYNC_MS, std::bind(&UploaderService::syncSpool, this));
+    }
+
+    client->exec();
+    client->wait();
+}
+
+void UploaderService::login()
+{
+    m_loginPending = true;
+    m_sessionSaved = false;
+    m_logins++;
+    m_loginStart = Clock::now();
+    m_startupTimer = m_reactor.after(STARTUP_TIMEOUT_MS, std::bind(&UploaderService::startupTimedOut, this));
+    cwd = UNDEF;
+
+    FILE* fp = m_usingSession ? NULL : fopen(m_sessionFile.c_str(), "r");
+    if (fp)
+    {
+        char b64[512];
+        byte session[sizeof b64];
+        bool ok = fgets(b64, sizeof b64, fp) != NULL;
+        fclose(fp);
+
+        int len = ok ? Base64::atob(strtok(b64, "\n"), session, sizeof session) : 0;
+        if (len > 0)
+        {
+            cout << "Resuming MEGA session..." << endl;
+            m_usingSession = true;
+            client->login(session, len);
+            return;
+        }
+    }
+
+    // deriving the password key is deliberately expensive, so do it once
+    if (!m_pwkeyValid)
+    {
+        client->pw_key(m_password.c_str(), m_pwkey);
+        m_pwkeyValid = true;
+    }
+
+    m_usingSession = false;
+    client->login(m_user.c_str(), m_pwkey);
+}
+
+// the login or the node tree fetch hung: drop the half-made session, the
+// next step() starts over
+void UploaderService::startupTimedOut()
+{
+    cout << "MEGA login timed out after " << STARTUP_TIMEOUT_MS / 1000 << " s, retrying" << endl;
+
+    m_startupTimer = 0;
+    m_loginPending = false;
+    m_usingSession = false;
+    client->locallogout();
+    cwd = UNDEF;
+}
+
+void UploaderService::uploadTimedOut(AppFile* f)
+{
+    cout << "Upload timed out after " << UPLOAD_TIMEOUT_MS / 1000 << " s, cancelling" << endl;
+
+    m_uploadTimers.erase(f);
+    m_retry.failure(RETRY_TRANSIENT);
+
+    std::map<AppFile*, ActiveUpload>::iterator a = m_active.find(f);
+    if (a != m_active.end())
+    {
+        a->second.failure = RETRY_TRANSIENT;
+    }
+
+    if (f->transfer)
+    {
+        client->stopxfer(f);
+    }
+    delete f;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_timedOut++;
+}
+
+void UploaderService::loginResult(error e)
+{
+    if (!m_loginPending)
+    {
+        // answer to a login startupTimedOut() already gave up on
+        return;
+    }
+    m_loginPending = false;
+
+    if (e)
+    {
+        m_reactor.cancel(m_startupTimer);
+        m_startupTimer = 0;
+
+        if (m_usingSession)
+        {
+            // stale session: fall back to the password on the next pass
+            cout << "Stored MEGA session rejected (" << errorstring(e) << ")" << endl;
+            unlink(m_sessionFile.c_str());
+        }
+        else if (retryClassOf(e) == RETRY_FATAL)
+        {
+            // wrong password, unknown or blocked account: asking again
+            // cannot help
+            cout << "Login failed: " << errorstring(e) << ", check the account and password; no more logins" << endl;
+            m_loginFailed = true;
+            m_loginRefused = true;
+        }
+        else
+        {
+            unsigned ms = LOGIN_RETRY_MS;
+            for (unsigned i = 0; i < m_loginFailures && ms < LOGIN_RETRY_MAX_MS; i++)
+            {
+                ms *= 2;
+            }
+            if (ms > LOGIN_RETRY_MAX_MS)
+            {
+                ms = LOGIN_RETRY_MAX_MS;
+            }
+            m_loginFailures++;
+
+            cout << "Login failed: " << errorstring(e) << ", trying again in " << ms / 1000 << " s" << endl;
+            m_loginFailed = true;
+            m_loginTimer = m_reactor.after(ms, [this]()
+            {
+                // the next step() logs in
+                m_loginTimer = 0;
+            });
+        }
+        m_usingSession = false;
+        return;
+    }
+
+    cout << "Login successful, retrieving account..." << endl;
+    m_loginFailed = false;
+    m_loginFailures = 0;
+    m_loginMs = std::chrono::duration<double, std::milli>(Clock::now() - m_loginStart).count();
+    client->fetchnodes();
+}
+
+void UploaderService::transferDone(Transfer* t, error e)
+{
+    bool ok = e == API_OK;
+
+    if (!ok)
+    {
+        RetryClass why = retryClassOf(e);
+        m_retry.failure(why);
+
+        // AppFile::failed() declines the SDK's own retry; once the SDK is
+        // done with the transfer, drop what is left of its files so that
+        // fileRemoved() frees their slots and retries them our way
+        for (file_list::iterator it = t->files.begin(); it != t->files.end(); it++)
+        {
+            AppFile* f = (AppFile*)*it;
+            std::map<AppFile*, ActiveUpload>::iterator a = m_active.find(f);
+
+            if (a != m_active.end())
+            {
+                a->second.failure = why;
+
+                // (f may be gone and its address reused by then)
+                unsigned long seq = a->second.seq;
+                m_reactor.after(0, [this, f, seq]()
+                {
+                    std::map<AppFile*, ActiveUpload>::iterator a = m_active.find(f);
+
+                    if (a != m_active.end() && a->second.seq == seq)
+                    {
+                        if (f->transfer)
+                        {
+                            client->stopxfer(f);
+                        }
+                        delete f;
+                    }
+                });
+            }
+        }
+    }
+    else if (m_retry.success())
+    {
+        requeueParked();
+    }
+
+    // throughput per class, from when the file got its slot
+    if (ok)
+    {
+        for (file_list::iterator it = t->files.begin(); it != t->files.end(); it++)
+        {
+            std::map<AppFile*, ActiveUpload>::iterator a = m_active.find((AppFile*)*it);
+
+            if (a != m_active.end())
+            {
+                double ms = std::chrono::duration<double, std::milli>(Clock::now() - a->second.started).count();
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_scheduler.completed(a->second.cls, t->size, ms);
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (ok)
+    {
+        m_completed++;
+    }
+    else
+    {
+        m_failed++;
+    }
+}
+
+void UploaderService::fileCompleted(AppFile* f)
+{
+    std::map<AppFile*, ActiveUpload>::iterator it = m_active.find(f);
+
+    if (it != m_active.end())
+    {
+        it->second.completed = true;
+    }
+}
+
+// an upload finished or was cancelled: disarm its deadline and drop its
+// buffer if it was a memory upload
+void UploaderService::fileRemoved(AppFile* f)
+{
+    if (m_fs)
+    {
+        m_fs->removefile(f->localname);
+    }
+
+    std::map<AppFile*, unsigned long>::iterator it = m_uploadTimers.find(f);
+
+    if (it != m_uploadTimers.end())
+    {
+        m_reactor.cancel(it->second);
+        m_uploadTimers.erase(it);
+    }
+
+    // its slot is free again; without fileCompleted() it failed or was
+    // cancelled
+    std::map<AppFile*, ActiveUpload>::iterator a = m_active.find(f);
+
+    if (a != m_active.end())
+    {
+        ActiveUpload done = a->second;
+        m_active.erase(a);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_scheduler.finished(done.cls, done.completed);
+        }
+
+        if (done.spoolId)
+        {
+            spooledFinished(done.spoolId, done.completed, done.failure);
+        }
+    }
+}
+
+// one file of spooled upload id is done with; once all of them are, the
+// upload leaves the spool, or if one failed it is retried after a backoff
+void UploaderService::spooledFinished(unsigned long id, bool ok, RetryClass why)
+{
+    if (!ok)
+    {
+        // removed without an error of its own (cancelled, or dropped by the SDK)
+        m_spoolFailed[id] = why == RETRY_CLASSES ? RETRY_TRANSIENT : why;
+    }
+
+    if (--m_spoolActive[id] > 0)
+    {
+        return;
+    }
+    m_spoolActive.erase(id);
+
+    std::map<unsigned long, RetryClass>::iterator failed = m_spoolFailed.find(id);
+    if (failed == m_spoolFailed.end())
+    {
+        m_attempts.erase(id);
+        m_spool->done(id);
+        return;
+    }
+    why = failed->second;
+    m_spoolFailed.erase(failed);
+
+    SpoolEntry e;
+    if (m_cancelling || !m_spool->entry(id, &e))
+    {
+        return;
+    }
+
+    if (why == RETRY_FATAL)
+    {
+        cout << "Upload of " << e.name << " cannot succeed, removing it from the spool" << endl;
+        m_attempts.erase(id);
+        m_spool->done(id);
+        return;
+    }
+
+    unsigned ms;
+    if (!m_retry.backoff(why, ++m_attempts[id], &ms))
+    {
+        cout << "Upload of " << e.name << " failed " << m_attempts[id] - 1 << " time(s), parking it until uploads succeed again" << endl;
+        m_parked.push_back(id);
+        return;
+    }
+
+    m_retryTimers[id] = m_reactor.after(ms, std::bind(&UploaderService::requeue, this, id));
+}
+
+// a failed spooled upload's turn has come again
+void UploaderService::requeue(unsigned long id)
+{
+    m_retryTimers.erase(id);
+
+    SpoolEntry e;
+    if (!m_spool->entry(id, &e))
+    {
+        return;
+    }
+
+    PendingUpload p;
+    p.path = e.name;
+    p.spoolId = id;
+    p.cls = UPLOAD_BULK;
+    p.queued = Clock::now();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_pending[p.cls].push_back(p);
+    m_requeued++;
+}
+
+// the backend works again: what ran out of retries gets a fresh budget
+void UploaderService::requeueParked()
+{
+    std::vector<unsigned long> parked;
+    parked.swap(m_parked);
+
+    for (size_t i = 0; i < parked.size(); i++)
+    {
+        m_attempts.erase(parked[i]);
+        requeue(parked[i]);
+    }
+}
+
+void UploaderService::syncSpool()
+{
+    m_syncTimer = 0;
+    m_spool->sync();
+}
+
+// logged in and the node tree is known (nodes_updated() sets cwd)
+bool UploaderService::ready()
+{
+    return !m_loginPending && client->loggedin() != NOTLOGGEDIN && !ISUNDEF(cwd);
+}
+
+bool UploaderService::idle()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return waitingLocked() == 0 && appxferq[PUT].empty();
+}
+
+size_t UploaderService::waitingLocked() const
+{
+    size_t n = 0;
+
+    for (int c = 0; c < UPLOAD_CLASSES; c++)
+    {
+        n += m_pending[c].size();
+    }
+
+    return n;
+}
+
+void UploaderService::finishDrain()
+{
+    if (m_drainTimer)
+    {
+        m_reactor.cancel(m_drainTimer);
+        m_drainTimer = 0;
+    }
+
+    Reactor::Task done;
+    done.swap(m_drainDone);
+    done();
+}
+
+// a resumed session can load the node tree from the local cache (warm),
+// a password login always downloads it (cold)
+void UploaderService::recordStartup()
+{
+    double totalMs = std::chrono::duration<double, std::milli>(Clock::now() - m_loginStart).count();
+    bool warm = m_usingSession;
+
+    m_reactor.cancel(m_startupTimer);
+    m_startupTimer = 0;
+
+    cout << "MEGA ready after " << totalMs << " ms (" << (warm ? "warm" : "cold") << " start: login "
+         << m_loginMs << " ms, node tree " << totalMs - m_loginMs << " ms, " << client->nodes.size()
+         << " nodes)" << endl;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    (warm ? m_warmStartMs : m_coldStartMs) = totalMs;
+}
+
+void UploaderService::saveSession()
+{
+    byte session[256];
+    char b64[sizeof session * 4 / 3 + 4];
+    int len = client->dumpsession(session, sizeof session);
+
+    m_sessionSaved = true;
+    if (len <= 0)
+    {
+        return;
+    }
+
+    Base64::btoa(session, len, b64);
+
+    // the session grants full account access: owner read/write only
+    int fd = open(m_sessionFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+    {
+        perror("Failed to store MEGA session");
+        return;
+    }
+    FILE* fp = fdopen(fd, "w");
+    fprintf(fp, "%s\n", b64);
+    fclose(fp);
+}
+
+// starts what the scheduler lets through, highest class first
+void UploaderService::startPending()
+{
+    while (true)
+    {
+        PendingUpload p;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            size_t waiting[UPLOAD_CLASSES];
+            for (int c = 0; c < UPLOAD_CLASSES; c++)
+            {
+                waiting[c] = m_pending[c].size();
+            }
+
+            UploadClass c = m_scheduler.next(waiting);
+
+            // the backend is down: leave everything queued (and spooled)
+            // until the breaker allows a trial upload
+            unsigned breakerMs = 0;
+            if (c != UPLOAD_CLASSES && !m_retry.allow(&breakerMs))
+            {
+                if (breakerMs && !m_breakerTimer)
+                {
+                    m_breakerTimer = m_reactor.after(breakerMs, [this]()
+                    {
+                        m_breakerTimer = 0;
+                    });
+                }
+                return;
+            }
+
+            if (c == UPLOAD_CLASSES)
+            {
+                // held back by the rate limit: step() again once it allows
+                unsigned ms = waitingLocked() ? m_scheduler.waitMs() : 0;
+                if (ms && !m_scheduleTimer)
+                {
+                    m_scheduleTimer = m_reactor.after(ms, [this]()
+                    {
+                        m_scheduleTimer = 0;
+                    });
+                }
+                return;
+            }
+
+            p = m_pending[c].front();
+            m_pending[c].pop_front();
+            if (p.data)
+            {
+                m_pendingInMemory--;
+            }
+        }
+
+        string localname;
+
+        if (!p.data && p.spoolId)
+        {
+            // left in the spool: read the bytes back now that it is their turn
+            SpoolEntry e;
+            if (!m_spool->entry(p.spoolId, &e))
+            {
+                continue;
+            }
+
+            if (!e.file.empty())
+            {
+                std::shared_ptr<std::vector<unsigned char> > buf = std::make_shared<std::vector<unsigned char> >();
+                if (!m_spool->load(e, *buf))
+                {
+                    cout << "Spooled copy of " << e.name << " is unreadable, dropping it" << endl;
+                    m_spool->done(p.spoolId);
+                    continue;
+                }
+                p.data = buf;
+
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_fromSpool++;
+            }
+        }
+
+        if (p.data)
+        {
+            // a name of its own, so that two uploads of the same name can be
+            // in flight at once; AppFilePut keeps only the last component
+            string name = p.path.substr(p.path.find_last_of('/') + 1);
+            string path = MEMORY_UPLOAD_DIR + std::to_string(++m_memorySeq) + "/" + name;
+
+            client->fsaccess->path2local(&path, &localname);
+            m_fs->addfile(localname, p.data);
+            cout << "Queueing " << name << " from memory..." << endl;
+            startUpload(&localname, p.spoolId, p.cls, p.data->size());
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_fromMemory++;
+        }
+        else
+        {
+            string name;
+            nodetype_t type;
+            unsigned files = 0;
+
+            client->fsaccess->path2local(&p.path, &localname);
+
+            DirAccess* da = client->fsaccess->newdiraccess();
+
+            if (da->dopen(&localname, NULL, true))
+            {
+                while (da->dnext(NULL, &localname, true, &type))
+                {
+                    client->fsaccess->local2path(&localname, &name);
+                    cout << "Queueing " << name << "..." << endl;
+
+                    if (type == FILENODE)
+                    {
+                        struct stat st;
+                        startUpload(&localname, p.spoolId, p.cls, stat(name.c_str(), &st) ? 0 : st.st_size);
+                        files++;
+                    }
+                }
+            }
+
+            delete da;
+
+            // gone since it was queued: nothing left to retry
+            if (!files && p.spoolId)
+            {
+                cout << "Nothing to upload at " << p.path << ", removing it from the spool" << endl;
+                m_spool->done(p.spoolId);
+            }
+        }
+
+        double ms = std::chrono::duration<double, std::milli>(Clock::now() - p.queued).count();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_started++;
+        m_totalStartMs += ms;
+        if (ms > m_maxStartMs)
+        {
+            m_maxStartMs = ms;
+        }
+    }
+}
+
+// queues an AppFilePut of localname (bytes long, of class cls) to cwd with
+// its deadline; spoolId (or 0) is the spooled upload it belongs to
+void UploaderService::startUpload(string* localname, unsigned long spoolId, UploadClass cls, size_t bytes)
+{
+    string targetuser;
+
+    AppFile* f = new AppFilePut(localname, cwd, targetuser.c_str());
+    f->appxfer_it = appxferq[PUT].insert(appxferq[PUT].end(), f);
+    m_uploadTimers[f] = m_reactor.after(UPLOAD_TIMEOUT_MS, std::bind(&UploaderService::uploadTimedOut, this, f));
+
+    ActiveUpload& a = m_active[f];
+    a.seq = ++m_activeSeq;
+    a.spoolId = spoolId;
+    a.cls = cls;
+    a.completed = false;
+    a.failure = RETRY_CLASSES;
+    a.started = Clock::now();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_scheduler.started(cls, bytes);
+    }
+    if (spoolId)
+    {
+        m_spoolActive[spoolId]++;
+    }
+
+    client->startxfer(PUT, f);
+}
+
+void loginAndUploadFile(const char* User, const char* Password, const char* FilePath)
+{
+    static std::mutex startMutex;
+    {
+        std::lock_guard<std::mutex> lock(startMutex);
+        if (!uploader)
+        {
+            Reactor* reactor = new Reactor;
+            (new UploaderService(*reactor, User, Password))->start();
+            std::thread(&Reactor::run, reactor).detach();
+        }
+    }
+
+    uploader->upload(FilePath);
 }
@@ -31,7 +31,20 @@ extern void term_echo(int);
 
 extern void read_pw_char(char*, int, int*, char**);
 
+#include "reactor.h"
+#include "upload_spool.h"
+#include "upload_scheduler.h"
+#include "retry_policy.h"
+
 #include <list>
+#include <deque>
+#include <map>
+#include <set>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 using namespace std;
 
 typedef list<struct AppFile*> appfile_list;
@@ -74,6 +87,63 @@ struct AppFilePut : public AppFile
     ~AppFilePut();
 };
 
+typedef std::shared_ptr<const std::vector<unsigned char> > MemoryFileData;
+
+// Filesystem access that can also serve files straight from memory: a
+// buffer registered under a local name is what the SDK reads when it opens
+// that name for an upload, so encoded frames are uploaded without being
+// written to and read back from the SD card. Every other name goes to the
+// platform's FSACCESS_CLASS. Registrations are made and dropped on the
+// client's thread.
+struct MemoryFileSystemAccess : public FSACCESS_CLASS
+{
+    FileAccess* newfileaccess();
+
+    void addfile(const string& localname, MemoryFileData data);
+    void removefile(const string& localname);
+
+    // NULL if localname is not a memory file
+    MemoryFileData findfile(const string& localname, m_time_t* mtime) const;
+
+    size_t files() const;
+
+private:
+    struct MemoryFile
+    {
+        MemoryFileData data;
+        m_time_t mtime;
+    };
+
+    map<string, MemoryFile> memfiles;
+};
+
+// FileAccess of MemoryFileSystemAccess: reads a memory file from its buffer
+// (read-only) and passes any other file on to the platform's FileAccess
+struct MemoryFileAccess : public FileAccess
+{
+    bool fopen(string*, bool, bool);
+    void updatelocalname(string*);
+    bool fwrite(const byte*, unsigned, m_off_t);
+
+    bool sysread(byte*, unsigned, m_off_t);
+    bool sysstat(m_time_t*, m_off_t*);
+    bool sysopen();
+    void sysclose();
+
+    MemoryFileAccess(MemoryFileSystemAccess*, FileAccess*);
+    ~MemoryFileAccess();
+
+private:
+    void copystate();
+
+    MemoryFileSystemAccess* fs;
+    FileAccess* disk;
+
+    // set while a memory file is open; NULL means disk
+    MemoryFileData data;
+    m_time_t datamtime;
+};
+
 struct AppReadContext
 {
     SymmCipher key;
@@ -189,4 +259,207 @@ struct DemoApp : public MegaApp
     void notify_retry(dstime);
 };
 
+// Waiter that sleeps in a Reactor instead of select(), so the SDK's sockets
+// share one epoll loop with the rest of the application: each
+// client->wait() registers the fds the SDK asked for and runs one poll() of
+// the reactor, which may dispatch any other fd or timer handler as well.
+class ReactorWaiter : public PosixWaiter
+{
+public:
+    explicit ReactorWaiter(Reactor& reactor);
+    ~ReactorWaiter();
+
+    int wait();
+    void notify();
+
+private:
+    void ready(int fd, uint32_t events);
+
+    Reactor& m_reactor;
+
+    // fds registered on the SDK's behalf in the previous round
+    std::set<int> m_fds;
+};
+
+// Long-lived MEGA session shared by all uploads. The client is created and
+// logged in once and then driven by the reactor passed in, whose run() loop
+// must be running on some thread; every method except upload() belongs on
+// that thread (or runs once run() has returned). The session is written to
+// sessionFile so that a restart resumes it instead of deriving the password
+// key and logging in from scratch. Login (up to the node tree) and each
+// upload have a deadline after which they are cancelled. Only one instance
+// may exist, since the SDK callbacks above reach it through globals.
+//
+// With an UploadSpool every upload is recorded in it until it completes:
+// what the previous run left pending is queued again by start(), and an
+// upload that times out is queued again rather than dropped. Beyond a few,
+// queued memory uploads are read back from the spool when their turn comes
+// instead of being held in RAM.
+//
+// Uploads wait in one queue per UploadClass, and an UploadScheduler picks
+// which one starts next.
+//
+// Failed uploads are retried by the service rather than by the SDK, as
+// the RetryPolicy says: a spooled upload goes back in the queue after its
+// backoff, and one whose budget is spent stays parked in the spool until
+// an upload succeeds again (or the next run). Nothing starts while the
+// policy's circuit breaker is open.
+class UploaderService
+{
+public:
+    UploaderService(Reactor& reactor, const char* user, const char* password,
+                    const char* sessionFile = ".mega_session");
+    ~UploaderService();
+
+    // before start(); spool must be open and outlive the service
+    void setSpool(UploadSpool* spool);
+
+    // before start(): files uploading at once, and the average upload
+    // rate in bytes/s (0 for no limit)
+    void setLimits(unsigned slots, double bytesPerSecond);
+
+    void start();
+    void stop();
+
+    // queue a local file for upload; any thread, returns immediately
+    void upload(const string& path, UploadClass cls = UPLOAD_NORMAL);
+
+    // queue data for upload as a file named after the last component of
+    // name, without touching the disk; takes data's contents (data is left
+    // empty). Any thread, returns immediately.
+    void upload(const string& name, std::vector<unsigned char>& data, UploadClass cls = UPLOAD_NORMAL);
+
+    // abort every upload in progress
+    void cancelUploads();
+
+    // calls done once nothing is waiting or uploading, or after ms
+    // milliseconds with whatever is left cancelled
+    void drain(unsigned ms, Reactor::Task done);
+
+    // reactor thread: reads the retry timers and parked uploads
+    void printStats();
+
+    RetryPolicy& retryPolicy();
+
+    // DemoApp/AppFile callbacks, reactor thread only
+    void loginResult(error e);
+    void transferDone(Transfer* t, error e);
+    void fileCompleted(AppFile* f);
+    void fileRemoved(AppFile* f);
+
+private:
+    void step();
+    void login();
+    void startupTimedOut();
+    void uploadTimedOut(AppFile* f);
+    bool ready();
+    bool idle();
+    void finishDrain();
+    void recordStartup();
+    void saveSession();
+    void startPending();
+    void startUpload(string* localname, unsigned long spoolId, UploadClass cls, size_t bytes);
+    void spooledFinished(unsigned long id, bool ok, RetryClass why);
+    void requeue(unsigned long id);
+    void requeueParked();
+    void syncSpool();
+    size_t waitingLocked() const;
+
+    Reactor& m_reactor;
+    ReactorWaiter* m_waiter;
+    MemoryFileSystemAccess* m_fs;
+    UploadSpool* m_spool;
+
+    string m_user;
+    string m_password;
+    string m_sessionFile;
+
+    bool m_loginPending;
+    bool m_loginFailed;
+    bool m_loginRefused;        // the credentials are wrong: no more logins
+    unsigned m_loginFailures;   // in a row, for the delay before the next
+    bool m_usingSession;
+    bool m_sessionSaved;
+    bool m_pwkeyValid;
+    byte m_pwkey[SymmCipher::KEYLENGTH];
+
+    // a path on disk, or the name and contents of a memory upload; the
+    // contents of a spooled upload may be left in the spool (data unset)
+    struct PendingUpload
+    {
+        string path;
+        MemoryFileData data;
+        unsigned long spoolId;
+        UploadClass cls;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    std::mutex m_mutex;
+    std::deque<PendingUpload> m_pending[UPLOAD_CLASSES];
+    size_t m_pendingInMemory;
+    unsigned long m_memorySeq;
+
+    // each file in flight, reactor thread only
+    struct ActiveUpload
+    {
+        unsigned long seq;
+        unsigned long spoolId;
+        UploadClass cls;
+        bool completed;
+
+        // why it failed, RETRY_CLASSES if it has not
+        RetryClass failure;
+        std::chrono::steady_clock::time_point started;
+    };
+
+    std::map<AppFile*, ActiveUpload> m_active;
+    unsigned long m_activeSeq;
+
+    // under m_mutex, for printStats()
+    UploadScheduler m_scheduler;
+    unsigned long m_scheduleTimer;
+
+    // how many files each spooled upload has in flight (a path may be a
+    // pattern), reactor thread only
+    std::map<unsigned long, unsigned> m_spoolActive;
+    std::map<unsigned long, RetryClass> m_spoolFailed;
+    bool m_cancelling;
+
+    // failed spooled uploads: attempts so far, backoff timers, and those
+    // waiting for the backend to come back; reactor thread only
+    RetryPolicy m_retry;
+    std::map<unsigned long, unsigned> m_attempts;
+    std::map<unsigned long, unsigned long> m_retryTimers;
+    std::vector<unsigned long> m_parked;
+    unsigned long m_breakerTimer;
+
+    // reactor timer ids, 0 when not armed
+    unsigned long m_startupTimer;
+    unsigned long m_loginTimer;
+    unsigned long m_drainTimer;
+    unsigned long m_syncTimer;
+    std::map<AppFile*, unsigned long> m_uploadTimers;
+    Reactor::Task m_drainDone;
+
+    unsigned long m_logins;
+    unsigned long m_started;
+    unsigned long m_completed;
+    unsigned long m_failed;
+    unsigned long m_timedOut;
+    unsigned long m_cancelled;
+    unsigned long m_fromMemory;
+    unsigned long m_fromSpool;
+    unsigned long m_requeued;
+    double m_totalStartMs;
+    double m_maxStartMs;
+
+    // login() to node tree available, split into login and fetchnodes
+    std::chrono::steady_clock::time_point m_loginStart;
+    double m_loginMs;
+    double m_coldStartMs;
+    double m_warmStartMs;
+};
+
+// uploads through a process-wide UploaderService, created on first use
+// together with a thread running its reactor
 void loginAndUploadFile(const char* User, const char* Password, const char* FilePath);
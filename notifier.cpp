@@ -0,0 +1,303 @@
+#include "notifier.h"
+
+#include <stdio.h>
+
+typedef std::chrono::steady_clock Clock;
+
+Notification::Notification()
+{
+    stamp = 0;
+}
+
+static std::string formatTime(time_t t, const char* format = "%Y-%m-%d %H:%M:%S")
+{
+    char buf[64];
+    struct tm tm;
+    localtime_r(&t, &tm);
+    strftime(buf, sizeof buf, format, &tm);
+    return buf;
+}
+
+// "cam0_20261016_140102.jpg" -> "cam0_20261016_140102_thumb.jpg"
+static std::string thumbnailName(const std::string& file)
+{
+    size_t dot = file.rfind('.');
+    return (dot == std::string::npos ? file : file.substr(0, dot)) + "_thumb.jpg";
+}
+
+static void attachThumbnail(SmtpMessage& mail, const Notification& n)
+{
+    SmtpAttachment a;
+    a.name = thumbnailName(n.file);
+    a.type = "image/jpeg";
+    a.data = n.thumbnail;
+    mail.attachments.push_back(a);
+}
+
+NotificationAggregator::NotificationAggregator(Reactor& reactor, const std::vector<std::string>& recipients,
+                                               const std::string& from, MailSender send, unsigned digestSeconds,
+                                               double mailsPerHour)
+    : m_reactor(reactor)
+{
+    m_from = from;
+    m_send = send;
+    m_digestSeconds = digestSeconds;
+    m_rate = mailsPerHour / 3600;
+
+    // never reallocated after this: the digest timers point into it
+    m_recipients.resize(recipients.size());
+    for (size_t i = 0; i < recipients.size(); i++)
+    {
+        Recipient& r = m_recipients[i];
+
+        r.address = recipients[i];
+        r.tokens = NOTIFY_BURST;
+        r.refilled = Clock::now();
+        r.holding = false;
+        r.timer = 0;
+        r.digest.events = 0;
+        r.alerts = 0;
+        r.digests = 0;
+        r.digested = 0;
+        r.limited = 0;
+    }
+
+    m_events = 0;
+    m_thumbnails = 0;
+}
+
+NotificationAggregator::~NotificationAggregator()
+{
+    for (size_t i = 0; i < m_recipients.size(); i++)
+    {
+        m_reactor.cancel(m_recipients[i].timer);
+    }
+}
+
+void NotificationAggregator::notify(const Notification& n)
+{
+    m_events++;
+    if (n.thumbnail)
+    {
+        m_thumbnails++;
+    }
+
+    for (size_t i = 0; i < m_recipients.size(); i++)
+    {
+        Recipient& r = m_recipients[i];
+
+        // the spell goes on until a digest period passes without events
+        if (r.holding)
+        {
+            add(r.digest, n);
+            continue;
+        }
+
+        r.holding = true;
+        unsigned waitMs;
+        if (take(r, &waitMs))
+        {
+            sendAlert(r, n);
+            arm(r, m_digestSeconds * 1000);
+        }
+        else
+        {
+            r.limited++;
+            add(r.digest, n);
+            arm(r, waitMs);
+        }
+    }
+}
+
+void NotificationAggregator::flush()
+{
+    for (size_t i = 0; i < m_recipients.size(); i++)
+    {
+        Recipient& r = m_recipients[i];
+
+        m_reactor.cancel(r.timer);
+        r.timer = 0;
+        r.holding = false;
+
+        if (r.digest.events)
+        {
+            sendDigest(r);
+        }
+    }
+}
+
+// token bucket: m_rate tokens per second, NOTIFY_BURST at most
+bool NotificationAggregator::take(Recipient& r, unsigned* waitMs)
+{
+    if (m_rate <= 0)
+    {
+        return true;
+    }
+
+    Clock::time_point now = Clock::now();
+    r.tokens += std::chrono::duration<double>(now - r.refilled).count() * m_rate;
+    if (r.tokens > NOTIFY_BURST)
+    {
+        r.tokens = NOTIFY_BURST;
+    }
+    r.refilled = now;
+
+    if (r.tokens >= 1)
+    {
+        r.tokens -= 1;
+        return true;
+    }
+
+    *waitMs = (unsigned)((1 - r.tokens) / m_rate * 1000) + 1;
+    return false;
+}
+
+void NotificationAggregator::add(Digest& d, const Notification& n)
+{
+    if (!d.events)
+    {
+        d.first = n.stamp;
+    }
+    d.last = n.stamp;
+    d.events++;
+    d.cameras[n.camera]++;
+
+    if (d.files.size() < DIGEST_FILES)
+    {
+        d.files.push_back(n.file);
+    }
+
+    // the first ones, and the latest in the last slot
+    if (n.thumbnail)
+    {
+        if (d.thumbnails.size() < DIGEST_THUMBNAILS)
+        {
+            d.thumbnails.push_back(n);
+        }
+        else
+        {
+            d.thumbnails.back() = n;
+        }
+    }
+}
+
+void NotificationAggregator::arm(Recipient& r, unsigned ms)
+{
+    Recipient* p = &r;
+
+    m_reactor.cancel(r.timer);
+    r.timer = m_reactor.after(ms, [this, p]()
+    {
+        digestDue(p);
+    });
+}
+
+void NotificationAggregator::digestDue(Recipient* r)
+{
+    r->timer = 0;
+
+    if (!r->digest.events)
+    {
+        // a whole period without events: the next one is news again
+        r->holding = false;
+        return;
+    }
+
+    unsigned waitMs;
+    if (!take(*r, &waitMs))
+    {
+        r->limited++;
+        arm(*r, waitMs);
+        return;
+    }
+
+    sendDigest(*r);
+    arm(*r, m_digestSeconds * 1000);
+}
+
+void NotificationAggregator::sendAlert(Recipient& r, const Notification& n)
+{
+    char text[512];
+    snprintf(text, sizeof text,
+             "The camera have detected something strange (%s) at %s.\n\n"
+             "Further events will be mailed as a digest every %u minute(s) while they last.\n",
+             n.file.c_str(), formatTime(n.stamp).c_str(), (m_digestSeconds + 59) / 60);
+
+    SmtpMessage mail;
+    mail.from = m_from;
+    mail.to = r.address;
+    mail.subject = "Camera notification";
+    mail.body = text;
+    if (n.thumbnail)
+    {
+        attachThumbnail(mail, n);
+    }
+
+    r.alerts++;
+    m_send(mail);
+}
+
+void NotificationAggregator::sendDigest(Recipient& r)
+{
+    Digest& d = r.digest;
+    char line[256];
+
+    SmtpMessage mail;
+    mail.from = m_from;
+    mail.to = r.address;
+
+    snprintf(line, sizeof line, "Camera digest: %lu event(s)", d.events);
+    mail.subject = line;
+
+    // the date once if the range does not span midnight
+    bool sameDay = formatTime(d.first, "%Y%m%d") == formatTime(d.last, "%Y%m%d");
+    snprintf(line, sizeof line, "%lu event(s) between %s and %s.\n\n", d.events, formatTime(d.first).c_str(),
+             formatTime(d.last, sameDay ? "%H:%M:%S" : "%Y-%m-%d %H:%M:%S").c_str());
+    mail.body = line;
+
+    for (std::map<std::string, unsigned long>::const_iterator it = d.cameras.begin(); it != d.cameras.end(); ++it)
+    {
+        snprintf(line, sizeof line, "  %s: %lu\n", it->first.c_str(), it->second);
+        mail.body += line;
+    }
+
+    mail.body += "\nFiles, in the MEGA Cloud Drive:\n";
+    for (size_t i = 0; i < d.files.size(); i++)
+    {
+        mail.body += "  " + d.files[i] + "\n";
+    }
+    if (d.events > d.files.size())
+    {
+        snprintf(line, sizeof line, "  and %lu more\n", d.events - (unsigned long)d.files.size());
+        mail.body += line;
+    }
+
+    for (size_t i = 0; i < d.thumbnails.size(); i++)
+    {
+        attachThumbnail(mail, d.thumbnails[i]);
+    }
+
+    r.digests++;
+    r.digested += d.events;
+
+    d.events = 0;
+    d.cameras.clear();
+    d.files.clear();
+    d.thumbnails.clear();
+
+    m_send(mail);
+}
+
+void NotificationAggregator::printStats()
+{
+    printf("notifications: %lu event(s), %lu thumbnail(s), digest every %u s, %.0f mail(s)/hour per recipient\n",
+           m_events, m_thumbnails, m_digestSeconds, m_rate * 3600);
+
+    for (size_t i = 0; i < m_recipients.size(); i++)
+    {
+        const Recipient& r = m_recipients[i];
+
+        printf("  %s: %lu alert(s), %lu digest(s) of %lu event(s), %lu held back by the rate limit, %lu pending\n",
+               r.address.c_str(), r.alerts, r.digests, r.digested, r.limited, r.digest.events);
+    }
+}
@@ -0,0 +1,116 @@
+#ifndef NOTIFIER_H
+#define NOTIFIER_H
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <time.h>
+#include <vector>
+
+#include "reactor.h"
+#include "smtp.h"
+
+#define NOTIFY_DIGEST_SECONDS 600 // default time between digests while events keep coming
+#define NOTIFY_MAILS_PER_HOUR 6 // default mail rate per recipient, alerts and digests together
+#define NOTIFY_BURST 3 // mails a recipient may get back to back before the rate applies
+#define DIGEST_THUMBNAILS 6 // thumbnails attached to a digest
+#define DIGEST_FILES 50 // event files listed in a digest, the rest are only counted
+#define THUMBNAIL_SPACING 10 // seconds between the events that get a thumbnail, per camera
+
+// one detection event, as far as mail is concerned
+struct Notification
+{
+    std::string camera;
+    std::string file;       // event file, as uploaded
+    time_t stamp;
+
+    // small JPEG, or empty; shared by every mail that attaches it
+    std::shared_ptr<const std::vector<unsigned char> > thumbnail;
+
+    Notification();
+};
+
+typedef std::function<void(const SmtpMessage& mail)> MailSender;
+
+// Turns a stream of detection events into a few mails. The first event
+// after a quiet spell is mailed at once; the ones that follow are collected
+// and mailed as a digest (count, time range, events per camera, file names
+// and a handful of thumbnails) every digestSeconds for as long as they keep
+// coming. A digest period without events ends the spell.
+//
+// Every recipient has a token bucket of mailsPerHour (NOTIFY_BURST deep)
+// covering alerts and digests alike. Without a token an alert goes into the
+// digest, and a digest waits and keeps growing until there is one, so a
+// recipient never gets more than the rate whatever the camera sees. The
+// memory a digest holds is bounded by DIGEST_FILES and DIGEST_THUMBNAILS.
+//
+// Thumbnails come ready encoded with the events; the caller makes one at
+// most every THUMBNAIL_SPACING seconds, as a digest only keeps a few.
+//
+// Reactor thread only.
+class NotificationAggregator
+{
+public:
+    NotificationAggregator(Reactor& reactor, const std::vector<std::string>& recipients, const std::string& from,
+                           MailSender send, unsigned digestSeconds = NOTIFY_DIGEST_SECONDS,
+                           double mailsPerHour = NOTIFY_MAILS_PER_HOUR);
+    ~NotificationAggregator();
+
+    void notify(const Notification& n);
+
+    // mails the pending digests now, whatever the rate limit (at shutdown)
+    void flush();
+
+    void printStats();
+
+private:
+    NotificationAggregator(const NotificationAggregator&);
+    NotificationAggregator& operator=(const NotificationAggregator&);
+
+    struct Digest
+    {
+        unsigned long events;
+        time_t first;
+        time_t last;
+        std::map<std::string, unsigned long> cameras;
+        std::vector<std::string> files;
+        std::vector<Notification> thumbnails;
+    };
+
+    struct Recipient
+    {
+        std::string address;
+        double tokens;
+        std::chrono::steady_clock::time_point refilled;
+        bool holding;           // in a spell: events go to the digest
+        unsigned long timer;
+        Digest digest;
+
+        unsigned long alerts;
+        unsigned long digests;
+        unsigned long digested;
+        unsigned long limited;  // alerts and digests held back by the rate
+    };
+
+    bool take(Recipient& r, unsigned* waitMs);
+    void add(Digest& d, const Notification& n);
+    void arm(Recipient& r, unsigned ms);
+    void digestDue(Recipient* r);
+    void sendAlert(Recipient& r, const Notification& n);
+    void sendDigest(Recipient& r);
+
+    Reactor& m_reactor;
+    std::string m_from;
+    MailSender m_send;
+    unsigned m_digestSeconds;
+    double m_rate;
+
+    std::vector<Recipient> m_recipients;
+
+    unsigned long m_events;
+    unsigned long m_thumbnails;
+};
+
+#endif
@@ -0,0 +1,656 @@
+#include "pipeline.h"
+
+#include <chrono>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// reset a non-blocking eventfd to zero
+static void resetFd(int fd)
+{
+    uint64_t n;
+    while (read(fd, &n, sizeof n) < 0 && errno == EINTR)
+    {
+    }
+}
+
+// wait for an eventfd to become non-zero and reset it
+static void waitFd(int fd)
+{
+    struct pollfd p = { fd, POLLIN, 0 };
+    while (::poll(&p, 1, -1) < 0 && errno == EINTR)
+    {
+    }
+    resetFd(fd);
+}
+
+static void signalFd(int fd)
+{
+    uint64_t one = 1;
+    while (write(fd, &one, sizeof one) < 0 && errno == EINTR)
+    {
+    }
+}
+
+FramePool::FramePool(size_t count)
+{
+    m_frames = new Frame[count];
+    m_count = count;
+    m_next = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        m_frames[i].inUse.store(false, std::memory_order_relaxed);
+    }
+}
+
+FramePool::~FramePool()
+{
+    delete[] m_frames;
+}
+
+Frame* FramePool::acquire()
+{
+    for (size_t i = 0; i < m_count; i++)
+    {
+        Frame* f = &m_frames[(m_next + i) % m_count];
+
+        if (!f->inUse.load(std::memory_order_acquire))
+        {
+            // only this thread ever marks frames as in use
+            f->inUse.store(true, std::memory_order_relaxed);
+            m_next = (m_next + i + 1) % m_count;
+            return f;
+        }
+    }
+
+    return NULL;
+}
+
+void FramePool::release(Frame* f)
+{
+    f->inUse.store(false, std::memory_order_release);
+}
+
+const char* dropPolicyName(DropPolicy policy)
+{
+    switch (policy)
+    {
+        case DROP_BLOCK:
+            return "block";
+        case DROP_NEWEST:
+            return "newest";
+        case DROP_OLDEST:
+            return "oldest";
+    }
+
+    return "unknown";
+}
+
+bool parseDropPolicy(const char* name, DropPolicy* policy)
+{
+    if (!strcmp(name, "block"))
+    {
+        *policy = DROP_BLOCK;
+    }
+    else if (!strcmp(name, "newest"))
+    {
+        *policy = DROP_NEWEST;
+    }
+    else if (!strcmp(name, "oldest"))
+    {
+        *policy = DROP_OLDEST;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+Stage::Stage(const char* name, size_t capacity, DropPolicy policy, FramePool& pool)
+    : m_name(name), m_ring(capacity), m_policy(policy), m_pool(pool)
+{
+    // non-blocking so that a consumer driven by epoll can reset them
+    m_dataFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    m_spaceFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    m_closed.store(false);
+    m_pushed.store(0);
+    m_popped.store(0);
+    m_dropped.store(0);
+    m_highWater.store(0);
+}
+
+Stage::~Stage()
+{
+    close();
+    ::close(m_dataFd);
+    ::close(m_spaceFd);
+}
+
+bool Stage::push(Frame* f)
+{
+    while (!m_ring.push(f))
+    {
+        if (m_policy != DROP_BLOCK || m_closed.load())
+        {
+            m_dropped++;
+            m_pool.release(f);
+            return false;
+        }
+
+        waitFd(m_spaceFd);
+    }
+
+    m_pushed++;
+
+    size_t depth = m_ring.size();
+    if (depth > m_highWater.load(std::memory_order_relaxed))
+    {
+        m_highWater.store(depth, std::memory_order_relaxed);
+    }
+
+    signalFd(m_dataFd);
+    return true;
+}
+
+Frame* Stage::pop()
+{
+    Frame* f;
+
+    while (!(f = tryPop()))
+    {
+        if (m_closed.load())
+        {
+            // a frame may have been pushed just before close()
+            return tryPop();
+        }
+
+        waitFd(m_dataFd);
+    }
+
+    return f;
+}
+
+Frame* Stage::tryPop()
+{
+    Frame* f;
+
+    // reset before looking, so a push racing with us leaves fd() readable
+    resetFd(m_dataFd);
+    if (!m_ring.pop(f))
+    {
+        return NULL;
+    }
+    m_popped++;
+
+    if (m_policy == DROP_OLDEST)
+    {
+        Frame* newer;
+        while (m_ring.pop(newer))
+        {
+            m_popped++;
+            m_dropped++;
+            m_pool.release(f);
+            f = newer;
+        }
+    }
+    else if (m_policy == DROP_BLOCK)
+    {
+        signalFd(m_spaceFd);
+    }
+
+    return f;
+}
+
+void Stage::close()
+{
+    if (!m_closed.exchange(true))
+    {
+        signalFd(m_dataFd);
+        signalFd(m_spaceFd);
+    }
+}
+
+bool Stage::closed() const
+{
+    return m_closed.load();
+}
+
+bool Stage::drained() const
+{
+    return m_closed.load() && m_ring.size() == 0;
+}
+
+int Stage::fd() const
+{
+    return m_dataFd;
+}
+
+const char* Stage::name() const
+{
+    return m_name;
+}
+
+StageStats Stage::stats() const
+{
+    StageStats s;
+
+    s.pushed = m_pushed.load();
+    s.popped = m_popped.load();
+    s.dropped = m_dropped.load();
+    s.depth = m_ring.size();
+    s.highWater = m_highWater.load();
+    s.capacity = m_ring.capacity();
+
+    return s;
+}
+
+PipelineConfig::PipelineConfig()
+{
+    analysisDepth = 4;
+    eventDepth = 8;
+    analysisPolicy = DROP_OLDEST;
+    eventPolicy = DROP_NEWEST;
+    captureIntervalMs = 1000;
+    analysisThread = true;
+    actThread = true;
+    stopAtEnd = false;
+
+    // every queued frame plus one in the hands of each thread
+    poolSize = analysisDepth + eventDepth + 3;
+}
+
+Pipeline::Pipeline(const PipelineConfig& config, CaptureFn capture, AnalyseFn analyse, ActFn act)
+    : m_config(config),
+      m_capture(capture),
+      m_analyse(analyse),
+      m_act(act),
+      m_pool(config.poolSize),
+      m_analysisStage("analysis", config.analysisDepth, config.analysisPolicy, m_pool),
+      m_eventStage("event", config.eventDepth, config.eventPolicy, m_pool)
+{
+    m_running.store(false);
+    m_captureIntervalMs.store(config.captureIntervalMs);
+    m_poolExhausted.store(0);
+}
+
+Pipeline::~Pipeline()
+{
+    stop();
+}
+
+void Pipeline::start()
+{
+    m_running.store(true);
+
+    if (m_config.actThread)
+    {
+        m_actThread = std::thread(&Pipeline::actLoop, this);
+    }
+    if (m_config.analysisThread)
+    {
+        m_analyseThread = std::thread(&Pipeline::analyseLoop, this);
+    }
+    m_captureThread = std::thread(&Pipeline::captureLoop, this);
+}
+
+void Pipeline::stop()
+{
+    m_running.store(false);
+
+    // close before joining: with DROP_BLOCK the capture thread may be
+    // blocked pushing into a full analysis stage, behind an analysis worker
+    // blocked pushing into a full event stage that only our caller drains
+    m_analysisStage.close();
+    if (!m_config.actThread || !m_config.analysisThread)
+    {
+        // nobody drains the event stage while we wait for the threads, so
+        // it must not block them; and an owner-run analysis stage may
+        // still be running, so the act thread cannot wait for it
+        m_eventStage.close();
+    }
+
+    if (m_captureThread.joinable())
+    {
+        m_captureThread.join();
+    }
+    if (m_analyseThread.joinable())
+    {
+        m_analyseThread.join();
+    }
+    if (m_actThread.joinable())
+    {
+        m_actThread.join();
+    }
+}
+
+int Pipeline::eventFd() const
+{
+    return m_eventStage.fd();
+}
+
+void Pipeline::dispatchEvents()
+{
+    Frame* f;
+
+    while ((f = m_eventStage.tryPop()))
+    {
+        m_act(*f);
+        m_pool.release(f);
+    }
+}
+
+void Pipeline::setAnalysisReady(ReadyFn ready)
+{
+    m_analysisReady = ready;
+}
+
+bool Pipeline::analyseNext()
+{
+    Frame* f = m_analysisStage.tryPop();
+    if (!f)
+    {
+        if (m_analysisStage.drained())
+        {
+            m_eventStage.close();
+        }
+        return false;
+    }
+
+    analyseFrame(f);
+    return true;
+}
+
+bool Pipeline::analysisPending() const
+{
+    if (!m_analysisStage.drained())
+    {
+        return m_analysisStage.stats().depth > 0;
+    }
+
+    return !m_eventStage.closed();
+}
+
+void Pipeline::setCaptureInterval(unsigned ms)
+{
+    m_captureIntervalMs.store(ms);
+}
+
+bool Pipeline::finished() const
+{
+    return m_config.stopAtEnd && m_eventStage.drained();
+}
+
+void Pipeline::printStats()
+{
+    const Stage* stages[] = { &m_analysisStage, &m_eventStage };
+
+    for (unsigned i = 0; i < sizeof stages / sizeof *stages; i++)
+    {
+        StageStats s = stages[i]->stats();
+
+        printf("%s stage: depth %zu/%zu (max %zu), pushed %lu, popped %lu, dropped %lu\n",
+               stages[i]->name(), s.depth, s.capacity, s.highWater, s.pushed, s.popped, s.dropped);
+    }
+
+    printf("frame pool exhausted %lu time(s)\n", m_poolExhausted.load());
+}
+
+// sleeps up to ms milliseconds, returning early once the pipeline stops
+static void sleepWhileRunning(std::atomic<bool>& running, unsigned ms)
+{
+    const unsigned slice = 100;
+
+    while (ms && running.load())
+    {
+        unsigned t = ms < slice ? ms : slice;
+        std::this_thread::sleep_for(std::chrono::milliseconds(t));
+        ms -= t;
+    }
+}
+
+// sleeps until the capture interval has passed since start, returning early
+// once the pipeline stops. The interval is re-read every slice, so that
+// setCaptureInterval() applies to the capture being waited for.
+void Pipeline::waitForNextCapture(std::chrono::steady_clock::time_point start)
+{
+    const long long slice = 100;
+
+    while (m_running.load())
+    {
+        long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                std::chrono::steady_clock::now() - start).count();
+        long long left = m_captureIntervalMs.load() - elapsed;
+        if (left <= 0)
+        {
+            return;
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(left < slice ? left : slice));
+    }
+}
+
+void Pipeline::captureLoop()
+{
+    unsigned long seq = 0;
+
+    while (m_running.load())
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        Frame* f = m_pool.acquire();
+        if (!f)
+        {
+            // every frame is still queued or being processed downstream
+            m_poolExhausted++;
+            waitForNextCapture(start);
+            continue;
+        }
+
+        if (!m_capture(f->img))
+        {
+            m_pool.release(f);
+            if (m_config.stopAtEnd)
+            {
+                break;
+            }
+            sleepWhileRunning(m_running, 10000);
+            continue;
+        }
+
+        f->seq = ++seq;
+        f->stamp = time(NULL);
+        f->score = 0;
+        f->average = 0;
+        f->region = cv::Rect();
+        f->trigger = false;
+        f->jpeg.clear();
+        f->thumbnail.clear();
+        m_analysisStage.push(f);
+        if (m_analysisReady)
+        {
+            m_analysisReady();
+        }
+
+        waitForNextCapture(start);
+    }
+
+    m_analysisStage.close();
+    if (m_analysisReady)
+    {
+        m_analysisReady();
+    }
+}
+
+void Pipeline::analyseLoop()
+{
+    Frame* f;
+
+    while ((f = m_analysisStage.pop()))
+    {
+        analyseFrame(f);
+    }
+
+    m_eventStage.close();
+}
+
+void Pipeline::analyseFrame(Frame* f)
+{
+    if (m_analyse(*f))
+    {
+        m_eventStage.push(f);
+    }
+    else
+    {
+        m_pool.release(f);
+    }
+}
+
+void Pipeline::actLoop()
+{
+    Frame* f;
+
+    while ((f = m_eventStage.pop()))
+    {
+        m_act(*f);
+        m_pool.release(f);
+    }
+}
+
+AnalysisPool::AnalysisPool(unsigned workers)
+{
+    m_workerCount = workers ? workers : 1;
+    m_stopping = false;
+}
+
+AnalysisPool::~AnalysisPool()
+{
+    stop();
+}
+
+void AnalysisPool::add(Pipeline& pipeline, const std::string& name)
+{
+    Member m;
+    m.pipeline = &pipeline;
+    m.name = name;
+    m.queued = false;
+    m.running = false;
+    m.analysed = 0;
+    m.busyMs = 0;
+    m.maxMs = 0;
+
+    size_t index = m_members.size();
+    m_members.push_back(m);
+    pipeline.setAnalysisReady([this, index]()
+    {
+        ready(index);
+    });
+}
+
+void AnalysisPool::start()
+{
+    m_stopping = false;
+    for (unsigned i = 0; i < m_workerCount; i++)
+    {
+        m_workers.push_back(std::thread(&AnalysisPool::workerLoop, this));
+    }
+}
+
+void AnalysisPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_cond.notify_all();
+
+    for (size_t i = 0; i < m_workers.size(); i++)
+    {
+        m_workers[i].join();
+    }
+    m_workers.clear();
+}
+
+// capture thread of member index: queue it unless a worker already has it;
+// a running member is requeued by its worker if it still has work
+void AnalysisPool::ready(size_t index)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Member& m = m_members[index];
+
+    if (!m.queued && !m.running)
+    {
+        m.queued = true;
+        m_ready.push_back(index);
+        m_cond.notify_one();
+    }
+}
+
+void AnalysisPool::workerLoop()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (true)
+    {
+        while (m_ready.empty() && !m_stopping)
+        {
+            m_cond.wait(lock);
+        }
+        if (m_ready.empty())
+        {
+            break;
+        }
+
+        size_t index = m_ready.front();
+        m_ready.pop_front();
+        Member& m = m_members[index];
+        m.queued = false;
+        m.running = true;
+        lock.unlock();
+
+        // one frame per turn
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        bool analysed = m.pipeline->analyseNext();
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        lock.lock();
+        m.running = false;
+        if (analysed)
+        {
+            m.analysed++;
+            m.busyMs += ms;
+            if (ms > m.maxMs)
+            {
+                m.maxMs = ms;
+            }
+        }
+
+        // anything captured while we ran did not queue us, so look again
+        if (m.pipeline->analysisPending())
+        {
+            m.queued = true;
+            m_ready.push_back(index);
+            m_cond.notify_one();
+        }
+    }
+}
+
+void AnalysisPool::printStats()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    printf("analysis pool: %u worker(s), %zu waiting\n", m_workerCount, m_ready.size());
+    for (size_t i = 0; i < m_members.size(); i++)
+    {
+        const Member& m = m_members[i];
+
+        printf("  %s: analysed %lu, mean %.2f ms, max %.2f ms\n", m.name.c_str(), m.analysed,
+               m.analysed ? m.busyMs / m.analysed : 0.0, m.maxMs);
+    }
+}
@@ -0,0 +1,293 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <opencv2/opencv.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+#include "spsc_ring.h"
+
+// A captured frame travelling through the pipeline. Frames come from a fixed
+// pool; their pixel buffers are reused, so same-sized captures never
+// allocate.
+struct Frame
+{
+    cv::Mat img;
+    unsigned long seq;
+    time_t stamp;
+
+    // filled in by the analysis stage; region is where the change is, if
+    // the analysis can tell (empty otherwise), and trigger is false for
+    // frames passed on only as context of an event
+    double score;
+    double average;
+    cv::Rect region;
+    bool trigger;
+
+    // encoded by the analysis stage for the act stage, so that the act
+    // stage (often an event loop) never compresses images itself: jpeg is
+    // the frame as the act stage stores it, thumbnail a small copy or empty
+    std::vector<unsigned char> jpeg;
+    std::vector<unsigned char> thumbnail;
+
+    std::atomic<bool> inUse;
+};
+
+class FramePool
+{
+public:
+    explicit FramePool(size_t count);
+    ~FramePool();
+
+    // capture thread only; NULL when every frame is still in flight
+    Frame* acquire();
+
+    // any thread
+    void release(Frame* f);
+
+private:
+    FramePool(const FramePool&);
+    FramePool& operator=(const FramePool&);
+
+    Frame* m_frames;
+    size_t m_count;
+    size_t m_next;
+};
+
+// what a stage does when its producer outruns its consumer
+enum DropPolicy
+{
+    DROP_BLOCK,     // producer waits for space
+    DROP_NEWEST,    // a frame arriving at a full stage is discarded
+    DROP_OLDEST     // the consumer skips to the newest queued frame and
+                    // discards the older ones (a full stage still rejects
+                    // the incoming frame)
+};
+
+const char* dropPolicyName(DropPolicy policy);
+bool parseDropPolicy(const char* name, DropPolicy* policy);
+
+struct StageStats
+{
+    unsigned long pushed;
+    unsigned long popped;
+    unsigned long dropped;
+    size_t depth;
+    size_t highWater;
+    size_t capacity;
+};
+
+// One hop of the pipeline: an SPSC ring of frame handles plus an eventfd the
+// consumer blocks on while the ring is empty.
+class Stage
+{
+public:
+    Stage(const char* name, size_t capacity, DropPolicy policy, FramePool& pool);
+    ~Stage();
+
+    // producer: hands f over to the stage. Returns false if the drop policy
+    // discarded it, in which case it has already gone back to the pool.
+    bool push(Frame* f);
+
+    // consumer: blocks until a frame is queued; NULL once the stage is
+    // closed and drained
+    Frame* pop();
+
+    // consumer: the next frame, or NULL if none is queued right now. Also
+    // resets fd(), so poll fd() again once this returns NULL.
+    Frame* tryPop();
+
+    void close();
+    bool closed() const;
+
+    // closed and nothing left to pop
+    bool drained() const;
+
+    // readable while frames may be queued
+    int fd() const;
+
+    const char* name() const;
+    StageStats stats() const;
+
+private:
+    Stage(const Stage&);
+    Stage& operator=(const Stage&);
+
+    const char* m_name;
+    SpscRing<Frame*> m_ring;
+    DropPolicy m_policy;
+    FramePool& m_pool;
+
+    int m_dataFd;
+    int m_spaceFd;
+    std::atomic<bool> m_closed;
+
+    std::atomic<unsigned long> m_pushed;
+    std::atomic<unsigned long> m_popped;
+    std::atomic<unsigned long> m_dropped;
+    std::atomic<size_t> m_highWater;
+};
+
+struct PipelineConfig
+{
+    size_t poolSize;
+    size_t analysisDepth;
+    size_t eventDepth;
+    DropPolicy analysisPolicy;
+    DropPolicy eventPolicy;
+
+    // time from one capture to the next (initially; see setCaptureInterval)
+    unsigned captureIntervalMs;
+
+    // false: no analysis thread, the owner calls analyseNext() whenever the
+    // analysis-ready callback fires (e.g. from an AnalysisPool)
+    bool analysisThread;
+
+    // false: no act thread, the owner calls dispatchEvents() whenever
+    // eventFd() is readable (e.g. from a Reactor)
+    bool actThread;
+
+    // a failed capture ends the run (recordings) instead of being retried
+    // 10 s later (cameras); see finished()
+    bool stopAtEnd;
+
+    PipelineConfig();
+};
+
+// capture -> analyse -> act on three threads, or fewer when the owner runs
+// the analysis or act stage itself. The callbacks run on their stage's
+// thread only (for an owner-run stage: one caller at a time):
+//   capture(img)  fills img with the next frame, false if none is available
+//   analyse(f)    scores f, true if it should be passed on as an event
+//   act(f)        handles an event frame
+class Pipeline
+{
+public:
+    typedef std::function<bool(cv::Mat&)> CaptureFn;
+    typedef std::function<bool(Frame&)> AnalyseFn;
+    typedef std::function<void(Frame&)> ActFn;
+    typedef std::function<void()> ReadyFn;
+
+    Pipeline(const PipelineConfig& config, CaptureFn capture, AnalyseFn analyse, ActFn act);
+    ~Pipeline();
+
+    void start();
+
+    // stops capturing, drains the queued frames and joins all threads. A
+    // frame being captured as it stops may be dropped. Without an act
+    // thread, frames still queued for it are left for one final
+    // dispatchEvents(), and frames analysed during the stop are dropped.
+    // Without an analysis thread the owner finishes the analysis stage
+    // after stop() returns. Never blocks on a full DROP_BLOCK stage.
+    void stop();
+
+    // analysis stage without an analysis thread. ready runs on the capture
+    // thread after every capture and once when capturing ends; set it
+    // before start().
+    void setAnalysisReady(ReadyFn ready);
+
+    // analyses the next queued frame; false if there was none
+    bool analyseNext();
+
+    // analyseNext() has something to do: a queued frame, or the end of the
+    // analysis stage to pass on
+    bool analysisPending() const;
+
+    // act stage without an act thread: handles every queued event frame
+    int eventFd() const;
+    void dispatchEvents();
+
+    // with stopAtEnd: the source ran dry and every frame has been handled
+    // (eventFd() becomes readable when this turns true)
+    bool finished() const;
+
+    // any thread; a shorter interval also cuts short the current wait
+    void setCaptureInterval(unsigned ms);
+
+    void printStats();
+
+private:
+    void captureLoop();
+    void waitForNextCapture(std::chrono::steady_clock::time_point start);
+    void analyseLoop();
+    void analyseFrame(Frame* f);
+    void actLoop();
+
+    PipelineConfig m_config;
+    CaptureFn m_capture;
+    AnalyseFn m_analyse;
+    ActFn m_act;
+    ReadyFn m_analysisReady;
+
+    FramePool m_pool;
+    Stage m_analysisStage;
+    Stage m_eventStage;
+
+    std::atomic<bool> m_running;
+    std::atomic<unsigned> m_captureIntervalMs;
+    std::atomic<unsigned long> m_poolExhausted;
+    std::thread m_captureThread;
+    std::thread m_analyseThread;
+    std::thread m_actThread;
+};
+
+// Runs the analysis stage of several pipelines (one per camera) on a shared
+// set of worker threads. A pipeline is analysed by one worker at a time, so
+// its analyse callback and detector state need no locking, and pipelines
+// with queued frames take turns one frame each: a busy camera goes to the
+// back of the line after every frame instead of starving the others.
+class AnalysisPool
+{
+public:
+    explicit AnalysisPool(unsigned workers);
+    ~AnalysisPool();
+
+    // before start(); the pipeline must be configured without an analysis
+    // thread and outlive the pool
+    void add(Pipeline& pipeline, const std::string& name);
+
+    void start();
+
+    // finishes the frames already queued, then joins the workers; stop the
+    // pipelines first
+    void stop();
+
+    // per pipeline: frames analysed and time spent analysing them
+    void printStats();
+
+private:
+    struct Member
+    {
+        Pipeline* pipeline;
+        std::string name;
+        bool queued;
+        bool running;
+        unsigned long analysed;
+        double busyMs;
+        double maxMs;
+    };
+
+    void ready(size_t index);
+    void workerLoop();
+
+    unsigned m_workerCount;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::vector<Member> m_members;
+    std::deque<size_t> m_ready;
+    bool m_stopping;
+
+    std::vector<std::thread> m_workers;
+};
+
+#endif
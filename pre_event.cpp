@@ -0,0 +1,109 @@
+#include "pre_event.h"
+
+#include <stdio.h>
+
+PreEventBuffer::PreEventBuffer(size_t budgetBytes, unsigned seconds, int downscale)
+{
+    m_budget = budgetBytes;
+    m_seconds = seconds;
+    m_downscale = downscale > 1 ? downscale : 1;
+    m_params.push_back(CV_IMWRITE_JPEG_QUALITY);
+    m_params.push_back(PRE_EVENT_QUALITY);
+    m_bytes = 0;
+    m_added = 0;
+    m_evicted = 0;
+    m_rejected = 0;
+    m_taken = 0;
+}
+
+void PreEventBuffer::add(const Frame& f)
+{
+    // encode outside the lock, into the buffer of an evicted frame if there
+    // is one, so that a full ring reuses its memory
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_encoded.swap(m_spare);
+        m_spare.clear();
+    }
+
+    if (m_downscale > 1)
+    {
+        cv::resize(f.img, m_small, cv::Size(f.img.cols / m_downscale, f.img.rows / m_downscale), 0, 0, cv::INTER_AREA);
+        cv::imencode(".jpg", m_small, m_encoded, m_params);
+    }
+    else
+    {
+        cv::imencode(".jpg", f.img, m_encoded, m_params);
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_encoded.size() > m_budget)
+    {
+        m_rejected++;
+        return;
+    }
+
+    m_entries.push_back(Entry());
+    Entry& e = m_entries.back();
+    e.seq = f.seq;
+    e.stamp = f.stamp;
+    e.jpeg.swap(m_encoded);
+    m_bytes += e.jpeg.size();
+    m_added++;
+
+    evict();
+}
+
+void PreEventBuffer::evict()
+{
+    time_t newest = m_entries.empty() ? 0 : m_entries.back().stamp;
+
+    while (!m_entries.empty() &&
+           (m_bytes > m_budget || newest - m_entries.front().stamp > (time_t)m_seconds))
+    {
+        Entry& e = m_entries.front();
+        m_bytes -= e.jpeg.size();
+        if (e.jpeg.capacity() > m_spare.capacity())
+        {
+            m_spare.swap(e.jpeg);
+        }
+        m_entries.pop_front();
+        m_evicted++;
+    }
+}
+
+size_t PreEventBuffer::take(unsigned long seq, std::vector<unsigned char>& out)
+{
+    return take(seq, [&](const std::vector<unsigned char>& jpeg, time_t)
+    {
+        out.insert(out.end(), jpeg.begin(), jpeg.end());
+    });
+}
+
+size_t PreEventBuffer::take(unsigned long seq, FrameFn fn)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t n = 0;
+
+    // frames analysed after the event frame stay for the next event
+    while (!m_entries.empty() && m_entries.front().seq < seq)
+    {
+        Entry& e = m_entries.front();
+        fn(e.jpeg, e.stamp);
+        m_bytes -= e.jpeg.size();
+        m_entries.pop_front();
+        n++;
+    }
+
+    m_taken += n;
+    return n;
+}
+
+void PreEventBuffer::printStats()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    printf("pre-event buffer: %zu frame(s), %zu/%zu bytes, added %lu, evicted %lu, too large %lu, taken %lu\n",
+           m_entries.size(), m_bytes, m_budget, m_added, m_evicted, m_rejected, m_taken);
+}
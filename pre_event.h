@@ -0,0 +1,76 @@
+#ifndef PRE_EVENT_H
+#define PRE_EVENT_H
+
+#include <opencv2/opencv.hpp>
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <time.h>
+#include <vector>
+
+#include "pipeline.h"
+
+#define PRE_EVENT_QUALITY 80 // JPEG quality of the buffered frames
+
+// The last few seconds of frames before an event, kept JPEG-encoded so that
+// a useful window fits in a Pi's RAM. Memory is bounded in bytes, not
+// frames: the oldest frames go first when the encoded total would exceed
+// the budget, and frames older than the window go regardless.
+//
+// add() runs on the analysis side and take() on the act side; both may run
+// at once.
+class PreEventBuffer
+{
+public:
+    typedef std::function<void(const std::vector<unsigned char>& jpeg, time_t stamp)> FrameFn;
+
+    // downscale: store frames shrunk by this factor (1 = full size)
+    PreEventBuffer(size_t budgetBytes, unsigned seconds, int downscale = 1);
+
+    // encodes and keeps f, evicting what no longer fits
+    void add(const Frame& f);
+
+    // Removes the frames captured before frame seq and appends them to out,
+    // oldest first, as one concatenated MJPEG stream. Returns how many
+    // frames were taken.
+    size_t take(unsigned long seq, std::vector<unsigned char>& out);
+
+    // as above, handing the frames to fn one by one (under the buffer's
+    // lock, so fn should not take long)
+    size_t take(unsigned long seq, FrameFn fn);
+
+    void printStats();
+
+private:
+    struct Entry
+    {
+        unsigned long seq;
+        time_t stamp;
+        std::vector<unsigned char> jpeg;
+    };
+
+    // called with the mutex held
+    void evict();
+
+    size_t m_budget;
+    unsigned m_seconds;
+    int m_downscale;
+
+    // analysis side only
+    cv::Mat m_small;
+    std::vector<int> m_params;
+    std::vector<unsigned char> m_encoded;
+
+    std::mutex m_mutex;
+    std::deque<Entry> m_entries;
+    size_t m_bytes;
+    std::vector<unsigned char> m_spare;
+
+    unsigned long m_added;
+    unsigned long m_evicted;
+    unsigned long m_rejected;
+    unsigned long m_taken;
+};
+
+#endif
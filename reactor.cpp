@@ -0,0 +1,181 @@
+#include "reactor.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 32
+
+Reactor::Reactor()
+{
+    m_epoll = epoll_create1(EPOLL_CLOEXEC);
+    m_wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    m_stopped = false;
+    m_nextTimer = 0;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = m_wakeFd;
+    epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wakeFd, &ev);
+}
+
+Reactor::~Reactor()
+{
+    close(m_wakeFd);
+    close(m_epoll);
+}
+
+void Reactor::watch(int fd, uint32_t events, FdHandler handler)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.fd = fd;
+
+    // fds closed since the last round drop out of the epoll set on their own
+    // and their numbers get reused, so fall back between ADD and MOD
+    int op = m_fds.count(fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(m_epoll, op, fd, &ev))
+    {
+        op = op == EPOLL_CTL_ADD ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        if (epoll_ctl(m_epoll, op, fd, &ev))
+        {
+            perror("epoll_ctl");
+            m_fds.erase(fd);
+            return;
+        }
+    }
+
+    m_fds[fd] = std::make_pair(events, handler);
+}
+
+void Reactor::unwatch(int fd)
+{
+    if (m_fds.erase(fd))
+    {
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, NULL);
+    }
+}
+
+bool Reactor::watching(int fd) const
+{
+    return m_fds.count(fd) != 0;
+}
+
+unsigned long Reactor::after(unsigned ms, Task task)
+{
+    unsigned long id = ++m_nextTimer;
+    Clock::time_point due = Clock::now() + std::chrono::milliseconds(ms);
+
+    m_timerIds[id] = m_timers.insert(std::make_pair(due, std::make_pair(id, task)));
+    return id;
+}
+
+bool Reactor::cancel(unsigned long timer)
+{
+    std::map<unsigned long, TimerQueue::iterator>::iterator it = m_timerIds.find(timer);
+    if (it == m_timerIds.end())
+    {
+        return false;
+    }
+
+    m_timers.erase(it->second);
+    m_timerIds.erase(it);
+    return true;
+}
+
+void Reactor::poll(int timeoutMs)
+{
+    if (!m_timers.empty())
+    {
+        long long untilDue = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                 m_timers.begin()->first - Clock::now()).count();
+        if (untilDue < 0)
+        {
+            untilDue = 0;
+        }
+        if (timeoutMs < 0 || untilDue < timeoutMs)
+        {
+            // round up so we never wake just before the deadline
+            timeoutMs = (int)untilDue + 1;
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(m_epoll, events, MAX_EVENTS, timeoutMs);
+
+    for (int i = 0; i < n; i++)
+    {
+        int fd = events[i].data.fd;
+
+        if (fd == m_wakeFd)
+        {
+            uint64_t count;
+            while (read(m_wakeFd, &count, sizeof count) > 0)
+            {
+            }
+            continue;
+        }
+
+        // copy: the handler may unwatch or replace itself
+        std::map<int, std::pair<uint32_t, FdHandler> >::iterator it = m_fds.find(fd);
+        if (it != m_fds.end())
+        {
+            FdHandler handler = it->second.second;
+            handler(events[i].events);
+        }
+    }
+
+    runTimers();
+}
+
+void Reactor::runTimers()
+{
+    Clock::time_point now = Clock::now();
+
+    while (!m_timers.empty() && m_timers.begin()->first <= now)
+    {
+        Task task = m_timers.begin()->second.second;
+        m_timerIds.erase(m_timers.begin()->second.first);
+        m_timers.erase(m_timers.begin());
+
+        task();
+    }
+}
+
+void Reactor::wake()
+{
+    uint64_t one = 1;
+    while (write(m_wakeFd, &one, sizeof one) < 0 && errno == EINTR)
+    {
+    }
+}
+
+void Reactor::setDriver(Task driver)
+{
+    m_driver = driver;
+}
+
+void Reactor::run()
+{
+    m_stopped = false;
+
+    while (!m_stopped)
+    {
+        if (m_driver)
+        {
+            m_driver();
+        }
+        else
+        {
+            poll(-1);
+        }
+    }
+}
+
+void Reactor::stop()
+{
+    m_stopped = true;
+    wake();
+}
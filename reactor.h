@@ -0,0 +1,66 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <stdint.h>
+
+// Single-threaded epoll event loop with one-shot timers. All methods except
+// wake() must be called from the thread running the loop (handlers included).
+class Reactor
+{
+public:
+    typedef std::function<void(uint32_t events)> FdHandler;
+    typedef std::function<void()> Task;
+
+    Reactor();
+    ~Reactor();
+
+    // start watching fd for events (EPOLLIN/EPOLLOUT/...), or replace the
+    // events and handler of an fd already watched
+    void watch(int fd, uint32_t events, FdHandler handler);
+    void unwatch(int fd);
+    bool watching(int fd) const;
+
+    // runs task once, ms milliseconds from now; returns an id for cancel()
+    unsigned long after(unsigned ms, Task task);
+
+    // false if the timer already fired or was cancelled
+    bool cancel(unsigned long timer);
+
+    // waits up to timeoutMs (-1 = until something happens) for watched fds
+    // or due timers and dispatches them
+    void poll(int timeoutMs);
+
+    // interrupts a blocking poll(); any thread
+    void wake();
+
+    // run() calls driver repeatedly instead of poll(-1); a driver must
+    // end up in poll() when it has nothing to do (see ReactorWaiter)
+    void setDriver(Task driver);
+
+    void run();
+    void stop();
+
+private:
+    Reactor(const Reactor&);
+    Reactor& operator=(const Reactor&);
+
+    typedef std::chrono::steady_clock Clock;
+    typedef std::multimap<Clock::time_point, std::pair<unsigned long, Task> > TimerQueue;
+
+    void runTimers();
+
+    int m_epoll;
+    int m_wakeFd;
+    bool m_stopped;
+    Task m_driver;
+
+    std::map<int, std::pair<uint32_t, FdHandler> > m_fds;
+    TimerQueue m_timers;
+    std::map<unsigned long, TimerQueue::iterator> m_timerIds;
+    unsigned long m_nextTimer;
+};
+
+#endif
@@ -0,0 +1,188 @@
+#include "retry_policy.h"
+
+#include <stdio.h>
+#include <string.h>
+
+typedef std::chrono::steady_clock Clock;
+
+const char* retryClassName(RetryClass c)
+{
+    switch (c)
+    {
+        case RETRY_TRANSIENT:
+            return "transient";
+        case RETRY_RATELIMIT:
+            return "rate-limit";
+        case RETRY_QUOTA:
+            return "quota";
+        case RETRY_FATAL:
+            return "fatal";
+        default:
+            return "unknown";
+    }
+}
+
+RetryPolicy::RetryPolicy()
+    : m_random(std::random_device()())
+{
+    setBudget(RETRY_TRANSIENT, 8, 1000, 300000);
+    setBudget(RETRY_RATELIMIT, 12, 5000, 600000);
+    setBudget(RETRY_QUOTA, 4, 60000, 3600000);
+    setBudget(RETRY_FATAL, 0, 0, 0);
+
+    m_state = BREAKER_CLOSED;
+    m_failures = 0;
+    m_openMs = BREAKER_OPEN_MS;
+
+    memset(m_retries, 0, sizeof(m_retries));
+    memset(m_gaveUp, 0, sizeof(m_gaveUp));
+    m_backoffMs = 0;
+    m_opened = 0;
+    m_openTotalMs = 0;
+}
+
+void RetryPolicy::setBudget(RetryClass c, unsigned attempts, unsigned baseMs, unsigned maxMs)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_budgets[c].attempts = attempts;
+    m_budgets[c].baseMs = baseMs;
+    m_budgets[c].maxMs = maxMs;
+}
+
+bool RetryPolicy::backoff(RetryClass c, unsigned attempt, unsigned* ms)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const Budget& b = m_budgets[c];
+
+    if (attempt < 1 || attempt > b.attempts)
+    {
+        m_gaveUp[c]++;
+        return false;
+    }
+
+    // base * 2^(attempt - 1), capped, without overflowing on the way
+    double cap = b.baseMs;
+    for (unsigned i = 1; i < attempt && cap < b.maxMs; i++)
+    {
+        cap *= 2;
+    }
+    if (cap > b.maxMs)
+    {
+        cap = b.maxMs;
+    }
+
+    *ms = std::uniform_int_distribution<unsigned>(0, (unsigned)cap)(m_random);
+    m_retries[c]++;
+    m_backoffMs += *ms;
+    return true;
+}
+
+bool RetryPolicy::success()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    bool reopened = m_state != BREAKER_CLOSED;
+
+    if (reopened)
+    {
+        m_openTotalMs += std::chrono::duration<double, std::milli>(Clock::now() - m_openedAt).count();
+        printf("Backend reachable again, resuming uploads\n");
+    }
+
+    m_state = BREAKER_CLOSED;
+    m_failures = 0;
+    m_openMs = BREAKER_OPEN_MS;
+    return reopened;
+}
+
+void RetryPolicy::failure(RetryClass c)
+{
+    if (c != RETRY_TRANSIENT && c != RETRY_RATELIMIT)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_failures++;
+
+    if (m_state == BREAKER_HALF_OPEN)
+    {
+        // the trial failed: stay away for longer
+        m_openMs = m_openMs * 2 < BREAKER_MAX_OPEN_MS ? m_openMs * 2 : BREAKER_MAX_OPEN_MS;
+    }
+    else if (m_state == BREAKER_OPEN || m_failures < BREAKER_FAILURES)
+    {
+        return;
+    }
+    else
+    {
+        m_openedAt = Clock::now();
+        m_opened++;
+    }
+
+    m_state = BREAKER_OPEN;
+    m_openUntil = Clock::now() + std::chrono::milliseconds(m_openMs);
+    printf("Backend unreachable after %u failure(s), holding uploads for %u s\n", m_failures, m_openMs / 1000);
+}
+
+bool RetryPolicy::allow(unsigned* waitMs)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    switch (m_state)
+    {
+        case BREAKER_CLOSED:
+            return true;
+
+        case BREAKER_OPEN:
+        {
+            Clock::time_point now = Clock::now();
+
+            if (now >= m_openUntil)
+            {
+                // one trial; its outcome decides
+                m_state = BREAKER_HALF_OPEN;
+                m_openUntil = now + std::chrono::milliseconds(m_openMs);
+                return true;
+            }
+            if (waitMs)
+            {
+                *waitMs = std::chrono::duration_cast<std::chrono::milliseconds>(m_openUntil - now).count() + 1;
+            }
+            return false;
+        }
+
+        default:
+        {
+            // the trial is still running; another one if it has gone
+            // quiet (it may never have reached the backend)
+            Clock::time_point now = Clock::now();
+
+            if (now >= m_openUntil)
+            {
+                m_openUntil = now + std::chrono::milliseconds(m_openMs);
+                return true;
+            }
+            if (waitMs)
+            {
+                *waitMs = std::chrono::duration_cast<std::chrono::milliseconds>(m_openUntil - now).count() + 1;
+            }
+            return false;
+        }
+    }
+}
+
+void RetryPolicy::printStats()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    static const char* states[] = { "closed", "open", "half-open" };
+
+    printf("retry policy: breaker %s, opened %lu time(s) for %.1f s in total, %.1f s of backoff handed out\n",
+           states[m_state], m_opened, m_openTotalMs / 1000, m_backoffMs / 1000);
+
+    for (int c = 0; c < RETRY_CLASSES; c++)
+    {
+        printf("  %-10s %lu retries, gave up %lu time(s)\n", retryClassName((RetryClass)c), m_retries[c], m_gaveUp[c]);
+    }
+}
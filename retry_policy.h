@@ -0,0 +1,94 @@
+#ifndef RETRY_POLICY_H
+#define RETRY_POLICY_H
+
+#include <chrono>
+#include <mutex>
+#include <random>
+
+#define BREAKER_FAILURES 5 // consecutive failures that open the circuit breaker
+#define BREAKER_OPEN_MS 30000 // first wait before a trial request
+#define BREAKER_MAX_OPEN_MS 1800000 // the wait doubles after each failed trial, up to this
+
+// how a failure should be retried
+enum RetryClass
+{
+    RETRY_TRANSIENT,    // network errors, timeouts, temporary server trouble
+    RETRY_RATELIMIT,    // the server asked us to slow down
+    RETRY_QUOTA,        // out of storage or transfer quota
+    RETRY_FATAL,        // retrying cannot help
+    RETRY_CLASSES
+};
+
+const char* retryClassName(RetryClass c);
+
+// When and whether to try again after a failure, shared by everything that
+// talks to the backend.
+//
+// Delays grow exponentially per attempt with full jitter (a uniform random
+// delay between 0 and the capped exponential), so that uploads failing
+// together do not come back together. Each RetryClass has its own budget of
+// attempts and its own base and cap.
+//
+// The circuit breaker counts consecutive failures of the transient and
+// rate-limit classes. After BREAKER_FAILURES it opens: callers should not
+// start new requests until allow() says so, which it does for one trial
+// request once the open period has passed (and for another if that one
+// has not been heard of for as long). A success closes the breaker; a
+// failed trial opens it again for twice as long.
+//
+// All methods may be called from any thread.
+class RetryPolicy
+{
+public:
+    RetryPolicy();
+
+    // attempts 0 never retries
+    void setBudget(RetryClass c, unsigned attempts, unsigned baseMs, unsigned maxMs);
+
+    // the delay before retry number attempt (from 1) of a failure of class
+    // c; false once the class's budget is spent
+    bool backoff(RetryClass c, unsigned attempt, unsigned* ms);
+
+    // outcome of a request, for the circuit breaker; success() returns true
+    // if it closed the breaker
+    bool success();
+    void failure(RetryClass c);
+
+    // whether a new request may start; while open, ms until the next trial
+    bool allow(unsigned* waitMs = NULL);
+
+    void printStats();
+
+private:
+    enum BreakerState
+    {
+        BREAKER_CLOSED,
+        BREAKER_OPEN,
+        BREAKER_HALF_OPEN
+    };
+
+    struct Budget
+    {
+        unsigned attempts;
+        unsigned baseMs;
+        unsigned maxMs;
+    };
+
+    std::mutex m_mutex;
+    std::mt19937 m_random;
+    Budget m_budgets[RETRY_CLASSES];
+
+    BreakerState m_state;
+    unsigned m_failures;
+    unsigned m_openMs;
+    std::chrono::steady_clock::time_point m_openUntil;
+    std::chrono::steady_clock::time_point m_openedAt;
+
+    unsigned long m_retries[RETRY_CLASSES];
+    unsigned long m_gaveUp[RETRY_CLASSES];
+    double m_backoffMs;
+    unsigned long m_opened;
+    double m_openTotalMs;
+};
+
+#endif
@@ -0,0 +1,113 @@
+#include "scheduler.h"
+
+#include <stdio.h>
+
+const char* scheduleModeName(ScheduleMode mode)
+{
+    switch (mode)
+    {
+        case MODE_IDLE:
+            return "idle";
+        case MODE_ARMED:
+            return "armed";
+    }
+
+    return "unknown";
+}
+
+SchedulerConfig::SchedulerConfig(double threshold, unsigned idleIntervalMs, unsigned armedIntervalMs, int armedStep)
+{
+    this->idleIntervalMs = idleIntervalMs;
+    this->armedIntervalMs = armedIntervalMs;
+    this->armedStep = armedStep;
+
+    // every 4th pixel of every 4th row: 1/16 of the work, plenty to see
+    // a trend coming
+    idleStep = armedStep > 4 ? armedStep : 4;
+
+    double headroom = 1 - threshold;
+    armLevel = threshold + headroom / 2;
+    armDrop = headroom / 4;
+    disarmLevel = threshold + headroom * 3 / 4;
+    holdFrames = 10;
+}
+
+AdaptiveScheduler::AdaptiveScheduler(const SchedulerConfig& config)
+    : m_config(config)
+{
+    m_mode.store(MODE_IDLE);
+    m_lastScore = 1;
+    m_haveScore = false;
+    m_calmFrames = 0;
+    m_since = Clock::now();
+
+    m_switches.store(0);
+    for (int i = 0; i < 2; i++)
+    {
+        m_frames[i].store(0);
+        m_timeMs[i].store(0);
+    }
+}
+
+bool AdaptiveScheduler::update(double score)
+{
+    ScheduleMode mode = (ScheduleMode)m_mode.load();
+    bool falling = m_haveScore && m_lastScore - score > m_config.armDrop;
+
+    m_frames[mode]++;
+    m_lastScore = score;
+    m_haveScore = true;
+
+    if (mode == MODE_IDLE)
+    {
+        if (score < m_config.armLevel || falling)
+        {
+            enter(MODE_ARMED);
+            return true;
+        }
+        return false;
+    }
+
+    m_calmFrames = score > m_config.disarmLevel ? m_calmFrames + 1 : 0;
+    if (m_calmFrames >= m_config.holdFrames)
+    {
+        enter(MODE_IDLE);
+        return true;
+    }
+    return false;
+}
+
+void AdaptiveScheduler::enter(ScheduleMode mode)
+{
+    Clock::time_point now = Clock::now();
+    ScheduleMode old = (ScheduleMode)m_mode.load();
+
+    m_timeMs[old] += std::chrono::duration_cast<std::chrono::milliseconds>(now - m_since).count();
+    m_since = now;
+    m_calmFrames = 0;
+    m_switches++;
+    m_mode.store(mode);
+}
+
+ScheduleMode AdaptiveScheduler::mode() const
+{
+    return (ScheduleMode)m_mode.load();
+}
+
+unsigned AdaptiveScheduler::intervalMs() const
+{
+    return mode() == MODE_ARMED ? m_config.armedIntervalMs : m_config.idleIntervalMs;
+}
+
+int AdaptiveScheduler::step() const
+{
+    return mode() == MODE_ARMED ? m_config.armedStep : m_config.idleStep;
+}
+
+void AdaptiveScheduler::printStats()
+{
+    // time in the current mode is only added up on the next switch
+    printf("scheduler: %s, %lu switch(es), idle %lu frame(s) %lld s, armed %lu frame(s) %lld s\n",
+           scheduleModeName(mode()), m_switches.load(), m_frames[MODE_IDLE].load(),
+           m_timeMs[MODE_IDLE].load() / 1000, m_frames[MODE_ARMED].load(), m_timeMs[MODE_ARMED].load() / 1000);
+}
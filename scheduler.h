@@ -0,0 +1,74 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <atomic>
+#include <chrono>
+
+enum ScheduleMode
+{
+    MODE_IDLE,      // slow captures, decimated analysis
+    MODE_ARMED      // fast captures, full analysis
+};
+
+const char* scheduleModeName(ScheduleMode mode);
+
+// Scores are histogram correlations: 1 for an unchanged scene, falling
+// towards the event threshold as something moves in.
+struct SchedulerConfig
+{
+    unsigned idleIntervalMs;
+    unsigned armedIntervalMs;
+    int idleStep;
+    int armedStep;
+
+    // arm once the smoothed score falls below armLevel, or drops by more
+    // than armDrop from one analysed frame to the next
+    double armLevel;
+    double armDrop;
+
+    // disarm after holdFrames consecutive scores above disarmLevel
+    // (> armLevel, so a score hovering around one level does not flap)
+    double disarmLevel;
+    unsigned holdFrames;
+
+    // defaults relative to the event threshold
+    SchedulerConfig(double threshold, unsigned idleIntervalMs, unsigned armedIntervalMs, int armedStep);
+};
+
+// Dual-rate capture schedule. update() runs on the analysis thread; the
+// getters and printStats() are safe from any thread.
+class AdaptiveScheduler
+{
+public:
+    explicit AdaptiveScheduler(const SchedulerConfig& config);
+
+    // feeds the smoothed score of the frame just analysed; true if the mode
+    // changed, after which intervalMs() and step() return the new settings
+    bool update(double score);
+
+    ScheduleMode mode() const;
+    unsigned intervalMs() const;
+    int step() const;
+
+    void printStats();
+
+private:
+    void enter(ScheduleMode mode);
+
+    typedef std::chrono::steady_clock Clock;
+
+    SchedulerConfig m_config;
+    std::atomic<int> m_mode;
+
+    // analysis thread only
+    double m_lastScore;
+    bool m_haveScore;
+    unsigned m_calmFrames;
+    Clock::time_point m_since;
+
+    std::atomic<unsigned long> m_switches;
+    std::atomic<unsigned long> m_frames[2];
+    std::atomic<long long> m_timeMs[2];
+};
+
+#endif
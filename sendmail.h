@@ -1,24 +1,38 @@
 #include<stdio.h>
 #include<errno.h>
 #include<string.h>
+#include<string>
+#include<sys/wait.h>
 
-int sendmail(const char *to, const char *from, const char *subject, const char *message)
+// message is complete, headers included: sendmail -t takes the recipients
+// from its To: line
+int sendmail(const std::string& message)
 {
     int retval = -1;
     FILE *mailpipe = popen("/usr/sbin/sendmail -t", "w");
     if (mailpipe != NULL)
     {
-        fprintf(mailpipe, "To: %s\n", to);
-        fprintf(mailpipe, "From: %s\n", from);
-        fprintf(mailpipe, "Subject: %s\n\n", subject);
-        fwrite(message, 1, strlen(message), mailpipe);
+        fwrite(message.data(), 1, message.size(), mailpipe);
         fwrite(".\n", 1, 2, mailpipe);
-        pclose(mailpipe);
-        retval = 0;
+
+        // sendmail reports a refused message through its exit status
+        int status = pclose(mailpipe);
+        if (status == 0)
+        {
+            retval = 0;
+        }
+        else if (status == -1)
+        {
+            perror("Failed to wait for sendmail");
+        }
+        else
+        {
+            fprintf(stderr, "sendmail failed with status %d\n", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        }
      }
      else
      {
          perror("Failed to invoke sendmail");
      }
      return retval;
-}
\ No newline at end of file
+}
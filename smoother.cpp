@@ -0,0 +1,167 @@
+#include "smoother.h"
+
+#include <string.h>
+
+const char* smoothingMethodName(SmoothingMethod method)
+{
+    switch (method)
+    {
+        case SMOOTH_MEAN:
+            return "mean";
+        case SMOOTH_EWMA:
+            return "ewma";
+        case SMOOTH_MEDIAN:
+            return "median";
+    }
+
+    return "unknown";
+}
+
+bool parseSmoothingMethod(const char* name, SmoothingMethod* method)
+{
+    if (!strcmp(name, "mean"))
+    {
+        *method = SMOOTH_MEAN;
+    }
+    else if (!strcmp(name, "ewma"))
+    {
+        *method = SMOOTH_EWMA;
+    }
+    else if (!strcmp(name, "median"))
+    {
+        *method = SMOOTH_MEDIAN;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+Smoother* Smoother::create(SmoothingMethod method, size_t window)
+{
+    switch (method)
+    {
+        case SMOOTH_EWMA:
+            return new EwmaSmoother(window);
+        case SMOOTH_MEDIAN:
+            return new MedianSmoother(window);
+        case SMOOTH_MEAN:
+            break;
+    }
+
+    return new MeanSmoother(window);
+}
+
+MeanSmoother::MeanSmoother(size_t window)
+    : m_window(window)
+{
+}
+
+double MeanSmoother::update(double v)
+{
+    m_window.push(v);
+    return m_window.mean();
+}
+
+void MeanSmoother::reset()
+{
+    m_window.clear();
+}
+
+EwmaSmoother::EwmaSmoother(size_t window)
+{
+    // same centre of mass as a window-long mean
+    m_alpha = 2.0 / ((window ? window : 1) + 1);
+    reset();
+}
+
+double EwmaSmoother::update(double v)
+{
+    if (!m_primed)
+    {
+        m_value = v;
+        m_primed = true;
+    }
+    else
+    {
+        m_value += m_alpha * (v - m_value);
+    }
+
+    return m_value;
+}
+
+void EwmaSmoother::reset()
+{
+    m_value = 0;
+    m_primed = false;
+}
+
+MedianSmoother::MedianSmoother(size_t window)
+    : m_window(window)
+{
+}
+
+double MedianSmoother::update(double v)
+{
+    if (m_window.full())
+    {
+        double old = m_window.oldest();
+
+        // equal values may sit on both sides, so look where it actually is
+        std::multiset<double>::iterator it = m_low.find(old);
+        if (it != m_low.end())
+        {
+            m_low.erase(it);
+        }
+        else if ((it = m_high.find(old)) != m_high.end())
+        {
+            m_high.erase(it);
+        }
+
+        // m_low must not be empty while m_high is not, or v could land
+        // below values that are larger than it
+        rebalance();
+    }
+    m_window.push(v);
+
+    if (m_low.empty() || v <= *m_low.rbegin())
+    {
+        m_low.insert(v);
+    }
+    else
+    {
+        m_high.insert(v);
+    }
+    rebalance();
+
+    if (m_low.size() > m_high.size())
+    {
+        return *m_low.rbegin();
+    }
+    return (*m_low.rbegin() + *m_high.begin()) / 2;
+}
+
+// keep m_low as large as m_high or one larger
+void MedianSmoother::rebalance()
+{
+    if (m_low.size() > m_high.size() + 1)
+    {
+        std::multiset<double>::iterator top = --m_low.end();
+        m_high.insert(*top);
+        m_low.erase(top);
+    }
+    else if (m_high.size() > m_low.size())
+    {
+        m_low.insert(*m_high.begin());
+        m_high.erase(m_high.begin());
+    }
+}
+
+void MedianSmoother::reset()
+{
+    m_window.clear();
+    m_low.clear();
+    m_high.clear();
+}
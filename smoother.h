@@ -0,0 +1,176 @@
+#ifndef SMOOTHER_H
+#define SMOOTHER_H
+
+#include <set>
+#include <stddef.h>
+
+// Fixed-capacity ring of the last capacity() values with a running sum, so
+// the mean costs O(1) per push whatever the window length. The sum is
+// recomputed from the slots once per lap to keep floating point error from
+// accumulating.
+template<typename T>
+class RollingWindow
+{
+public:
+    explicit RollingWindow(size_t capacity)
+    {
+        m_capacity = capacity ? capacity : 1;
+        m_slots = new T[m_capacity];
+        clear();
+    }
+
+    ~RollingWindow()
+    {
+        delete[] m_slots;
+    }
+
+    // appends v, dropping the oldest value once the window is full
+    void push(const T& v)
+    {
+        if (m_size == m_capacity)
+        {
+            m_sum -= m_slots[m_next];
+        }
+        else
+        {
+            m_size++;
+        }
+
+        m_slots[m_next] = v;
+        m_sum += v;
+
+        if (++m_next == m_capacity)
+        {
+            m_next = 0;
+            resum();
+        }
+    }
+
+    void clear()
+    {
+        m_size = 0;
+        m_next = 0;
+        m_sum = T();
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    size_t capacity() const
+    {
+        return m_capacity;
+    }
+
+    bool full() const
+    {
+        return m_size == m_capacity;
+    }
+
+    // the value the next push() drops; only valid when full()
+    const T& oldest() const
+    {
+        return m_slots[m_next];
+    }
+
+    T sum() const
+    {
+        return m_sum;
+    }
+
+    // mean of the values pushed so far, up to capacity() of them
+    double mean() const
+    {
+        return m_size ? (double)m_sum / m_size : 0;
+    }
+
+private:
+    RollingWindow(const RollingWindow&);
+    RollingWindow& operator=(const RollingWindow&);
+
+    void resum()
+    {
+        m_sum = T();
+        for (size_t i = 0; i < m_size; i++)
+        {
+            m_sum += m_slots[i];
+        }
+    }
+
+    T* m_slots;
+    size_t m_capacity;
+    size_t m_size;
+    size_t m_next;
+    T m_sum;
+};
+
+enum SmoothingMethod
+{
+    SMOOTH_MEAN,    // mean of the last window scores
+    SMOOTH_EWMA,    // exponential average, alpha = 2 / (window + 1)
+    SMOOTH_MEDIAN   // median of the last window scores, ignores single outliers
+};
+
+const char* smoothingMethodName(SmoothingMethod method);
+bool parseSmoothingMethod(const char* name, SmoothingMethod* method);
+
+// Smooths the per-frame detector score. update() adds a score and returns
+// the smoothed value; until window scores have been seen, it smooths over
+// the ones there are.
+class Smoother
+{
+public:
+    virtual ~Smoother() {}
+
+    virtual double update(double v) = 0;
+    virtual void reset() = 0;
+
+    static Smoother* create(SmoothingMethod method, size_t window);
+};
+
+class MeanSmoother : public Smoother
+{
+public:
+    explicit MeanSmoother(size_t window);
+
+    double update(double v);
+    void reset();
+
+private:
+    RollingWindow<double> m_window;
+};
+
+class EwmaSmoother : public Smoother
+{
+public:
+    explicit EwmaSmoother(size_t window);
+
+    double update(double v);
+    void reset();
+
+private:
+    double m_alpha;
+    double m_value;
+    bool m_primed;
+};
+
+// running median: the window in arrival order, to know what to evict, plus
+// its values split into a lower and an upper half; O(log window) per update
+class MedianSmoother : public Smoother
+{
+public:
+    explicit MedianSmoother(size_t window);
+
+    double update(double v);
+    void reset();
+
+private:
+    void rebalance();
+
+    RollingWindow<double> m_window;
+    std::multiset<double> m_low;
+    std::multiset<double> m_high;
+};
+
+#endif
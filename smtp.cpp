@@ -0,0 +1,827 @@
+#include "smtp.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock Clock;
+
+SmtpClient::SmtpClient(Reactor& reactor, const std::string& host, unsigned short port)
+    : m_reactor(reactor)
+{
+    m_host = host;
+    m_port = port;
+    m_queueFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    char name[256];
+    m_helo = gethostname(name, sizeof name) == 0 && name[0] ? name : "localhost";
+
+    m_fd = -1;
+    m_serial = 0;
+    m_state = SMTP_DISCONNECTED;
+    m_pipelining = false;
+    m_busy = false;
+    m_envelopeReplies = 0;
+    m_failCode = 0;
+
+    m_replyTimer = 0;
+    m_idleTimer = 0;
+    m_retryTimer = 0;
+    m_drainTimer = 0;
+
+    // a mail server is not the upload backend: a short budget of its own
+    m_retry.setBudget(RETRY_TRANSIENT, SMTP_ATTEMPTS - 1, 2000, 60000);
+
+    m_delivered = 0;
+    m_failed = 0;
+    m_retried = 0;
+    m_connections = 0;
+    m_reused = 0;
+    m_pipelined = 0;
+    m_totalMs = 0;
+    m_maxMs = 0;
+}
+
+SmtpClient::~SmtpClient()
+{
+    stop();
+    close(m_queueFd);
+}
+
+void SmtpClient::start()
+{
+    m_reactor.watch(m_queueFd, EPOLLIN, [this](uint32_t)
+    {
+        uint64_t n;
+        if (read(m_queueFd, &n, sizeof n) == sizeof n)
+        {
+            kick();
+        }
+    });
+}
+
+void SmtpClient::stop()
+{
+    m_reactor.unwatch(m_queueFd);
+
+    if (m_drainTimer)
+    {
+        m_reactor.cancel(m_drainTimer);
+        m_drainTimer = 0;
+    }
+
+    if (m_retryTimer)
+    {
+        m_reactor.cancel(m_retryTimer);
+        m_retryTimer = 0;
+    }
+    if (m_idleTimer)
+    {
+        m_reactor.cancel(m_idleTimer);
+        m_idleTimer = 0;
+    }
+    if (m_replyTimer)
+    {
+        m_reactor.cancel(m_replyTimer);
+        m_replyTimer = 0;
+    }
+    if (m_fd >= 0)
+    {
+        m_reactor.unwatch(m_fd);
+        close(m_fd);
+        m_fd = -1;
+    }
+    m_state = SMTP_DISCONNECTED;
+
+    std::deque<Pending> left;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        left.swap(m_queue);
+        if (m_busy)
+        {
+            left.push_front(m_current);
+        }
+        m_failed += left.size();
+    }
+    m_busy = false;
+
+    if (!left.empty())
+    {
+        printf("%zu mail(s) not delivered at shutdown\n", left.size());
+    }
+    for (size_t i = 0; i < left.size(); i++)
+    {
+        if (left[i].done)
+        {
+            left[i].done(false, "not sent before shutdown");
+        }
+    }
+}
+
+void SmtpClient::send(const SmtpMessage& message, SmtpDone done)
+{
+    Pending p;
+    p.message = message;
+    p.done = done;
+    p.attempts = 0;
+    p.queued = Clock::now();
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back(p);
+    }
+
+    // the reactor picks it up in kick()
+    uint64_t one = 1;
+    if (::write(m_queueFd, &one, sizeof one) != sizeof one)
+    {
+        perror("Failed to queue mail");
+    }
+}
+
+void SmtpClient::drain(unsigned ms, Reactor::Task done)
+{
+    m_drainDone = done;
+    m_drainTimer = m_reactor.after(ms, [this]()
+    {
+        m_drainTimer = 0;
+
+        // stop() fails and reports what is left
+        stop();
+
+        Reactor::Task done;
+        done.swap(m_drainDone);
+        done();
+    });
+
+    checkDrained();
+}
+
+void SmtpClient::checkDrained()
+{
+    if (!m_drainDone || m_busy)
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_queue.empty())
+        {
+            return;
+        }
+    }
+
+    m_reactor.cancel(m_drainTimer);
+    m_drainTimer = 0;
+
+    Reactor::Task done;
+    done.swap(m_drainDone);
+    done();
+}
+
+// starts on the next queued mail if the connection is free for it
+void SmtpClient::kick()
+{
+    if (m_busy || m_retryTimer || (m_state != SMTP_DISCONNECTED && m_state != SMTP_READY))
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_queue.empty())
+        {
+            return;
+        }
+        m_current = m_queue.front();
+        m_queue.pop_front();
+        if (m_state == SMTP_READY)
+        {
+            m_reused++;
+        }
+    }
+    m_busy = true;
+
+    if (m_idleTimer)
+    {
+        m_reactor.cancel(m_idleTimer);
+        m_idleTimer = 0;
+    }
+
+    if (m_state == SMTP_READY)
+    {
+        startEnvelope();
+    }
+    else
+    {
+        connect();
+    }
+}
+
+void SmtpClient::connect()
+{
+    char port[8];
+    snprintf(port, sizeof port, "%u", m_port);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    // blocks, but the server is normally localhost or a literal address
+    struct addrinfo* res;
+    int err = getaddrinfo(m_host.c_str(), port, &hints, &res);
+    if (err)
+    {
+        disconnect("cannot resolve " + m_host + ": " + gai_strerror(err));
+        return;
+    }
+
+    m_fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, res->ai_protocol);
+    int rc = m_fd < 0 ? -1 : ::connect(m_fd, res->ai_addr, res->ai_addrlen);
+    err = errno;
+    freeaddrinfo(res);
+
+    if (rc < 0 && err != EINPROGRESS)
+    {
+        disconnect("cannot connect to " + m_host + ": " + strerror(err));
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_connections++;
+    }
+    m_serial++;
+    m_state = SMTP_CONNECTING;
+    m_pipelining = false;
+    m_reactor.watch(m_fd, EPOLLOUT, std::bind(&SmtpClient::ready, this, std::placeholders::_1));
+    expectReply();
+}
+
+void SmtpClient::ready(uint32_t events)
+{
+    if (m_state == SMTP_CONNECTING)
+    {
+        int err = 0;
+        socklen_t len = sizeof err;
+        getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err)
+        {
+            disconnect("cannot connect to " + m_host + ": " + strerror(err));
+            return;
+        }
+
+        m_state = SMTP_GREETING;
+        m_reactor.watch(m_fd, EPOLLIN, std::bind(&SmtpClient::ready, this, std::placeholders::_1));
+        expectReply();
+        return;
+    }
+
+    if (events & EPOLLOUT)
+    {
+        flush();
+    }
+    if (m_fd >= 0 && (events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+    {
+        readReplies();
+    }
+}
+
+void SmtpClient::readReplies()
+{
+    unsigned long serial = m_serial;
+    char buf[4096];
+    ssize_t n;
+    bool closed = false;
+    int err = 0;
+
+    while (true)
+    {
+        n = read(m_fd, buf, sizeof buf);
+        if (n > 0)
+        {
+            m_in.append(buf, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        closed = true;
+        err = n < 0 ? errno : 0;
+        break;
+    }
+
+    // one reply may be several lines ("250-..." up to "250 ..."); a reply
+    // handler may close the connection, which empties m_in
+    size_t eol;
+    while ((eol = m_in.find('\n')) != std::string::npos)
+    {
+        std::string line = m_in.substr(0, eol);
+        m_in.erase(0, eol + 1);
+        if (!line.empty() && line[line.size() - 1] == '\r')
+        {
+            line.erase(line.size() - 1);
+        }
+
+        if (line.size() < 3 || !isdigit(line[0]) || !isdigit(line[1]) || !isdigit(line[2]) ||
+            (line.size() > 3 && line[3] != ' ' && line[3] != '-'))
+        {
+            disconnect("unexpected reply from " + m_host + ": " + line);
+            return;
+        }
+
+        std::string text = line.size() > 4 ? line.substr(4) : std::string();
+        if (m_state == SMTP_EHLO && !strncasecmp(text.c_str(), "PIPELINING", 10) &&
+            (text.size() == 10 || text[10] == ' '))
+        {
+            m_pipelining = true;
+        }
+
+        if (!m_replyText.empty())
+        {
+            m_replyText += ' ';
+        }
+        m_replyText += text;
+
+        if (line.size() > 3 && line[3] == '-')
+        {
+            continue;
+        }
+
+        std::string reply = line.substr(0, 3) + " " + m_replyText;
+        m_replyText.clear();
+        this->reply(atoi(line.substr(0, 3).c_str()), reply);
+    }
+
+    if (closed && m_fd >= 0 && m_serial == serial)
+    {
+        disconnect(err ? std::string("connection to ") + m_host + " failed: " + strerror(err) :
+                         "connection closed by " + m_host);
+    }
+}
+
+void SmtpClient::reply(int code, const std::string& text)
+{
+    if (m_replyTimer)
+    {
+        m_reactor.cancel(m_replyTimer);
+        m_replyTimer = 0;
+    }
+
+    switch (m_state)
+    {
+        case SMTP_GREETING:
+            if (code / 100 != 2)
+            {
+                disconnect("refused by " + m_host + ": " + text);
+                return;
+            }
+            m_state = SMTP_EHLO;
+            write("EHLO " + m_helo + "\r\n");
+            expectReply();
+            break;
+
+        case SMTP_EHLO:
+            // a server without ESMTP gets the old greeting
+            if (code / 100 == 2)
+            {
+                connected();
+                return;
+            }
+            m_state = SMTP_HELO;
+            write("HELO " + m_helo + "\r\n");
+            expectReply();
+            break;
+
+        case SMTP_HELO:
+            if (code / 100 != 2)
+            {
+                disconnect("HELO refused by " + m_host + ": " + text);
+                return;
+            }
+            connected();
+            break;
+
+        case SMTP_ENVELOPE:
+            envelopeReply(code, text);
+            break;
+
+        case SMTP_BODY:
+            m_state = SMTP_READY;
+            finish(code / 100 == 2, code / 100 != 5, text);
+            break;
+
+        case SMTP_RSET:
+            m_state = SMTP_READY;
+            nextMessage();
+            break;
+
+        case SMTP_QUIT:
+            disconnect(std::string());
+            break;
+
+        default:
+            // e.g. 421 when the server times out an idle connection
+            disconnect(text);
+            break;
+    }
+}
+
+void SmtpClient::connected()
+{
+    m_state = SMTP_READY;
+
+    if (m_busy)
+    {
+        startEnvelope();
+    }
+    else
+    {
+        nextMessage();
+    }
+}
+
+void SmtpClient::startEnvelope()
+{
+    const SmtpMessage& m = m_current.message;
+
+    m_state = SMTP_ENVELOPE;
+    m_envelopeReplies = 0;
+    m_failCode = 0;
+    m_failReply.clear();
+
+    std::string mail = "MAIL FROM:<" + m.from + ">\r\n";
+    std::string rcpt = "RCPT TO:<" + m.to + ">\r\n";
+
+    if (m_pipelining)
+    {
+        write(mail + rcpt + "DATA\r\n");
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pipelined++;
+    }
+    else
+    {
+        write(mail);
+    }
+    expectReply();
+}
+
+// the replies to MAIL, RCPT and DATA, in that order
+void SmtpClient::envelopeReply(int code, const std::string& text)
+{
+    m_envelopeReplies++;
+
+    // 250 for MAIL and RCPT, 354 for DATA
+    int expected = m_envelopeReplies == 3 ? 3 : 2;
+    if (code / 100 != expected && !m_failCode)
+    {
+        m_failCode = code;
+        m_failReply = text;
+    }
+
+    if (m_envelopeReplies < 3 && (m_pipelining || !m_failCode))
+    {
+        if (!m_pipelining)
+        {
+            write(m_envelopeReplies == 1 ? "RCPT TO:<" + m_current.message.to + ">\r\n" : std::string("DATA\r\n"));
+        }
+        expectReply();
+        return;
+    }
+
+    if (!m_failCode)
+    {
+        m_state = SMTP_BODY;
+        write(formatMessage(m_current.message));
+        expectReply();
+        return;
+    }
+
+    int failCode = m_failCode;
+    std::string failReply = m_failReply;
+
+    // the server took DATA after all: no clean way to abandon the message
+    bool dataOpen = code / 100 == 3;
+    if (!dataOpen)
+    {
+        m_state = SMTP_RSET;
+    }
+
+    // before RSET goes out, as a failed write would finish it again
+    finish(false, failCode / 100 != 5, failReply);
+
+    if (dataOpen)
+    {
+        disconnect(std::string());
+    }
+    else
+    {
+        write("RSET\r\n");
+        expectReply();
+    }
+}
+
+// the current mail is done with: delivered, failed, or to be tried again
+void SmtpClient::finish(bool ok, bool temporary, const std::string& reply)
+{
+    Pending p = m_current;
+    m_busy = false;
+
+    unsigned ms;
+    if (!ok && temporary && m_retry.backoff(RETRY_TRANSIENT, ++p.attempts, &ms))
+    {
+        printf("Mail to %s failed (%s), trying again in %u ms\n", p.message.to.c_str(), reply.c_str(), ms);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queue.push_front(p);
+            m_retried++;
+        }
+        m_retryTimer = m_reactor.after(ms, [this]()
+        {
+            m_retryTimer = 0;
+            kick();
+        });
+        nextMessage();
+        return;
+    }
+
+    double latency = std::chrono::duration<double, std::milli>(Clock::now() - p.queued).count();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (ok)
+        {
+            m_delivered++;
+            m_totalMs += latency;
+            if (latency > m_maxMs)
+            {
+                m_maxMs = latency;
+            }
+        }
+        else
+        {
+            m_failed++;
+        }
+    }
+
+    if (!ok)
+    {
+        printf("Mail to %s not delivered: %s\n", p.message.to.c_str(), reply.c_str());
+    }
+    if (p.done)
+    {
+        p.done(ok, reply);
+    }
+
+    nextMessage();
+}
+
+// the connection is free: the next mail, or QUIT once it has been idle
+void SmtpClient::nextMessage()
+{
+    kick();
+
+    if (!m_busy && m_state == SMTP_READY && !m_idleTimer)
+    {
+        m_idleTimer = m_reactor.after(SMTP_IDLE_MS, std::bind(&SmtpClient::idleTimeout, this));
+    }
+
+    checkDrained();
+}
+
+void SmtpClient::idleTimeout()
+{
+    m_idleTimer = 0;
+
+    if (!m_busy && m_state == SMTP_READY)
+    {
+        m_state = SMTP_QUIT;
+        write("QUIT\r\n");
+        expectReply();
+    }
+}
+
+// closes the connection; why is what went wrong, if anything did
+void SmtpClient::disconnect(const std::string& why)
+{
+    if (m_replyTimer)
+    {
+        m_reactor.cancel(m_replyTimer);
+        m_replyTimer = 0;
+    }
+    if (m_idleTimer)
+    {
+        m_reactor.cancel(m_idleTimer);
+        m_idleTimer = 0;
+    }
+    if (m_fd >= 0)
+    {
+        m_reactor.unwatch(m_fd);
+        close(m_fd);
+        m_fd = -1;
+    }
+
+    m_state = SMTP_DISCONNECTED;
+    m_in.clear();
+    m_out.clear();
+    m_replyText.clear();
+
+    if (m_busy)
+    {
+        finish(false, true, why);
+    }
+    else
+    {
+        kick();
+    }
+}
+
+void SmtpClient::write(const std::string& data)
+{
+    m_out += data;
+    flush();
+}
+
+void SmtpClient::flush()
+{
+    while (!m_out.empty())
+    {
+        ssize_t n = ::send(m_fd, m_out.data(), m_out.size(), MSG_NOSIGNAL);
+        if (n > 0)
+        {
+            m_out.erase(0, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        disconnect("connection to " + m_host + " failed: " + strerror(errno));
+        return;
+    }
+
+    m_reactor.watch(m_fd, m_out.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT,
+                    std::bind(&SmtpClient::ready, this, std::placeholders::_1));
+}
+
+void SmtpClient::expectReply()
+{
+    if (m_fd < 0)
+    {
+        return;
+    }
+
+    if (m_replyTimer)
+    {
+        m_reactor.cancel(m_replyTimer);
+    }
+    m_replyTimer = m_reactor.after(SMTP_TIMEOUT_MS, [this]()
+    {
+        m_replyTimer = 0;
+        disconnect("no reply from " + m_host + " within " + std::to_string(SMTP_TIMEOUT_MS / 1000) + " s");
+    });
+}
+
+static void appendBase64(std::string& out, const std::vector<unsigned char>& data)
+{
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    // 57 bytes make one 76 character line
+    for (size_t i = 0; i < data.size(); i += 57)
+    {
+        size_t end = i + 57 < data.size() ? i + 57 : data.size();
+
+        for (size_t j = i; j < end; j += 3)
+        {
+            unsigned n = data[j] << 16;
+            if (j + 1 < end)
+            {
+                n |= data[j + 1] << 8;
+            }
+            if (j + 2 < end)
+            {
+                n |= data[j + 2];
+            }
+
+            out += digits[n >> 18];
+            out += digits[(n >> 12) & 63];
+            out += j + 1 < end ? digits[(n >> 6) & 63] : '=';
+            out += j + 2 < end ? digits[n & 63] : '=';
+        }
+        out += '\n';
+    }
+}
+
+std::string formatMail(const SmtpMessage& m)
+{
+    char date[64];
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    strftime(date, sizeof date, "%a, %d %b %Y %H:%M:%S %z", &tm);
+
+    std::string out = "From: " + m.from + "\nTo: " + m.to + "\nSubject: " + m.subject + "\nDate: " + date + "\n";
+    std::string body = m.body;
+    if (!body.empty() && body[body.size() - 1] != '\n')
+    {
+        body += '\n';
+    }
+
+    if (m.attachments.empty())
+    {
+        return out + "\n" + body;
+    }
+
+    // base64 and our own text never contain it
+    static unsigned long serial = 0;
+    char boundary[64];
+    snprintf(boundary, sizeof boundary, "=_camera_pi_%ld_%lu", (long)now, ++serial);
+
+    out += "MIME-Version: 1.0\nContent-Type: multipart/mixed; boundary=\"" + std::string(boundary) + "\"\n\n";
+    out += "--" + std::string(boundary) + "\nContent-Type: text/plain; charset=utf-8\n\n" + body;
+
+    for (size_t i = 0; i < m.attachments.size(); i++)
+    {
+        const SmtpAttachment& a = m.attachments[i];
+
+        out += "--" + std::string(boundary) + "\nContent-Type: " + a.type + "; name=\"" + a.name +
+               "\"\nContent-Transfer-Encoding: base64\nContent-Disposition: inline; filename=\"" + a.name + "\"\n\n";
+        if (a.data)
+        {
+            appendBase64(out, *a.data);
+        }
+    }
+    out += "--" + std::string(boundary) + "--\n";
+    return out;
+}
+
+// the message with CRLF line ends and leading dots doubled, then the
+// terminating "."
+std::string SmtpClient::formatMessage(const SmtpMessage& m) const
+{
+    std::string text = formatMail(m);
+    std::string out;
+    bool lineStart = true;
+
+    out.reserve(text.size() + text.size() / 32 + 8);
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        char c = text[i];
+
+        if (c == '\r')
+        {
+            continue;
+        }
+        if (c == '\n')
+        {
+            out += "\r\n";
+            lineStart = true;
+            continue;
+        }
+        if (lineStart && c == '.')
+        {
+            out += '.';
+        }
+        out += c;
+        lineStart = false;
+    }
+
+    if (!lineStart)
+    {
+        out += "\r\n";
+    }
+    out += ".\r\n";
+    return out;
+}
+
+void SmtpClient::printStats()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    printf("smtp %s:%u: %lu delivered, %lu failed, %lu retried, %zu queued, %lu connection(s), %lu on a reused connection, %lu pipelined",
+           m_host.c_str(), m_port, m_delivered, m_failed, m_retried, m_queue.size(), m_connections, m_reused, m_pipelined);
+    if (m_delivered)
+    {
+        printf(", queue to delivery avg %.0f ms max %.0f ms", m_totalMs / m_delivered, m_maxMs);
+    }
+    printf("\n");
+}
@@ -0,0 +1,167 @@
+#ifndef SMTP_H
+#define SMTP_H
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "reactor.h"
+#include "retry_policy.h"
+
+#define SMTP_PORT 25
+#define SMTP_TIMEOUT_MS 30000 // to connect, and for each reply
+#define SMTP_IDLE_MS 60000 // an idle connection is kept this long for the next mail
+#define SMTP_ATTEMPTS 3 // tries per mail when the failure is temporary
+
+// a file sent with the message, base64 encoded; the data is shared, not
+// copied, when one attachment goes to several recipients
+struct SmtpAttachment
+{
+    std::string name;
+    std::string type;   // e.g. "image/jpeg"
+    std::shared_ptr<const std::vector<unsigned char> > data;
+};
+
+struct SmtpMessage
+{
+    std::string from;
+    std::string to;
+    std::string subject;
+    std::string body;
+    std::vector<SmtpAttachment> attachments;
+};
+
+// the message as RFC 5322 text with "\n" line ends: headers, then the
+// body, as a MIME multipart if there are attachments
+std::string formatMail(const SmtpMessage& m);
+
+// whether the server accepted the mail, and its last reply (or what went
+// wrong on our side)
+typedef std::function<void(bool delivered, const std::string& reply)> SmtpDone;
+
+// Delivers mail to an SMTP server (normally the local MTA) from the
+// reactor, without blocking the caller or forking anything. One connection
+// is opened on demand and kept for SMTP_IDLE_MS after the last mail, so a
+// burst of notifications shares it. If the server announces PIPELINING,
+// the envelope (MAIL, RCPT, DATA) goes out in one write and costs one round
+// trip instead of three.
+//
+// Every connect and reply has a deadline of SMTP_TIMEOUT_MS. A mail that
+// fails temporarily (4xx replies, connection trouble) is tried again after
+// a backoff, up to SMTP_ATTEMPTS times; a 5xx reply fails it at once. Plain
+// SMTP only: no STARTTLS or AUTH, which a local relay does not need.
+//
+// send() and printStats() may be called from any thread; everything else
+// belongs on the reactor's thread.
+class SmtpClient
+{
+public:
+    SmtpClient(Reactor& reactor, const std::string& host = "localhost", unsigned short port = SMTP_PORT);
+    ~SmtpClient();
+
+    void start();
+
+    // drops the connection; mail not yet delivered is reported as failed
+    void stop();
+
+    // queues message; done (optional) runs on the reactor thread with the
+    // outcome. Failures are logged either way.
+    void send(const SmtpMessage& message, SmtpDone done = SmtpDone());
+
+    // calls done once no mail is queued or being sent, or after ms
+    // milliseconds with whatever is left failed
+    void drain(unsigned ms, Reactor::Task done);
+
+    void printStats();
+
+private:
+    SmtpClient(const SmtpClient&);
+    SmtpClient& operator=(const SmtpClient&);
+
+    enum State
+    {
+        SMTP_DISCONNECTED,
+        SMTP_CONNECTING,
+        SMTP_GREETING,
+        SMTP_EHLO,
+        SMTP_HELO,
+        SMTP_READY,
+        SMTP_ENVELOPE,      // MAIL, RCPT and DATA sent or being sent
+        SMTP_BODY,          // message sent, waiting for the verdict
+        SMTP_RSET,
+        SMTP_QUIT
+    };
+
+    struct Pending
+    {
+        SmtpMessage message;
+        SmtpDone done;
+        unsigned attempts;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    void kick();
+    void connect();
+    void ready(uint32_t events);
+    void readReplies();
+    void reply(int code, const std::string& text);
+    void startEnvelope();
+    void envelopeReply(int code, const std::string& text);
+    void finish(bool ok, bool temporary, const std::string& reply);
+    void disconnect(const std::string& why);
+    void write(const std::string& data);
+    void flush();
+    void expectReply();
+    void connected();
+    void nextMessage();
+    void idleTimeout();
+    void checkDrained();
+    std::string formatMessage(const SmtpMessage& m) const;
+
+    Reactor& m_reactor;
+    std::string m_host;
+    unsigned short m_port;
+    std::string m_helo;
+    int m_queueFd;
+
+    std::mutex m_mutex;
+    std::deque<Pending> m_queue;
+
+    // reactor thread only from here on
+    int m_fd;
+    unsigned long m_serial;
+    State m_state;
+    bool m_pipelining;
+    std::string m_in;
+    std::string m_out;
+    std::string m_replyText;
+
+    bool m_busy;
+    Pending m_current;
+    unsigned m_envelopeReplies;
+    int m_failCode;
+    std::string m_failReply;
+
+    unsigned long m_replyTimer;
+    unsigned long m_idleTimer;
+    unsigned long m_retryTimer;
+    unsigned long m_drainTimer;
+    Reactor::Task m_drainDone;
+    RetryPolicy m_retry;
+
+    // under m_mutex
+    unsigned long m_delivered;
+    unsigned long m_failed;
+    unsigned long m_retried;
+    unsigned long m_connections;
+    unsigned long m_reused;
+    unsigned long m_pipelined;
+    double m_totalMs;
+    double m_maxMs;
+};
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <stddef.h>
+
+// Bounded lock-free single-producer/single-consumer ring. push() may only be
+// called from one thread and pop() from one (other) thread; size() is safe
+// from anywhere but only approximate. The capacity is rounded up to a power
+// of two.
+template<typename T>
+class SpscRing
+{
+public:
+    explicit SpscRing(size_t capacity)
+    {
+        size_t n = 1;
+        while (n < capacity)
+        {
+            n <<= 1;
+        }
+
+        m_slots = new T[n];
+        m_mask = n - 1;
+        m_head.store(0, std::memory_order_relaxed);
+        m_tail.store(0, std::memory_order_relaxed);
+        m_cachedHead = 0;
+        m_cachedTail = 0;
+    }
+
+    ~SpscRing()
+    {
+        delete[] m_slots;
+    }
+
+    // producer: false if the ring is full
+    bool push(const T& v)
+    {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+
+        if (tail - m_cachedHead > m_mask)
+        {
+            m_cachedHead = m_head.load(std::memory_order_acquire);
+            if (tail - m_cachedHead > m_mask)
+            {
+                return false;
+            }
+        }
+
+        m_slots[tail & m_mask] = v;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer: false if the ring is empty
+    bool pop(T& v)
+    {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+
+        if (head == m_cachedTail)
+        {
+            m_cachedTail = m_tail.load(std::memory_order_acquire);
+            if (head == m_cachedTail)
+            {
+                return false;
+            }
+        }
+
+        v = m_slots[head & m_mask];
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t size() const
+    {
+        return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const
+    {
+        return m_mask + 1;
+    }
+
+private:
+    SpscRing(const SpscRing&);
+    SpscRing& operator=(const SpscRing&);
+
+    T* m_slots;
+    size_t m_mask;
+
+    // consumer-owned and producer-owned halves live on separate cache lines
+    char m_pad0[64];
+    std::atomic<size_t> m_head;
+    size_t m_cachedTail;
+    char m_pad1[64];
+    std::atomic<size_t> m_tail;
+    size_t m_cachedHead;
+    char m_pad2[64];
+};
+
+#endif
@@ -0,0 +1,157 @@
+#include "upload_scheduler.h"
+
+#include <stdio.h>
+#include <string.h>
+
+typedef std::chrono::steady_clock Clock;
+
+const char* uploadClassName(UploadClass c)
+{
+    switch (c)
+    {
+        case UPLOAD_URGENT:
+            return "urgent";
+        case UPLOAD_NORMAL:
+            return "normal";
+        case UPLOAD_BULK:
+            return "bulk";
+        default:
+            return "unknown";
+    }
+}
+
+UploadScheduler::UploadScheduler(unsigned slots, double bytesPerSecond)
+{
+    m_slots = slots > 0 ? slots : 1;
+    m_rate = bytesPerSecond > 0 ? bytesPerSecond : 0;
+    m_burst = m_rate * UPLOAD_BURST_SECONDS;
+    m_tokens = m_burst;
+    m_refilled = Clock::now();
+
+    memset(m_active, 0, sizeof(m_active));
+    m_activeTotal = 0;
+    memset(m_stats, 0, sizeof(m_stats));
+}
+
+void UploadScheduler::refill()
+{
+    Clock::time_point now = Clock::now();
+    double seconds = std::chrono::duration<double>(now - m_refilled).count();
+
+    m_refilled = now;
+    m_tokens += seconds * m_rate;
+    if (m_tokens > m_burst)
+    {
+        m_tokens = m_burst;
+    }
+}
+
+UploadClass UploadScheduler::next(const size_t waiting[UPLOAD_CLASSES])
+{
+    if (m_activeTotal >= m_slots)
+    {
+        return UPLOAD_CLASSES;
+    }
+
+    int c = 0;
+    while (c < UPLOAD_CLASSES && !waiting[c])
+    {
+        c++;
+    }
+    if (c == UPLOAD_CLASSES)
+    {
+        return UPLOAD_CLASSES;
+    }
+
+    // the backlog only uses the link while a fresh event does not
+    if (c == UPLOAD_BULK && m_active[UPLOAD_URGENT] + m_active[UPLOAD_NORMAL] > 0)
+    {
+        return UPLOAD_CLASSES;
+    }
+
+    if (m_rate > 0)
+    {
+        refill();
+        if (m_tokens < 0)
+        {
+            return UPLOAD_CLASSES;
+        }
+    }
+
+    return (UploadClass)c;
+}
+
+void UploadScheduler::started(UploadClass c, size_t bytes)
+{
+    if (m_rate > 0)
+    {
+        refill();
+        m_tokens -= bytes;
+    }
+
+    m_active[c]++;
+    m_activeTotal++;
+    m_stats[c].started++;
+}
+
+void UploadScheduler::finished(UploadClass c, bool ok)
+{
+    if (m_active[c] > 0)
+    {
+        m_active[c]--;
+        m_activeTotal--;
+    }
+
+    if (!ok)
+    {
+        m_stats[c].failed++;
+    }
+}
+
+void UploadScheduler::completed(UploadClass c, double bytes, double ms)
+{
+    ClassStats& s = m_stats[c];
+
+    s.completed++;
+    s.bytes += bytes;
+    s.ms += ms;
+}
+
+unsigned UploadScheduler::waitMs()
+{
+    if (m_rate <= 0)
+    {
+        return 0;
+    }
+
+    refill();
+    if (m_tokens >= 0)
+    {
+        return 0;
+    }
+
+    return (unsigned)(-m_tokens * 1000 / m_rate) + 1;
+}
+
+void UploadScheduler::printStats()
+{
+    printf("upload scheduler: %u/%u slot(s) busy", m_activeTotal, m_slots);
+    if (m_rate > 0)
+    {
+        printf(", limit %.0f KB/s, %.0f KB of tokens", m_rate / 1024, m_tokens / 1024);
+    }
+    printf("\n");
+
+    for (int c = 0; c < UPLOAD_CLASSES; c++)
+    {
+        const ClassStats& s = m_stats[c];
+
+        printf("  %-6s %u active, %lu started, %lu completed, %lu failed, %.1f MB", uploadClassName((UploadClass)c),
+               m_active[c], s.started, s.completed, s.failed, s.bytes / (1 << 20));
+        if (s.ms > 0)
+        {
+            printf(", %.1f KB/s", s.bytes / 1024 / (s.ms / 1000));
+        }
+        printf("\n");
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef UPLOAD_SCHEDULER_H
+#define UPLOAD_SCHEDULER_H
+
+#include <chrono>
+#include <stddef.h>
+
+#define UPLOAD_SLOTS 4 // default number of files uploading at once
+#define UPLOAD_BURST_SECONDS 2 // token bucket size, in seconds of the rate limit
+
+// what an upload is, from most to least urgent
+enum UploadClass
+{
+    UPLOAD_URGENT,      // small files of a fresh event (stills)
+    UPLOAD_NORMAL,      // the rest of a fresh event (clips, pre-event frames)
+    UPLOAD_BULK,        // backlog: left from a previous run, or retried
+    UPLOAD_CLASSES
+};
+
+const char* uploadClassName(UploadClass c);
+
+// Decides which queued upload starts next, on top of the MEGA transfer
+// queue: a fixed number of transfer slots, strict priority between the
+// classes, bulk uploads held back while anything fresher is waiting or in
+// flight, and a token bucket limiting the average upload rate.
+//
+// The SDK gives no control over the speed of a transfer once it runs, so
+// the bucket meters starts instead: a start takes the file's size in
+// tokens and may leave the bucket in debt, and nothing else starts until
+// the debt is paid back. Over a few files this holds the average to the
+// limit, while a single file still goes at line speed.
+//
+// Not thread-safe; UploaderService calls it under its own lock.
+class UploadScheduler
+{
+public:
+    // bytesPerSecond 0 for no limit
+    UploadScheduler(unsigned slots = UPLOAD_SLOTS, double bytesPerSecond = 0);
+
+    // the class to start next given how many uploads wait in each, or
+    // UPLOAD_CLASSES if nothing may start now
+    UploadClass next(const size_t waiting[UPLOAD_CLASSES]);
+
+    // a file of class c and size bytes took a slot, and gave it back
+    void started(UploadClass c, size_t bytes);
+    void finished(UploadClass c, bool ok);
+
+    // the transfer of bytes took ms, for the per-class throughput
+    void completed(UploadClass c, double bytes, double ms);
+
+    // when next() is held back by the rate limit, ms until it no longer is;
+    // 0 otherwise
+    unsigned waitMs();
+
+    void printStats();
+
+private:
+    void refill();
+
+    unsigned m_slots;
+    double m_rate;
+    double m_burst;
+    double m_tokens;
+    std::chrono::steady_clock::time_point m_refilled;
+
+    unsigned m_active[UPLOAD_CLASSES];
+    unsigned m_activeTotal;
+
+    struct ClassStats
+    {
+        unsigned long started;
+        unsigned long completed;
+        unsigned long failed;
+        double bytes;
+        double ms;
+    };
+
+    ClassStats m_stats[UPLOAD_CLASSES];
+};
+
+#endif
@@ -0,0 +1,467 @@
+#include "upload_spool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+UploadSpool::UploadSpool(const std::string& dir)
+{
+    m_dir = dir;
+    m_journalPath = dir + "/journal";
+    m_journal = -1;
+    m_dirty = false;
+    m_nextId = 1;
+    m_doneSinceCompact = 0;
+    m_added = 0;
+    m_completed = 0;
+    m_dropped = 0;
+    m_syncs = 0;
+    m_compactions = 0;
+    m_errors = 0;
+}
+
+UploadSpool::~UploadSpool()
+{
+    if (m_journal >= 0)
+    {
+        sync();
+        close(m_journal);
+    }
+}
+
+std::string UploadSpool::payloadPath(unsigned long id) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%010lu", id);
+    return m_dir + name;
+}
+
+static bool write_all(int fd, const void* data, size_t size)
+{
+    const char* p = (const char*)data;
+
+    while (size > 0)
+    {
+        ssize_t n = write(fd, p, size);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static bool sync_path(const std::string& path, int flags)
+{
+    int fd = ::open(path.c_str(), flags | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+bool UploadSpool::open()
+{
+    if (mkdir(m_dir.c_str(), 0755) < 0 && errno != EEXIST)
+    {
+        printf("upload spool: cannot create %s: %s\n", m_dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (!replay() || !compact())
+    {
+        return false;
+    }
+
+    for (std::map<unsigned long, SpoolEntry>::iterator it = m_pending.begin(); it != m_pending.end(); ++it)
+    {
+        m_recovered.push_back(it->second);
+    }
+
+    if (!m_recovered.empty())
+    {
+        printf("upload spool: %zu upload(s) pending from a previous run\n", m_recovered.size());
+    }
+
+    return true;
+}
+
+bool UploadSpool::replay()
+{
+    FILE* fp = fopen(m_journalPath.c_str(), "r");
+    if (!fp)
+    {
+        return errno == ENOENT;
+    }
+
+    char line[4096];
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        size_t len = strlen(line);
+
+        // a torn last record, from a crash mid-append
+        if (len == 0 || line[len - 1] != '\n')
+        {
+            break;
+        }
+        line[len - 1] = 0;
+
+        char type = line[0];
+        char* p = line + 1;
+        char* end;
+        unsigned long id = strtoul(p, &end, 10);
+        if (end == p || id == 0)
+        {
+            continue;
+        }
+        p = end;
+
+        if (id >= m_nextId)
+        {
+            m_nextId = id + 1;
+        }
+
+        if (type == 'D')
+        {
+            m_pending.erase(id);
+            continue;
+        }
+
+        SpoolEntry e;
+        e.id = id;
+        e.size = 0;
+
+        if (type == 'A')
+        {
+            e.size = strtoul(p, &end, 10);
+            if (end == p || *end != ' ')
+            {
+                continue;
+            }
+            e.name = end + 1;
+            e.file = payloadPath(id);
+        }
+        else if (type == 'P' && *p == ' ')
+        {
+            e.name = p + 1;
+        }
+        else
+        {
+            continue;
+        }
+
+        m_pending[id] = e;
+    }
+
+    fclose(fp);
+
+    // spooled bytes that did not reach the disk whole are lost
+    for (std::map<unsigned long, SpoolEntry>::iterator it = m_pending.begin(); it != m_pending.end();)
+    {
+        struct stat st;
+
+        if (!it->second.file.empty() &&
+            (stat(it->second.file.c_str(), &st) < 0 || (size_t)st.st_size != it->second.size))
+        {
+            printf("upload spool: dropping %s, its spooled copy is incomplete\n", it->second.name.c_str());
+            unlink(it->second.file.c_str());
+            m_pending.erase(it++);
+            m_dropped++;
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    return true;
+}
+
+bool UploadSpool::compact()
+{
+    // called with the mutex held, after the payloads have been synced
+    std::string tmp = m_journalPath + ".new";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        printf("upload spool: cannot write %s: %s\n", tmp.c_str(), strerror(errno));
+        m_errors++;
+        return false;
+    }
+
+    std::string records;
+    char head[64];
+
+    for (std::map<unsigned long, SpoolEntry>::iterator it = m_pending.begin(); it != m_pending.end(); ++it)
+    {
+        const SpoolEntry& e = it->second;
+
+        if (e.file.empty())
+        {
+            snprintf(head, sizeof(head), "P%lu ", e.id);
+        }
+        else
+        {
+            snprintf(head, sizeof(head), "A%lu %zu ", e.id, e.size);
+        }
+        records += head;
+        records += e.name;
+        records += '\n';
+    }
+
+    bool ok = write_all(fd, records.data(), records.size()) && fsync(fd) == 0;
+    close(fd);
+
+    if (!ok || rename(tmp.c_str(), m_journalPath.c_str()) < 0 || !syncDir())
+    {
+        printf("upload spool: cannot rewrite %s: %s\n", m_journalPath.c_str(), strerror(errno));
+        unlink(tmp.c_str());
+        m_errors++;
+        return false;
+    }
+
+    if (m_journal >= 0)
+    {
+        close(m_journal);
+    }
+    m_journal = ::open(m_journalPath.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (m_journal < 0)
+    {
+        printf("upload spool: cannot open %s: %s\n", m_journalPath.c_str(), strerror(errno));
+        m_errors++;
+        return false;
+    }
+
+    m_doneSinceCompact = 0;
+    m_compactions++;
+    return true;
+}
+
+bool UploadSpool::syncDir()
+{
+    return sync_path(m_dir, O_RDONLY | O_DIRECTORY);
+}
+
+bool UploadSpool::append(const std::string& record)
+{
+    // called with the mutex held
+    if (m_journal < 0 || !write_all(m_journal, record.data(), record.size()))
+    {
+        m_errors++;
+        return false;
+    }
+
+    m_dirty = true;
+    return true;
+}
+
+const std::vector<SpoolEntry>& UploadSpool::recovered() const
+{
+    return m_recovered;
+}
+
+unsigned long UploadSpool::add(const std::string& name, const std::vector<unsigned char>& data)
+{
+    unsigned long id;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        id = m_nextId++;
+    }
+
+    // the copy is written outside the lock; only the record is serialised
+    std::string file = payloadPath(id);
+    int fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = fd >= 0 && write_all(fd, data.data(), data.size());
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (!ok)
+    {
+        printf("upload spool: cannot write %s: %s\n", file.c_str(), strerror(errno));
+        unlink(file.c_str());
+        m_errors++;
+        return 0;
+    }
+
+    char head[64];
+    snprintf(head, sizeof(head), "A%lu %zu ", id, data.size());
+    if (!append(head + name + "\n"))
+    {
+        unlink(file.c_str());
+        return 0;
+    }
+
+    SpoolEntry& e = m_pending[id];
+    e.id = id;
+    e.name = name;
+    e.file = file;
+    e.size = data.size();
+    m_unsynced.push_back(file);
+    m_added++;
+    return id;
+}
+
+unsigned long UploadSpool::addPath(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    unsigned long id = m_nextId++;
+
+    char head[32];
+    snprintf(head, sizeof(head), "P%lu ", id);
+    if (!append(head + path + "\n"))
+    {
+        return 0;
+    }
+
+    SpoolEntry& e = m_pending[id];
+    e.id = id;
+    e.name = path;
+    e.size = 0;
+    m_added++;
+    return id;
+}
+
+void UploadSpool::done(unsigned long id)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::map<unsigned long, SpoolEntry>::iterator it = m_pending.find(id);
+    if (it == m_pending.end())
+    {
+        return;
+    }
+
+    char record[32];
+    snprintf(record, sizeof(record), "D%lu\n", id);
+    append(record);
+
+    // if this reaches the disk before the record does, replay drops the
+    // entry as incomplete, which is what it is done with anyway
+    if (!it->second.file.empty())
+    {
+        unlink(it->second.file.c_str());
+    }
+
+    m_pending.erase(it);
+    m_completed++;
+    m_doneSinceCompact++;
+}
+
+bool UploadSpool::entry(unsigned long id, SpoolEntry* e)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::map<unsigned long, SpoolEntry>::iterator it = m_pending.find(id);
+    if (it == m_pending.end())
+    {
+        return false;
+    }
+
+    *e = it->second;
+    return true;
+}
+
+bool UploadSpool::load(const SpoolEntry& e, std::vector<unsigned char>& data)
+{
+    FILE* fp = fopen(e.file.c_str(), "rb");
+    if (!fp)
+    {
+        return false;
+    }
+
+    data.resize(e.size);
+    bool ok = fread(data.data(), 1, e.size, fp) == e.size;
+    fclose(fp);
+    return ok;
+}
+
+bool UploadSpool::dirty()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_dirty;
+}
+
+void UploadSpool::sync()
+{
+    std::vector<std::string> files;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_dirty)
+        {
+            return;
+        }
+        m_dirty = false;
+        files.swap(m_unsynced);
+    }
+
+    // payloads first, then their directory entries, then the journal that
+    // names them; a payload deleted by done() in between is skipped
+    bool ok = true;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        if (!sync_path(files[i], O_RDONLY) && errno != ENOENT)
+        {
+            ok = false;
+        }
+    }
+
+    if (!files.empty() && !syncDir())
+    {
+        ok = false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_journal >= 0 && fdatasync(m_journal) < 0)
+    {
+        ok = false;
+    }
+
+    if (!ok)
+    {
+        printf("upload spool: sync failed: %s\n", strerror(errno));
+        m_errors++;
+    }
+    m_syncs++;
+
+    if (m_doneSinceCompact >= SPOOL_COMPACT_RECORDS && m_doneSinceCompact > m_pending.size())
+    {
+        compact();
+    }
+}
+
+size_t UploadSpool::pending()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_pending.size();
+}
+
+void UploadSpool::printStats()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    printf("upload spool: %zu pending (%zu from the previous run), added %lu, completed %lu, dropped %lu, %lu sync(s), %lu compaction(s), %lu error(s)\n",
+           m_pending.size(), m_recovered.size(), m_added, m_completed, m_dropped, m_syncs, m_compactions, m_errors);
+}
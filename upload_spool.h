@@ -0,0 +1,101 @@
+#ifndef UPLOAD_SPOOL_H
+#define UPLOAD_SPOOL_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define SPOOL_COMPACT_RECORDS 1000 // completed records before the journal is rewritten
+
+struct SpoolEntry
+{
+    unsigned long id;
+
+    // the upload's name (spooled bytes) or local path (a file upload)
+    std::string name;
+
+    // where the spooled bytes are, empty for a file upload
+    std::string file;
+    size_t size;
+};
+
+// Crash-safe record of the uploads not yet finished, so that neither a
+// restart nor a long uplink outage loses an event. Uploads are appended to
+// a journal in the spool directory ("A" for bytes, whose payload is copied
+// next to it, "P" for a local file) and marked done ("D") when they
+// complete; open() replays the journal instead of scanning the directory,
+// so thousands of queued uploads cost one sequential read.
+//
+// Writes are group-committed: add() and done() only append, and sync()
+// flushes the new payloads, the directory and then the journal with one
+// fsync each, so an entry is durable after the next sync(). A payload that
+// did not make it to disk intact is dropped on replay (the journal records
+// its size). The journal is rewritten with just the pending entries once
+// SPOOL_COMPACT_RECORDS uploads have completed since the last rewrite.
+//
+// All methods may be called from any thread.
+class UploadSpool
+{
+public:
+    explicit UploadSpool(const std::string& dir);
+    ~UploadSpool();
+
+    // creates the directory, replays and compacts the journal; the uploads
+    // still pending are then listed by recovered()
+    bool open();
+
+    // oldest first
+    const std::vector<SpoolEntry>& recovered() const;
+
+    // record a pending upload; 0 if it could not be recorded
+    unsigned long add(const std::string& name, const std::vector<unsigned char>& data);
+    unsigned long addPath(const std::string& path);
+
+    // the upload completed: forget it and delete its payload
+    void done(unsigned long id);
+
+    // a pending entry by id; false if it is not (or no longer) pending
+    bool entry(unsigned long id, SpoolEntry* e);
+
+    // reads the spooled bytes of e back
+    bool load(const SpoolEntry& e, std::vector<unsigned char>& data);
+
+    // something was appended since the last sync()
+    bool dirty();
+    void sync();
+
+    size_t pending();
+    void printStats();
+
+private:
+    UploadSpool(const UploadSpool&);
+    UploadSpool& operator=(const UploadSpool&);
+
+    bool replay();
+    bool compact();
+    bool append(const std::string& record);
+    bool syncDir();
+    std::string payloadPath(unsigned long id) const;
+
+    std::string m_dir;
+    std::string m_journalPath;
+    int m_journal;
+
+    std::mutex m_mutex;
+    std::map<unsigned long, SpoolEntry> m_pending;
+    std::vector<SpoolEntry> m_recovered;
+    std::vector<std::string> m_unsynced;
+    bool m_dirty;
+    unsigned long m_nextId;
+    unsigned long m_doneSinceCompact;
+
+    unsigned long m_added;
+    unsigned long m_completed;
+    unsigned long m_dropped;
+    unsigned long m_syncs;
+    unsigned long m_compactions;
+    unsigned long m_errors;
+};
+
+#endif